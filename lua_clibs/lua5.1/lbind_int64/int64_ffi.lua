@@ -0,0 +1,191 @@
+-- int64 for LuaJIT: the same interface as the int64 C module, with values
+-- as an int64_t in a small struct, which carries the module's metamethods
+-- (division by zero raises, tostring has no LL suffix). The JIT sinks these
+-- boxes inside traces, so arithmetic in loops doesn't allocate. Without ffi
+-- this is just the C module.
+
+local ok, ffi = pcall(require, "ffi")
+if not ok then
+	return require "int64"
+end
+
+local bit = require "bit"
+
+ffi.cdef [[
+unsigned long long strtoull(const char *s, char **endptr, int base);
+]]
+
+local int64_t = ffi.typeof("int64_t")
+local endptr = ffi.new("char *[1]")
+local int64 = {}
+local int64_ct, acc_t
+
+-- the int64_t value of a number, an int64 or an accumulator, or nil
+local function tovalue(v)
+	if type(v) == "number" then
+		return int64_t(v < 0 and math.ceil(v) or math.floor(v))
+	end
+	if ffi.istype(int64_ct, v) or ffi.istype(acc_t, v) then
+		return v.v
+	end
+	if ffi.istype(int64_t, v) then
+		return v
+	end
+end
+
+-- an int64 or an accumulator, the only values the C module's __eq sees
+local function isboxed(v)
+	return ffi.istype(int64_ct, v) or ffi.istype(acc_t, v)
+end
+
+local function toint64(v)
+	local n = tovalue(v)
+	if n == nil then
+		error("argument error type " .. type(v), 3)
+	end
+	return n
+end
+
+local function str2int64(s, base)
+	local u = ffi.C.strtoull(s, endptr, base)
+	local rest = ffi.string(endptr[0])
+	if #rest == #s or not rest:match("^%s*$") then
+		error(string.format("The string(%s) is not a valid number string", s), 3)
+	end
+	return int64_ct(ffi.cast(int64_t, u))
+end
+
+function int64.new(v, base)
+	if v == nil then
+		return int64_ct(0)
+	end
+	if base ~= nil then
+		if base < 2 then
+			error("base must be >= 2", 2)
+		end
+		return str2int64(tostring(v), base)
+	end
+	if type(v) == "string" then
+		return str2int64(v, 10)
+	end
+	return int64_ct(toint64(v))
+end
+
+local shifts = { [2] = 1, [8] = 3, [16] = 4 }
+
+function int64.tostring(v, base)
+	v = toint64(v)
+	if base == nil then
+		return (tostring(v):gsub("LL$", ""))
+	end
+	local shift = shifts[base]
+	if shift == nil then
+		local hex = bit.tohex(v, 16):gsub("^0+", "")
+		return "0x" .. (hex == "" and "0" or hex)
+	end
+	local digits = {}
+	local mask = bit.lshift(1, shift) - 1
+	for i = 0, 64 - shift, shift do
+		digits[#digits + 1] = string.format("%x", tonumber(bit.band(bit.rshift(v, 64 - shift - i), mask)))
+	end
+	return table.concat(digits)
+end
+
+local function div(a, b)
+	if b == 0 then
+		error("div by zero", 3)
+	end
+	return a / b
+end
+
+local function mod(a, b)
+	if b == 0 then
+		error("mod by zero", 3)
+	end
+	return a % b
+end
+
+local function pow(a, b)
+	if b < 0 then
+		error(string.format("pow by negative number %d", tonumber(b)), 3)
+	end
+	local p = int64_t(1)
+	while b > 0 do
+		if b % 2 == 1 then
+			p = p * a
+		end
+		a = a * a
+		b = b / 2
+	end
+	return p
+end
+
+-- int64 values and accumulators share the operators; an accumulator reads
+-- as its current value and the results are new int64 values
+local function operators(mt)
+	function mt.__add(a, b) return int64_ct(toint64(a) + toint64(b)) end
+	function mt.__sub(a, b) return int64_ct(toint64(a) - toint64(b)) end
+	function mt.__mul(a, b) return int64_ct(toint64(a) * toint64(b)) end
+	function mt.__div(a, b) return int64_ct(div(toint64(a), toint64(b))) end
+	function mt.__mod(a, b) return int64_ct(mod(toint64(a), toint64(b))) end
+	function mt.__pow(a, b) return int64_ct(pow(toint64(a), toint64(b))) end
+	function mt.__unm(a) return int64_ct(-a.v) end
+	function mt.__lt(a, b) return toint64(a) < toint64(b) end
+	function mt.__le(a, b) return toint64(a) <= toint64(b) end
+	function mt.__len(a) return tonumber(a.v) end
+	-- LuaJIT calls __eq for cdata compared with anything, Lua only for two
+	-- userdata; as with the C module, an int64 never equals a number
+	function mt.__eq(a, b)
+		return isboxed(a) and isboxed(b) and a.v == b.v
+	end
+	function mt.__tostring(a) return int64.tostring(a.v) end
+	return mt
+end
+
+int64_ct = ffi.metatype("struct { int64_t v; }", operators {})
+
+-- int64.acc(v): a mutable int64 whose methods update it in place and return it
+local acc = operators {}
+acc.__index = acc
+
+function acc:set(v)
+	self.v = toint64(v)
+	return self
+end
+
+function acc:add(v)
+	self.v = self.v + toint64(v)
+	return self
+end
+
+function acc:sub(v)
+	self.v = self.v - toint64(v)
+	return self
+end
+
+function acc:mul(v)
+	self.v = self.v * toint64(v)
+	return self
+end
+
+function acc:div(v)
+	self.v = div(self.v, toint64(v))
+	return self
+end
+
+function acc:mod(v)
+	self.v = mod(self.v, toint64(v))
+	return self
+end
+
+function acc:get()
+	return int64_ct(self.v)
+end
+
+acc_t = ffi.metatype("struct { int64_t v; }", acc)
+
+function int64.acc(v)
+	return acc_t(v == nil and 0 or toint64(v))
+end
+
+return int64
@@ -1,26 +1,30 @@
 #include "lbind_int64.h"
 
-#include <lualib.h>   
+#include <lualib.h>   
 #include <lauxlib.h>
 #include <math.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <string.h>
 
 #if LUA_VERSION_NUM < 502
 
 static int s_lua_ridx_int64_mt = LUA_NOREF;
+static int s_lua_ridx_int64_acc_mt = LUA_NOREF;
+
+/* an int64, or an accumulator, which works as an int64 operand anywhere */
+bool
+lbind_int64_isint64(lua_State* L, int idx) {
+	if (lua_getmetatable(L, idx)) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, s_lua_ridx_int64_mt);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, s_lua_ridx_int64_acc_mt);
+		int equal = lua_rawequal(L, -2, -3) || lua_rawequal(L, -1, -3);
+		lua_pop(L, 3);
+		return equal;
+	}
 
-bool
-lbind_int64_isint64(lua_State* L, int idx) {
-	if (lua_getmetatable(L, idx)) {
-		lua_rawgeti(L, LUA_REGISTRYINDEX, s_lua_ridx_int64_mt);
-		int equal = lua_rawequal(L, -1, -2);
-		lua_pop(L, 2);
-		return equal;
-	}
-
-	return false;
+	return false;
 }
 
 int64_t
@@ -52,55 +56,105 @@ lbind_int64_toint64(lua_State *L, int idx) {
 
 void
 lbind_int64_pushint64(lua_State *L, int64_t n) {
-	int64_t *p = (int64_t*)lua_newuserdata(L, sizeof(int64_t));
-	*p = n;
-	lua_rawgeti(L, LUA_REGISTRYINDEX, s_lua_ridx_int64_mt);
+	int64_t *p = (int64_t*)lua_newuserdata(L, sizeof(int64_t));
+	*p = n;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, s_lua_ridx_int64_mt);
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * Every function below is a closure over the int64 metatable (upvalue 1),
+ * the accumulator metatable (upvalue 2) and the array metatable (upvalue 3),
+ * so operand checks and results don't go through the registry.
+ */
+#define INT64_MT lua_upvalueindex(1)
+#define INT64_ACC_MT lua_upvalueindex(2)
+#define INT64_ARRAY_MT lua_upvalueindex(3)
+#define INT64_UPVALUES 3
+
+/* int64 or accumulator userdata at idx, NULL for anything else */
+static int64_t *
+__toint64p(lua_State *L, int idx) {
+	int64_t *p = (int64_t *)lua_touserdata(L, idx);
+	if (p && lua_getmetatable(L, idx)) {
+		int ok = lua_rawequal(L, -1, INT64_MT) || lua_rawequal(L, -1, INT64_ACC_MT);
+		lua_pop(L, 1);
+		return ok ? p : NULL;
+	}
+	return NULL;
+}
+
+static int64_t
+__toint64(lua_State *L, int idx) {
+	int64_t *p;
+	int type = lua_type(L, idx);
+	switch (type) {
+	case LUA_TNUMBER:
+		return (int64_t)lua_tonumber(L, idx);
+
+	case LUA_TUSERDATA:
+		p = __toint64p(L, idx);
+		if (p == NULL) {
+			return luaL_error(L, "The userdata is not an int64 userdata");
+		}
+		return *p;
+
+	default:
+		return luaL_error(L, "argument %d error type %s", idx, lua_typename(L, type));
+	}
+}
+
+static void
+__pushint64(lua_State *L, int64_t n) {
+	int64_t *p = (int64_t*)lua_newuserdata(L, sizeof(int64_t));
+	*p = n;
+	lua_pushvalue(L, INT64_MT);
 	lua_setmetatable(L, -2);
 }
 
 static int
 __int64_add(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
-	lbind_int64_pushint64(L, a + b);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
+	__pushint64(L, a + b);
 	return 1;
 }
 
 static int
 __int64_sub(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
-	lbind_int64_pushint64(L, a - b);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
+	__pushint64(L, a - b);
 	return 1;
 }
 
 static int
 __int64_mul(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
-	lbind_int64_pushint64(L, a * b);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
+	__pushint64(L, a * b);
 	return 1;
 }
 
 static int
 __int64_div(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 	if (b == 0) {
 		return luaL_error(L, "div by zero");
 	}
-	lbind_int64_pushint64(L, a / b);
+	__pushint64(L, a / b);
 	return 1;
 }
 
 static int
 __int64_mod(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 	if (b == 0) {
 		return luaL_error(L, "mod by zero");
 	}
-	lbind_int64_pushint64(L, a % b);
+	__pushint64(L, a % b);
 	return 1;
 }
 
@@ -120,8 +174,8 @@ __pow64(int64_t a, int64_t b) {
 
 static int
 __int64_pow(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 	int64_t p;
 	if (b > 0) {
 		p = __pow64(a, b);
@@ -132,37 +186,37 @@ __int64_pow(lua_State *L) {
 	else {
 		return luaL_error(L, "pow by negative number %d", (int)b);
 	}
-	lbind_int64_pushint64(L, p);
+	__pushint64(L, p);
 	return 1;
 }
 
 static int
 __int64_unm(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	lbind_int64_pushint64(L, -a);
+	int64_t a = __toint64(L, 1);
+	__pushint64(L, -a);
 	return 1;
 }
 
-static bool
-__str2uint64(const char *s, int base, uint64_t *result) {
-	char *endptr;
-	*result = strtoull(s, &endptr, base);
-	if (endptr == s) {
-		return false;
-	}
-
-	if (*endptr == '\0') {
-		return true;
-	}
-
-	while (isspace((unsigned char)*endptr)) endptr++;
-	return *endptr == '\0';
+static bool
+__str2uint64(const char *s, int base, uint64_t *result) {
+	char *endptr;
+	*result = strtoull(s, &endptr, base);
+	if (endptr == s) {
+		return false;
+	}
+
+	if (*endptr == '\0') {
+		return true;
+	}
+
+	while (isspace((unsigned char)*endptr)) endptr++;
+	return *endptr == '\0';
 }
 
 static int
 __int64_eq(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 // 	printf("%s %s\n", lua_typename(L, 1), lua_typename(L, 2));
 // 	printf("%lld %lld\n", a, b);
 	lua_pushboolean(L, a == b);
@@ -171,35 +225,35 @@ __int64_eq(lua_State *L) {
 
 static int
 __int64_lt(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 	lua_pushboolean(L, a < b);
 	return 1;
 }
 
 static int
 __int64_le(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
-	int64_t b = lbind_int64_toint64(L, 2);
+	int64_t a = __toint64(L, 1);
+	int64_t b = __toint64(L, 2);
 	lua_pushboolean(L, a <= b);
 	return 1;
 }
 
 static int
 __int64_len(lua_State *L) {
-	int64_t a = lbind_int64_toint64(L, 1);
+	int64_t a = __toint64(L, 1);
 	lua_pushnumber(L, (lua_Number)a);
 	return 1;
 }
 
 static int
 __int64_new(lua_State *L) {
-	int64_t n = (int64_t)0;
-
-	int top = lua_gettop(L);
+	int64_t n = (int64_t)0;
+
+	int top = lua_gettop(L);
 	switch (top) {
 	case 0: {
-		lbind_int64_pushint64(L, (int64_t)0);
+		__pushint64(L, (int64_t)0);
 		break;
 	}
 
@@ -209,19 +263,19 @@ __int64_new(lua_State *L) {
 		case LUA_TNUMBER: {
 			lua_Number d = luaL_checknumber(L, 1);
 			n = (int64_t)d;
-			lbind_int64_pushint64(L, n);
+			__pushint64(L, n);
 			break;
 		}
 
 		case LUA_TSTRING: {
 			uint64_t u64 = (uint64_t)0;
-			size_t len = 0;
-			const uint8_t *str = (const uint8_t *)lua_tolstring(L, 1, &len);
-			if (!__str2uint64(str, 10, &u64)) {
-				return luaL_error(L, "The string(%s) is not a valid number string", str);
-			}
+			size_t len = 0;
+			const uint8_t *str = (const uint8_t *)lua_tolstring(L, 1, &len);
+			if (!__str2uint64(str, 10, &u64)) {
+				return luaL_error(L, "The string(%s) is not a valid number string", str);
+			}
 			n = (int64_t)u64;
-			lbind_int64_pushint64(L, n);
+			__pushint64(L, n);
 			break;
 		}
 
@@ -233,19 +287,19 @@ __int64_new(lua_State *L) {
 
 	default:
 		uint64_t u64 = (uint64_t)0;
-		size_t len = 0;
+		size_t len = 0;
 		const uint8_t *str = (const uint8_t *)lua_tolstring(L, 1, &len);
 		int base = (int)luaL_checkinteger(L, 2);
 		if (base < 2) {
 			luaL_error(L, "base must be >= 2");
 			base = 10;
 		}
-
-		if (!__str2uint64(str, base, &u64)) {
-			return luaL_error(L, "The string(%s) is not a valid number string", str);
-		}
+
+		if (!__str2uint64(str, base, &u64)) {
+			return luaL_error(L, "The string(%s) is not a valid number string", str);
+		}
 		n = (int64_t)u64;
-		lbind_int64_pushint64(L, n);
+		__pushint64(L, n);
 		break;
 	}
 	return 1;
@@ -262,7 +316,7 @@ __tostring(lua_State *L) {
 		int i;
 
 		// decimal, 10
-		int64_t dec = lbind_int64_toint64(L, 1);
+		int64_t dec = __toint64(L, 1);
 
 		luaL_Buffer b;
 		luaL_buffinit(L, &b);
@@ -288,7 +342,7 @@ __tostring(lua_State *L) {
 	}
 
 	case 2: {
-		int64_t n = lbind_int64_toint64(L, 1);
+		int64_t n = __toint64(L, 1);
 		int base = (int)luaL_checkinteger(L, 2);
 
 		char buffer[64];
@@ -355,41 +409,432 @@ __tostring(lua_State *L) {
 	return 1;
 }
 
+static int64_t *
+__checkacc(lua_State *L) {
+	int64_t *p = (int64_t *)lua_touserdata(L, 1);
+	if (p && lua_getmetatable(L, 1)) {
+		int ok = lua_rawequal(L, -1, INT64_ACC_MT);
+		lua_pop(L, 1);
+		if (ok) {
+			return p;
+		}
+	}
+	luaL_typerror(L, 1, "int64 accumulator");
+	return NULL;
+}
+
+static int
+__acc_new(lua_State *L) {
+	int64_t n = lua_isnoneornil(L, 1) ? 0 : __toint64(L, 1);
+	int64_t *p = (int64_t*)lua_newuserdata(L, sizeof(int64_t));
+	*p = n;
+	lua_pushvalue(L, INT64_ACC_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+__acc_set(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	*p = __toint64(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_add(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	*p += __toint64(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_sub(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	*p -= __toint64(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_mul(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	*p *= __toint64(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_div(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	int64_t b = __toint64(L, 2);
+	if (b == 0) {
+		return luaL_error(L, "div by zero");
+	}
+	*p /= b;
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_mod(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	int64_t b = __toint64(L, 2);
+	if (b == 0) {
+		return luaL_error(L, "mod by zero");
+	}
+	*p %= b;
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+__acc_get(lua_State *L) {
+	int64_t *p = __checkacc(L);
+	__pushint64(L, *p);
+	return 1;
+}
+
+/* int64.array: a fixed number of int64_t in one block */
+struct int64_array {
+	size_t n;
+	int64_t a[1];
+};
+
+static struct int64_array *
+__checkarray(lua_State *L) {
+	struct int64_array *arr = (struct int64_array *)lua_touserdata(L, 1);
+	if (arr && lua_getmetatable(L, 1)) {
+		int ok = lua_rawequal(L, -1, INT64_ARRAY_MT);
+		lua_pop(L, 1);
+		if (ok) {
+			return arr;
+		}
+	}
+	luaL_typerror(L, 1, "int64 array");
+	return NULL;
+}
+
+static struct int64_array *
+__newarray(lua_State *L, size_t n) {
+	struct int64_array *arr;
+	if (n > ((size_t)-1 - sizeof(struct int64_array)) / sizeof(int64_t)) {
+		luaL_error(L, "array size %f is too large", (double)n);
+	}
+	arr = (struct int64_array *)lua_newuserdata(L, sizeof(struct int64_array) + (n > 0 ? n - 1 : 0) * sizeof(int64_t));
+	arr->n = n;
+	lua_pushvalue(L, INT64_ARRAY_MT);
+	lua_setmetatable(L, -2);
+	return arr;
+}
+
+/* 1-based index at idx as an offset into arr */
+static size_t
+__checkindex(lua_State *L, struct int64_array *arr, int idx) {
+	lua_Number i = luaL_checknumber(L, idx);
+	if (!(i >= 1 && i <= (lua_Number)arr->n)) {
+		luaL_error(L, "index %f out of range [1, %f]", (double)i, (double)arr->n);
+	}
+	return (size_t)i - 1;
+}
+
+/* optional 1-based range [i, j] at idx, idx + 1 as [*lo, *hi) */
+static void
+__checkrange(lua_State *L, struct int64_array *arr, int idx, size_t *lo, size_t *hi) {
+	lua_Number i = luaL_optnumber(L, idx, 1);
+	lua_Number j = luaL_optnumber(L, idx + 1, (lua_Number)arr->n);
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > (lua_Number)arr->n) {
+		j = (lua_Number)arr->n;
+	}
+	*lo = (size_t)i - 1;
+	*hi = j >= i ? (size_t)j : *lo;
+}
+
+/* int64.array(n | s): n zeros, or the int64s packed little-endian in s */
+static int
+__array_new(lua_State *L) {
+	struct int64_array *arr;
+	size_t n, i;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		size_t len;
+		const uint8_t *s = (const uint8_t *)lua_tolstring(L, 1, &len);
+		if (len % sizeof(int64_t) != 0) {
+			return luaL_error(L, "packed string length %d is not a multiple of 8", (int)len);
+		}
+		n = len / sizeof(int64_t);
+		arr = __newarray(L, n);
+		for (i = 0; i < n; ++i, s += 8) {
+			arr->a[i] = (int64_t)((uint64_t)s[0] | (uint64_t)s[1] << 8 | (uint64_t)s[2] << 16 | (uint64_t)s[3] << 24 |
+				(uint64_t)s[4] << 32 | (uint64_t)s[5] << 40 | (uint64_t)s[6] << 48 | (uint64_t)s[7] << 56);
+		}
+		return 1;
+	}
+	n = (size_t)luaL_checknumber(L, 1);
+	arr = __newarray(L, n);
+	memset(arr->a, 0, n * sizeof(int64_t));
+	return 1;
+}
+
+static int
+__array_get(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	__pushint64(L, arr->a[__checkindex(L, arr, 2)]);
+	return 1;
+}
+
+static int
+__array_set(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	arr->a[__checkindex(L, arr, 2)] = __toint64(L, 3);
+	return 0;
+}
+
+static int
+__array_index(lua_State *L) {
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		return __array_get(L);
+	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, INT64_ARRAY_MT);
+	return 1;
+}
+
+static int
+__array_len(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	lua_pushnumber(L, (lua_Number)arr->n);
+	return 1;
+}
+
+static int
+__cmp_asc(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+__cmp_desc(const void *a, const void *b) {
+	return __cmp_asc(b, a);
+}
+
+/* arr:sort([desc]) */
+static int
+__array_sort(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	qsort(arr->a, arr->n, sizeof(int64_t), lua_toboolean(L, 2) ? __cmp_desc : __cmp_asc);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* arr:search(v) on an ascending array: index of v, or nil and where v would go */
+static int
+__array_search(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	int64_t v = __toint64(L, 2);
+	size_t lo = 0, hi = arr->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (arr->a[mid] < v) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo < arr->n && arr->a[lo] == v) {
+		lua_pushnumber(L, (lua_Number)(lo + 1));
+		return 1;
+	}
+	lua_pushnil(L);
+	lua_pushnumber(L, (lua_Number)(lo + 1));
+	return 2;
+}
+
+/* arr:sum([i, [j]]) */
+static int
+__array_sum(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	size_t lo, hi, k;
+	int64_t sum = 0;
+	__checkrange(L, arr, 2, &lo, &hi);
+	for (k = lo; k < hi; ++k) {
+		sum += arr->a[k];
+	}
+	__pushint64(L, sum);
+	return 1;
+}
+
+static int
+__array_minmax(lua_State *L, int max) {
+	struct int64_array *arr = __checkarray(L);
+	size_t lo, hi, k, best;
+	__checkrange(L, arr, 2, &lo, &hi);
+	if (lo >= hi) {
+		return 0;
+	}
+	best = lo;
+	for (k = lo + 1; k < hi; ++k) {
+		if (max ? arr->a[k] > arr->a[best] : arr->a[k] < arr->a[best]) {
+			best = k;
+		}
+	}
+	__pushint64(L, arr->a[best]);
+	lua_pushnumber(L, (lua_Number)(best + 1));
+	return 2;
+}
+
+/* arr:min([i, [j]]) -> value, index; nothing for an empty range */
+static int
+__array_min(lua_State *L) {
+	return __array_minmax(L, 0);
+}
+
+/* arr:max([i, [j]]) -> value, index; nothing for an empty range */
+static int
+__array_max(lua_State *L) {
+	return __array_minmax(L, 1);
+}
+
+/* arr:pack([i, [j]]): the elements as little-endian bytes, see int64.array(s) */
+static int
+__array_pack(lua_State *L) {
+	struct int64_array *arr = __checkarray(L);
+	size_t lo, hi, k;
+	luaL_Buffer b;
+	__checkrange(L, arr, 2, &lo, &hi);
+	luaL_buffinit(L, &b);
+	for (k = lo; k < hi; ++k) {
+		uint64_t u = (uint64_t)arr->a[k];
+		char bytes[8];
+		int i;
+		for (i = 0; i < 8; ++i) {
+			bytes[i] = (char)(u >> (i * 8));
+		}
+		luaL_addlstring(&b, bytes, 8);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static luaL_Reg mt_[] = {
+	{ "__add", __int64_add },
+	{ "__sub", __int64_sub },
+	{ "__mul", __int64_mul },
+	{ "__div", __int64_div },
+	{ "__mod", __int64_mod },
+	{ "__unm", __int64_unm },
+	{ "__pow", __int64_pow },
+	{ "__eq", __int64_eq },
+	{ "__lt", __int64_lt },
+	{ "__le", __int64_le },
+	{ "__len", __int64_len },
+	{ "__tostring", __tostring },
+	{ NULL, NULL },
+};
+
+static luaL_Reg acc_[] = {
+	{ "set", __acc_set },
+	{ "add", __acc_add },
+	{ "sub", __acc_sub },
+	{ "mul", __acc_mul },
+	{ "div", __acc_div },
+	{ "mod", __acc_mod },
+	{ "get", __acc_get },
+	{ NULL, NULL },
+};
+
+static luaL_Reg array_[] = {
+	{ "get", __array_get },
+	{ "set", __array_set },
+	{ "sort", __array_sort },
+	{ "search", __array_search },
+	{ "sum", __array_sum },
+	{ "min", __array_min },
+	{ "max", __array_max },
+	{ "pack", __array_pack },
+	{ "__index", __array_index },
+	{ "__newindex", __array_set },
+	{ "__len", __array_len },
+	{ NULL, NULL },
+};
+
+/* push f as a closure over the metatables at mts, mts + 1, ... */
+static void
+__pushclosure(lua_State *L, lua_CFunction f, int mts) {
+	int i;
+	for (i = 0; i < INT64_UPVALUES; ++i) {
+		lua_pushvalue(L, mts + i);
+	}
+	lua_pushcclosure(L, f, INT64_UPVALUES);
+}
+
+static void
+__setfuncs(lua_State *L, int idx, int mts, const luaL_Reg *l) {
+	for (; l->name; ++l) {
+		__pushclosure(L, l->func, mts);
+		lua_setfield(L, idx, l->name);
+	}
+}
+
 static void
 __make_mt(lua_State *L) {
-	luaL_Reg mt_[] = {
-		{ "__add", __int64_add },
-		{ "__sub", __int64_sub },
-		{ "__mul", __int64_mul },
-		{ "__div", __int64_div },
-		{ "__mod", __int64_mod },
-		{ "__unm", __int64_unm },
-		{ "__pow", __int64_pow },
-		{ "__eq", __int64_eq },
-		{ "__lt", __int64_lt },
-		{ "__le", __int64_le },
-		{ "__len", __int64_len },
-		{ "__tostring", __tostring },
+	luaL_Reg none_[] = {
 		{ NULL, NULL },
 	};
-	luaL_register(L, "lbind_int64_mt", mt_);
+	int mt, acc_mt, array_mt;
+	const luaL_Reg *l;
+
+	luaL_register(L, "lbind_int64_mt", none_);
+	mt = lua_gettop(L);
+	lua_newtable(L);
+	acc_mt = lua_gettop(L);
+	lua_newtable(L);
+	array_mt = lua_gettop(L);
+
+	/* one closure per metamethod, shared by both metatables so that __eq
+	   and the comparisons apply between an int64 and an accumulator */
+	for (l = mt_; l->name; ++l) {
+		__pushclosure(L, l->func, mt);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, mt, l->name);
+		lua_setfield(L, acc_mt, l->name);
+	}
+	__setfuncs(L, acc_mt, mt, acc_);
+	lua_pushvalue(L, acc_mt);
+	lua_setfield(L, acc_mt, "__index");
+	__setfuncs(L, array_mt, mt, array_);
 }
 
 static luaL_Reg lib_[] = {
 	{ "new", __int64_new },
 	{ "tostring", __tostring },
+	{ "acc", __acc_new },
+	{ "array", __array_new },
 	{ NULL, NULL },
 };
 
 int
 luaopen_int64(lua_State *L) {
-
+	luaL_Reg none_[] = {
+		{ NULL, NULL },
+	};
 	int top = lua_gettop(L);
 
 	__make_mt(L);
+	lua_pushvalue(L, top + 1);
 	s_lua_ridx_int64_mt = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, top + 2);
+	s_lua_ridx_int64_acc_mt = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	luaL_register(L, "int64", lib_);
+	luaL_register(L, "int64", none_);
+	__setfuncs(L, lua_gettop(L), top + 1, lib_);
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
 
 	assert(1 == lua_gettop(L) - top);
 	return 1;
@@ -1,10 +1,535 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "memory_stream.h"
 
+#define LCUTIL_STREAM "lcutil.memory_stream"
+
+/*
+ * A memory_stream over either a Lua string (a reader, which never copies
+ * it) or a growable buffer allocated through the Lua allocator (a writer).
+ * The userdata's environment table keeps the string, or the strings a
+ * writer holds by reference, alive.
+ */
+typedef struct lcutil_stream_s
+{
+	memory_stream_t ms;
+} lcutil_stream_t;
+
+#if LUA_VERSION_NUM >= 503
+#define lcutil_pushint64(L, v) lua_pushinteger(L, (lua_Integer)(v))
+#define lcutil_checkint64(L, i) ((int64_t)luaL_checkinteger(L, i))
+#else
+/* exact up to 2^53 */
+#define lcutil_pushint64(L, v) lua_pushnumber(L, (lua_Number)(v))
+#define lcutil_checkint64(L, i) ((int64_t)luaL_checknumber(L, i))
+#endif
+
+static lcutil_stream_t *
+check_stream(lua_State *L)
+{
+	return (lcutil_stream_t *)luaL_checkudata(L, 1, LCUTIL_STREAM);
+}
+
+static void
+check_readable(lua_State *L, lcutil_stream_t *s, int n)
+{
+	int used = memory_stream_get_used_size(&s->ms);
+	/* not used + n, which can overflow */
+	if (n < 0 || n > s->ms.end - used)
+		luaL_error(L, "read of %d bytes at %d overruns the stream (%d bytes)",
+			n, used, s->ms.end);
+}
+
+/* make room for n more bytes at the cursor */
+static void
+check_writable(lua_State *L, lcutil_stream_t *s, int n)
+{
+	if (!s->ms.growable)
+		luaL_error(L, "memory_stream over a string is read-only");
+	if (memory_stream_reserve(&s->ms, n) != 0)
+		luaL_error(L, "not enough memory for %d more bytes", n);
+}
+
+static void
+set_anchors(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM < 502
+	lua_setfenv(L, idx);
+#else
+	lua_setuservalue(L, idx);
+#endif
+}
+
+static lcutil_stream_t *
+new_stream(lua_State *L)
+{
+	lcutil_stream_t *s = (lcutil_stream_t *)lua_newuserdata(L, sizeof(lcutil_stream_t));
+	memset(s, 0, sizeof(lcutil_stream_t));
+	luaL_getmetatable(L, LCUTIL_STREAM);
+	lua_setmetatable(L, -2);
+	return s;
+}
+
+/* lcutil.reader(s [, pos]): read s in place from byte offset pos (0) */
+static int
+lcutil_reader(lua_State *L)
+{
+	size_t len;
+	const char *str = luaL_checklstring(L, 1, &len);
+	int pos = (int)luaL_optinteger(L, 2, 0);
+	lcutil_stream_t *s;
+	luaL_argcheck(L, len <= INT_MAX, 1, "string too long");
+	luaL_argcheck(L, pos >= 0 && (size_t)pos <= len, 2, "offset out of range");
+	s = new_stream(L);
+	s->ms.buffer = (char *)str;
+	s->ms.cursor = s->ms.buffer + pos;
+	s->ms.size = (int)len;
+	s->ms.end = (int)len;
+
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	set_anchors(L, -2);
+	return 1;
+}
+
+/* lcutil.writer([size]): an empty stream with room for size bytes */
+static int
+lcutil_writer(lua_State *L)
+{
+	int size = (int)luaL_optinteger(L, 1, 0);
+	lcutil_stream_t *s = new_stream(L);
+	void *ud;
+	lua_Alloc alloc = lua_getallocf(L, &ud);
+	init_growable_memory_stream(&s->ms, (memory_stream_alloc_t)alloc, ud);
+	lua_newtable(L);
+	set_anchors(L, -2);
+	if (size > 0)
+		check_writable(L, s, size);
+	return 1;
+}
+
+static int
+stream_gc(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	release_memory_stream(&s->ms);
+	return 0;
+}
+
+/* stream:endian("little" | "big" | "native") */
+static int
+stream_endian(lua_State *L)
+{
+	static const char *const names[] = { "native", "little", "big", NULL };
+	static const int endians[] = { MEMORY_STREAM_NATIVE, MEMORY_STREAM_LITTLE, MEMORY_STREAM_BIG };
+	lcutil_stream_t *s = check_stream(L);
+	memory_stream_set_endian(&s->ms, endians[luaL_checkoption(L, 2, NULL, names)]);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_tell(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	lua_pushinteger(L, memory_stream_get_used_size(&s->ms));
+	return 1;
+}
+
+/*
+ * stream:seek(pos), pos a byte offset into the stream's own bytes, as tell
+ * returns it. Strings written by reference take no room there, so a header
+ * reserved before write_ref can still be sought back to and patched.
+ */
+static int
+stream_seek(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int pos = (int)luaL_checkinteger(L, 2);
+	luaL_argcheck(L, pos >= 0 && pos <= s->ms.end, 2, "offset out of range");
+	memory_stream_seek(&s->ms, pos);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_skip(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int n = (int)luaL_checkinteger(L, 2);
+	check_readable(L, s, n);
+	memory_stream_skip(&s->ms, n);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* bytes left to read */
+static int
+stream_remaining(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	lua_pushinteger(L, s->ms.end - memory_stream_get_used_size(&s->ms));
+	return 1;
+}
+
+static int
+stream_len(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	lua_pushinteger(L, memory_stream_get_length(&s->ms));
+	return 1;
+}
+
+/* stream:tostring(): everything written, or the whole string read */
+static int
+stream_tostring(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	luaL_Buffer b;
+	int i;
+	if (s->ms.nsegs == 0)
+	{
+		lua_pushlstring(L, s->ms.buffer ? s->ms.buffer : "", s->ms.end);
+		return 1;
+	}
+	luaL_buffinit(L, &b);
+	for (i = 0; i < s->ms.nsegs; ++i)
+	{
+		const memory_stream_segment_t *seg = &s->ms.segs[i];
+		luaL_addlstring(&b, seg->base ? seg->base : s->ms.buffer + seg->offset, seg->len);
+	}
+	luaL_addlstring(&b, s->ms.buffer + s->ms.mark, s->ms.end - s->ms.mark);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/* stream:reset(): rewind; a writer also forgets what it holds */
+static int
+stream_reset(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	reset_memory_stream(&s->ms);
+	if (s->ms.growable)
+	{
+		lua_newtable(L);
+		set_anchors(L, 1);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* stream:flush(fd [, offset]): writev everything from offset (0) to a socket fd */
+static int
+stream_flush(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	intptr_t fd = (intptr_t)luaL_checknumber(L, 2);
+	int offset = (int)luaL_optinteger(L, 3, 0);
+	int sent;
+	luaL_argcheck(L, offset >= 0, 3, "offset out of range");
+	sent = memory_stream_writev(&s->ms, fd, offset);
+	if (sent < 0)
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "writev failed");
+		return 2;
+	}
+	lua_pushinteger(L, sent);
+	return 1;
+}
+
+static int
+stream_read_byte(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	check_readable(L, s, 1);
+	/* 0..255, matching what write_byte takes */
+	lua_pushinteger(L, (unsigned char)memory_stream_read_byte(&s->ms));
+	return 1;
+}
+
+static int
+stream_read_int16(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	check_readable(L, s, 2);
+	lua_pushinteger(L, memory_stream_read_int16(&s->ms));
+	return 1;
+}
+
+static int
+stream_read_int32(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	check_readable(L, s, 4);
+	lua_pushnumber(L, (lua_Number)memory_stream_read_int32(&s->ms));
+	return 1;
+}
+
+static int
+stream_read_int64(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	check_readable(L, s, 8);
+	lcutil_pushint64(L, memory_stream_read_int64(&s->ms));
+	return 1;
+}
+
+/* int16 length, then the bytes */
+static int
+stream_read_string(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int16_t len;
+	const char *p;
+	check_readable(L, s, 2);
+	len = memory_stream_read_int16(&s->ms);
+	if (len < 0)
+		return luaL_error(L, "bad string length %d", len);
+	check_readable(L, s, len);
+	p = s->ms.cursor;
+	memory_stream_skip(&s->ms, len);
+	lua_pushlstring(L, p, len);
+	return 1;
+}
+
+/* int32 length, then the bytes */
+static int
+stream_read_long_string(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int32_t len;
+	const char *p;
+	check_readable(L, s, 4);
+	len = memory_stream_read_int32(&s->ms);
+	if (len < 0)
+		return luaL_error(L, "bad string length %d", (int)len);
+	check_readable(L, s, len);
+	p = s->ms.cursor;
+	memory_stream_skip(&s->ms, len);
+	lua_pushlstring(L, p, len);
+	return 1;
+}
+
+static int
+stream_read_bytes(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int n = (int)luaL_checkinteger(L, 2);
+	check_readable(L, s, n);
+	lua_pushlstring(L, s->ms.cursor, n);
+	memory_stream_skip(&s->ms, n);
+	return 1;
+}
+
+static int
+stream_write_byte(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int d = (int)luaL_checkinteger(L, 2);
+	check_writable(L, s, 1);
+	memory_stream_write_byte(&s->ms, (unsigned char)d);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_int16(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int d = (int)luaL_checkinteger(L, 2);
+	check_writable(L, s, 2);
+	memory_stream_write_int16(&s->ms, (int16_t)d);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_int32(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int64_t d = lcutil_checkint64(L, 2);
+	check_writable(L, s, 4);
+	memory_stream_write_int32(&s->ms, (int32_t)d);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_int64(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int64_t d = lcutil_checkint64(L, 2);
+	check_writable(L, s, 8);
+	memory_stream_write_int64(&s->ms, d);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_string(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	luaL_argcheck(L, len <= INT16_MAX, 2, "string longer than 32767 bytes");
+	check_writable(L, s, 2 + (int)len);
+	memory_stream_write_string(&s->ms, str, (int16_t)len);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_long_string(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	luaL_argcheck(L, len <= INT_MAX - 4, 2, "string too long");
+	check_writable(L, s, 4 + (int)len);
+	memory_stream_write_long_string(&s->ms, str, (int32_t)len);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* stream:write_ref(s): append s by reference, without copying it */
+static int
+stream_write_ref(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	luaL_argcheck(L, len <= INT_MAX, 2, "string too long");
+	if (!s->ms.growable)
+		return luaL_error(L, "memory_stream over a string is read-only");
+	if (memory_stream_write_ref(&s->ms, str, (int)len) != 0)
+		return luaL_error(L, "not enough memory");
+#if LUA_VERSION_NUM < 502
+	lua_getfenv(L, 1);
+#else
+	lua_getuservalue(L, 1);
+#endif
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+stream_write_bytes(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	luaL_argcheck(L, len <= INT_MAX, 2, "string too long");
+	check_writable(L, s, (int)len);
+	memory_stream_write_buffer(&s->ms, (unsigned char *)str, (int)len);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static const char *const array_types[] = { "int8", "int16", "int32", "int64", NULL };
+static const int array_sizes[] = { 1, 2, 4, 8 };
+
+/* stream:read_array(type, n [, t]): n values into t[1..n] (a new table) */
+static int
+stream_read_array(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int type = luaL_checkoption(L, 2, NULL, array_types);
+	int n = (int)luaL_checkinteger(L, 3);
+	int i;
+	luaL_argcheck(L, n >= 0 && n <= INT_MAX / array_sizes[type], 3, "bad count");
+	check_readable(L, s, n * array_sizes[type]);
+	if (lua_istable(L, 4))
+		lua_settop(L, 4);
+	else
+		lua_createtable(L, n, 0);
+	for (i = 1; i <= n; ++i)
+	{
+		switch (type)
+		{
+		case 0: lua_pushinteger(L, memory_stream_read_byte(&s->ms)); break;
+		case 1: lua_pushinteger(L, memory_stream_read_int16(&s->ms)); break;
+		case 2: lua_pushnumber(L, (lua_Number)memory_stream_read_int32(&s->ms)); break;
+		default: lcutil_pushint64(L, memory_stream_read_int64(&s->ms)); break;
+		}
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
+}
+
+/* stream:write_array(type, t [, i [, j]]): t[i..j], by default all of t */
+static int
+stream_write_array(lua_State *L)
+{
+	lcutil_stream_t *s = check_stream(L);
+	int type = luaL_checkoption(L, 2, NULL, array_types);
+	int i, j;
+	luaL_checktype(L, 3, LUA_TTABLE);
+	i = (int)luaL_optinteger(L, 4, 1);
+	j = (int)luaL_optinteger(L, 5, (lua_Integer)lua_objlen(L, 3));
+	if (i <= j)
+	{
+		luaL_argcheck(L, j - i < INT_MAX / 8, 5, "too many values");
+		check_writable(L, s, (j - i + 1) * array_sizes[type]);
+	}
+	for (; i <= j; ++i)
+	{
+		lua_rawgeti(L, 3, i);
+		switch (type)
+		{
+		case 0: memory_stream_write_byte(&s->ms, (unsigned char)luaL_checkinteger(L, -1)); break;
+		case 1: memory_stream_write_int16(&s->ms, (int16_t)luaL_checkinteger(L, -1)); break;
+		case 2: memory_stream_write_int32(&s->ms, (int32_t)lcutil_checkint64(L, -1)); break;
+		default: memory_stream_write_int64(&s->ms, lcutil_checkint64(L, -1)); break;
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static const struct luaL_Reg _lua_c_utility_stream[] = {
+	{ "endian", stream_endian },
+	{ "tell", stream_tell },
+	{ "seek", stream_seek },
+	{ "skip", stream_skip },
+	{ "remaining", stream_remaining },
+	{ "tostring", stream_tostring },
+	{ "reset", stream_reset },
+	{ "flush", stream_flush },
+	{ "read_byte", stream_read_byte },
+	{ "read_int16", stream_read_int16 },
+	{ "read_int32", stream_read_int32 },
+	{ "read_int64", stream_read_int64 },
+	{ "read_string", stream_read_string },
+	{ "read_long_string", stream_read_long_string },
+	{ "read_bytes", stream_read_bytes },
+	{ "read_array", stream_read_array },
+	{ "write_byte", stream_write_byte },
+	{ "write_int16", stream_write_int16 },
+	{ "write_int32", stream_write_int32 },
+	{ "write_int64", stream_write_int64 },
+	{ "write_string", stream_write_string },
+	{ "write_long_string", stream_write_long_string },
+	{ "write_ref", stream_write_ref },
+	{ "write_bytes", stream_write_bytes },
+	{ "write_array", stream_write_array },
+	{ "__len", stream_len },
+	{ "__gc", stream_gc },
+	{ NULL, NULL }
+};
+
 static const struct luaL_Reg _lua_c_utility[] = {
+	{ "reader", lcutil_reader },
+	{ "writer", lcutil_writer },
 	{ NULL, NULL }
 };
 
@@ -12,7 +537,17 @@ LUALIB_API int
 luaopen_lcutil(lua_State *L)
 {
 	int top = lua_gettop(L);
-	
+
+	luaL_newmetatable(L, LCUTIL_STREAM);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+	luaL_register(L, NULL, _lua_c_utility_stream);
+#else
+	luaL_setfuncs(L, _lua_c_utility_stream, 0);
+#endif
+	lua_pop(L, 1);
+
 #if LUA_VERSION_NUM < 502
 	luaL_register(L, "lcutil", _lua_c_utility);
 #else
@@ -21,4 +556,4 @@ luaopen_lcutil(lua_State *L)
 
 	assert(1 == lua_gettop(L) - top);
 	return 1;
-}
\ No newline at end of file
+}
@@ -18,11 +18,16 @@ PB_NS_BEGIN
 #define PB_STATE     "pb.State"
 #define PB_BUFFER    "pb.Buffer"
 #define PB_SLICE     "pb.Slice"
+#define PB_VIEW      "pb.View"
+#define PB_STREAM    "pb.Stream"
 
 #define check_buffer(L,idx) ((pb_Buffer*)luaL_checkudata(L,idx,PB_BUFFER))
 #define test_buffer(L,idx)  ((pb_Buffer*)luaL_testudata(L,idx,PB_BUFFER))
 #define check_slice(L,idx)  ((lpb_SliceEx*)luaL_checkudata(L,idx,PB_SLICE))
 #define test_slice(L,idx)   ((lpb_SliceEx*)luaL_testudata(L,idx,PB_SLICE))
+#define check_view(L,idx)   ((lpb_View*)luaL_checkudata(L,idx,PB_VIEW))
+#define test_view(L,idx)    ((lpb_View*)luaL_testudata(L,idx,PB_VIEW))
+#define check_stream(L,idx) ((lpb_Stream*)luaL_checkudata(L,idx,PB_STREAM))
 #define return_self(L) { lua_settop(L, 1); return 1; }
 
 #if LUA_VERSION_NUM < 502
@@ -30,6 +35,8 @@ PB_NS_BEGIN
 
 # define LUA_OK        0
 # define lua_rawlen    lua_objlen
+# define lua_getuservalue lua_getfenv
+# define lua_setuservalue lua_setfenv
 # define luaL_setfuncs(L,l,n) (assert(n==0), luaL_register(L,NULL,l))
 # define luaL_setmetatable(L, name) \
     (luaL_getmetatable((L), (name)), lua_setmetatable(L, -2))
@@ -117,14 +124,20 @@ static const char state_name[] = PB_STATE;
 
 enum lpb_Int64Mode { LPB_NUMBER, LPB_STRING, LPB_HEXSTRING };
 enum lpb_DefMode   { LPB_DEFDEF, LPB_COPYDEF, LPB_METADEF, LPB_NODEF };
+enum lpb_EncMode   { LPB_TABLEORDER, LPB_FIELDORDER };
 
 typedef struct lpb_State {
     pb_State  base;
     pb_Buffer buffer;
+    pb_Buffer sizes; /* nested lengths measured by encode_presize */
     int defs_index;
+    int plans_index;
+    int epoch; /* bumped when all types are freed, see lpb_View */
     unsigned enum_as_value : 1;
     unsigned default_mode  : 2; /* lpb_DefMode */
     unsigned int64_mode    : 2; /* lpb_Int64Mode */
+    unsigned encode_mode   : 1; /* lpb_EncMode */
+    unsigned encode_presize : 1;
 } lpb_State;
 
 static void lpb_pushdeftable(lua_State *L, lpb_State *LS) {
@@ -137,12 +150,31 @@ static void lpb_pushdeftable(lua_State *L, lpb_State *LS) {
     }
 }
 
+/* encode plans by type, see lpb_Plan */
+static void lpb_pushplantable(lua_State *L, lpb_State *LS) {
+    if (LS->plans_index != LUA_NOREF)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LS->plans_index);
+    else {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        LS->plans_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+/* plans hold pb_Field pointers, drop them whenever the schema changes */
+static void lpb_clearplans(lua_State *L, lpb_State *LS) {
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->plans_index);
+    LS->plans_index = LUA_NOREF;
+}
+
 static int Lpb_delete(lua_State *L) {
     lpb_State *LS = (lpb_State*)luaL_testudata(L, 1, PB_STATE);
     if (LS != NULL) {
         pb_free(&LS->base);
         pb_resetbuffer(&LS->buffer);
+        pb_resetbuffer(&LS->sizes);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
+        lpb_clearplans(L, LS);
     }
     return 0;
 }
@@ -157,8 +189,10 @@ static lpb_State *default_lstate(lua_State *L) {
         LS = (lpb_State*)lua_newuserdata(L, sizeof(lpb_State));
         memset(LS, 0, sizeof(lpb_State));
         LS->defs_index = LUA_NOREF;
+        LS->plans_index = LUA_NOREF;
         pb_init(&LS->base);
         pb_initbuffer(&LS->buffer);
+        pb_initbuffer(&LS->sizes);
         luaL_setmetatable(L, PB_STATE);
         lua_rawsetp(L, LUA_REGISTRYINDEX, state_name);
     }
@@ -189,6 +223,25 @@ typedef struct lpb_SliceEx {
     const char *head;
 } lpb_SliceEx;
 
+typedef struct lpb_ViewEntry {
+    uint32_t    tag;
+    const char *start; /* the tag */
+    const char *value;
+    const char *end;
+} lpb_ViewEntry;
+
+/* a message left encoded in a string, indexed on first access */
+typedef struct lpb_View {
+    lpb_State     *LS;
+    int            epoch;
+    pb_Type       *type;
+    pb_Slice       data;
+    lpb_ViewEntry *entries;
+    int            count;
+    int            size;
+    int            indexed;
+} lpb_View;
+
 static int lpb_offset(lpb_SliceEx *s) { return (int)(s->base.p-s->head) + 1; }
 
 static lpb_SliceEx lpb_initext(pb_Slice s)
@@ -241,6 +294,10 @@ static pb_Slice lpb_toslice(lua_State *L, int idx) {
             ret = pb_result(buffer);
         else if ((s = test_slice(L, idx)) != NULL)
             ret = s->base;
+        else {
+            lpb_View *v = test_view(L, idx);
+            if (v != NULL) ret = v->data;
+        }
     }
     return ret;
 }
@@ -1133,15 +1190,16 @@ static pb_Field *lpb_checkfield(lua_State *L, int idx, pb_Type *t) {
 }
 
 static int Lpb_load(lua_State *L) {
-    pb_State *S = default_state(L);
+    lpb_State *LS = default_lstate(L);
     lpb_SliceEx s = lpb_initext(lpb_checkslice(L, 1));
-    lua_pushboolean(L, pb_load(S, &s.base) == PB_OK);
+    lpb_clearplans(L, LS);
+    lua_pushboolean(L, pb_load(&LS->base, &s.base) == PB_OK);
     lua_pushinteger(L, lpb_offset(&s));
     return 2;
 }
 
 static int Lpb_loadfile(lua_State *L) {
-    pb_State *S = default_state(L);
+    lpb_State *LS = default_lstate(L);
     const char *filename = luaL_checkstring(L, 1);
     size_t size;
     pb_Buffer b;
@@ -1159,13 +1217,29 @@ static int Lpb_loadfile(lua_State *L) {
     } while (size == BUFSIZ);
     fclose(fp);
     s = lpb_initext(pb_result(&b));
-    ret = pb_load(S, &s.base);
+    lpb_clearplans(L, LS);
+    ret = pb_load(&LS->base, &s.base);
     pb_resetbuffer(&b);
     lua_pushboolean(L, ret == PB_OK);
     lua_pushinteger(L, lpb_offset(&s));
     return 2;
 }
 
+static int Lpb_snapshot(lua_State *L) {
+    lpb_State *LS = default_lstate(L);
+    pb_Buffer *b = test_buffer(L, 1);
+    if (b == NULL) pb_resetbuffer(b = &LS->buffer);
+    if (pb_dump(&LS->base, b) != PB_OK)
+        return luaL_error(L, "out of memory");
+    if (b != &LS->buffer)
+        lua_settop(L, 1);
+    else {
+        lua_pushlstring(L, b->buff, b->size);
+        pb_resetbuffer(b);
+    }
+    return 1;
+}
+
 static int lpb_pushtype(lua_State *L, pb_Type *t) {
     if (t == NULL) return 0;
     lua_pushstring(L, (char*)t->name);
@@ -1341,8 +1415,10 @@ static int Lpb_clear(lua_State *L) {
     lpb_State *LS = default_lstate(L);
     pb_State *S = &LS->base;
     pb_Type *t;
+    lpb_clearplans(L, LS);
     if (lua_isnoneornil(L, 1)) {
         pb_free(S), pb_init(S);
+        ++LS->epoch;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         LS->defs_index = LUA_NOREF;
         return 0;
@@ -1357,30 +1433,194 @@ static int Lpb_clear(lua_State *L) {
 
 /* protobuf encode */
 
+enum lpb_EncPass { LPB_ONEPASS, LPB_SIZING, LPB_WRITING };
+
 typedef struct lpb_Env {
     lua_State *L;
     lpb_State *LS;
     pb_Buffer *b;
     lpb_SliceEx *s;
+    int plans;    /* stack index of the plan table */
+    int pass;     /* lpb_EncPass */
+    size_t extra; /* sizing: bytes of nested messages already measured */
+    size_t next;  /* writing: offset of the next length in LS->sizes */
 } lpb_Env;
 
+/* a length delimited value being encoded, see lpbE_beginlen */
+typedef struct lpb_Len {
+    size_t base;
+    size_t extra;
+    size_t slot;
+} lpb_Len;
+
 static void lpb_encode (lpb_Env *e, pb_Type *t);
 
+/* encode plans: the fields of a type, keyed by the address of their interned
+ * Lua name strings, which the plan's environment keeps alive */
+
+typedef struct lpb_PlanSlot {
+    const char *name;
+    pb_Field   *field;
+} lpb_PlanSlot;
+
+typedef struct lpb_Plan {
+    unsigned mask;           /* slot count - 1 */
+    int      nfields;        /* fields by number follow the slots */
+    lpb_PlanSlot slots[1];
+} lpb_Plan;
+
+#define lpb_planfields(p) ((pb_Field**)&(p)->slots[(p)->mask + 1])
+
+static unsigned lpb_ptrhash(const char *p)
+{ return (unsigned)(((size_t)p >> 3) * 2654435761u); }
+
+static int lpb_fieldcmp(const void *lhs, const void *rhs) {
+    int32_t l = (*(pb_Field* const*)lhs)->number;
+    int32_t r = (*(pb_Field* const*)rhs)->number;
+    return l < r ? -1 : l > r;
+}
+
+static lpb_Plan *lpb_newplan(lua_State *L, pb_Type *t) {
+    pb_Field *f = NULL, **fields;
+    pb_FieldEntry *fe = NULL;
+    unsigned size = 4;
+    int i, nnames = 0, n = 0;
+    lpb_Plan *p;
+    while (pb_nextfield(t, &f)) ++n;
+    while (t != NULL && pb_nextentry(&t->field_names, (pb_Entry**)&fe))
+        if (fe->value != NULL) ++nnames;
+    while (size < (unsigned)nnames * 2) size <<= 1;
+    p = (lpb_Plan*)lua_newuserdata(L, sizeof(lpb_Plan)
+            + (size - 1) * sizeof(lpb_PlanSlot) + n * sizeof(pb_Field*));
+    memset(p, 0, sizeof(lpb_Plan) + (size - 1) * sizeof(lpb_PlanSlot));
+    p->mask = size - 1;
+    p->nfields = n;
+    fields = lpb_planfields(p);
+    for (i = 0; pb_nextfield(t, &f); ++i)
+        fields[i] = f;
+    qsort(fields, n, sizeof(pb_Field*), lpb_fieldcmp);
+    /* env: [i] = name of the ith field by number, then every name */
+    lua_createtable(L, n + nnames, 0);
+    for (i = 0; i < n; ++i) {
+        lua_pushstring(L, (char*)fields[i]->name);
+        lua_rawseti(L, -2, i + 1);
+    }
+    /* by name, which also covers enum aliases sharing a number */
+    while (t != NULL && pb_nextentry(&t->field_names, (pb_Entry**)&fe)) {
+        const char *name;
+        unsigned h;
+        if (fe->value == NULL) continue;
+        lua_pushstring(L, (char*)fe->value->name);
+        name = lua_tostring(L, -1);
+        for (h = lpb_ptrhash(name); p->slots[h & p->mask].name; ++h)
+            ;
+        p->slots[h & p->mask].name = name;
+        p->slots[h & p->mask].field = fe->value;
+        lua_rawseti(L, -2, ++n);
+    }
+    lua_setuservalue(L, -2);
+    return p;
+}
+
+/* pushes the encode plan of t, building it on first use */
+static lpb_Plan *lpb_pushplan(lua_State *L, int plans, pb_Type *t) {
+    lpb_Plan *p;
+    if (lua53_rawgetp(L, plans, t) == LUA_TUSERDATA)
+        return (lpb_Plan*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    p = lpb_newplan(L, t);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, plans, t);
+    return p;
+}
+
+static pb_Field *lpb_planfield(lpb_Env *e, lpb_Plan *p, pb_Type *t, const char *name) {
+    unsigned h = lpb_ptrhash(name);
+    lpb_PlanSlot *slot;
+    while ((slot = &p->slots[h & p->mask])->name != NULL) {
+        if (slot->name == name) return slot->field;
+        ++h;
+    }
+    /* a name not interned (e.g. a long string in Lua 5.3), or not a field */
+    return pb_fname(t, pb_name(&e->LS->base, name));
+}
+
 static void lpb_checktable(lua_State *L, pb_Field *f) {
     argcheck(L, lua_istable(L, -1),
             2, "table expected at field '%s', got %s",
             (char*)f->name, luaL_typename(L, -1));
 }
 
+/* In one pass, a byte is reserved for the length and the value is moved
+ * only if its length needs more.  With encode_presize the message is
+ * walked twice: the sizing pass measures every length delimited value into
+ * LS->sizes, dropping the nested bytes as it goes, and the writing pass
+ * emits each length before its value, so nothing is ever moved. */
+static void lpbE_beginlen(lpb_Env *e, lpb_Len *l) {
+    pb_Buffer *sizes = &e->LS->sizes;
+    size_t len;
+    switch (e->pass) {
+    case LPB_SIZING:
+        l->base = pb_bufflen(e->b);
+        l->extra = e->extra, e->extra = 0;
+        l->slot = pb_bufflen(sizes);
+        if (pb_prepbuffsize(sizes, sizeof(size_t)) == NULL)
+            luaL_error(e->L, "encode bytes fail");
+        pb_addsize(sizes, sizeof(size_t));
+        break;
+    case LPB_WRITING:
+        memcpy(&len, sizes->buff + e->next, sizeof(size_t));
+        e->next += sizeof(size_t);
+        pb_addvarint64(e->b, len);
+        break;
+    default:
+        if (pb_prepbuffsize(e->b, 1) == NULL)
+            luaL_error(e->L, "encode bytes fail");
+        pb_addsize(e->b, 1);
+        l->base = pb_bufflen(e->b);
+    }
+}
+
+static void lpbE_endlen(lpb_Env *e, lpb_Len *l) {
+    char buff[10];
+    size_t len;
+    switch (e->pass) {
+    case LPB_SIZING:
+        len = pb_bufflen(e->b) - l->base + e->extra;
+        memcpy(e->LS->sizes.buff + l->slot, &len, sizeof(size_t));
+        e->b->size = l->base;
+        e->extra = l->extra + pb_write64(buff, len) + len;
+        break;
+    case LPB_WRITING:
+        break;
+    default:
+        len = pb_bufflen(e->b) - l->base;
+        if (len < 0x80)
+            e->b->buff[l->base - 1] = (char)len;
+        else {
+            int ml = pb_write64(buff, len);
+            if (pb_prepbuffsize(e->b, ml - 1) == NULL)
+                luaL_error(e->L, "encode bytes fail");
+            memmove(e->b->buff + l->base + ml - 1, e->b->buff + l->base, len);
+            memcpy(e->b->buff + l->base - 1, buff, ml);
+            pb_addsize(e->b, ml - 1);
+        }
+    }
+}
+
 static void lpbE_enum(lpb_Env *e, pb_Field *f) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
-    pb_Field *ev;
+    pb_Field *ev = NULL;
     int type = lua_type(L, -1);
+    if (type == LUA_TSTRING) {
+        const char *name = lua_tostring(L, -1);
+        ev = lpb_planfield(e, lpb_pushplan(L, e->plans, f->type), f->type, name);
+        lua_pop(L, 1);
+    }
     if (type == LUA_TNUMBER)
         pb_addvarint64(b, (uint64_t)lua_tonumber(L, -1));
-    else if ((ev = pb_fname(f->type,
-                    pb_name(&e->LS->base, lua_tostring(L, -1)))) != NULL)
+    else if (ev != NULL)
         pb_addvarint32(b, ev->number);
     else if (type != LUA_TSTRING)
         argcheck(L, 0, 2, "number/string expected at field '%s', got %s",
@@ -1393,7 +1633,8 @@ static void lpbE_enum(lpb_Env *e, pb_Field *f) {
 static void lpbE_field(lpb_Env *e, pb_Field *f, size_t *plen) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
-    size_t len;
+    lpb_View *v;
+    lpb_Len len;
     int ltype;
     if (plen) *plen = 0;
     switch (f->type_id) {
@@ -1402,12 +1643,35 @@ static void lpbE_field(lpb_Env *e, pb_Field *f, size_t *plen) {
         break;
 
     case PB_Tmessage:
+        if ((v = test_view(L, -1)) != NULL && v->type == f->type
+                && v->LS == e->LS && v->epoch == e->LS->epoch) {
+            /* copy the encoded message as it is */
+            lpbE_beginlen(e, &len);
+            if (e->pass == LPB_SIZING)
+                e->extra += pb_len(v->data);
+            else
+                pb_addslice(b, v->data);
+            lpbE_endlen(e, &len);
+            break;
+        }
         lpb_checktable(L, f);
-        len = pb_bufflen(b);
+        lpbE_beginlen(e, &len);
         lpb_encode(e, f->type);
-        lpb_addlength(L, b, len);
+        lpbE_endlen(e, &len);
         break;
 
+    case PB_Tbytes: case PB_Tstring:
+        if (e->pass == LPB_SIZING) {
+            /* only the size matters here, don't copy the bytes */
+            pb_Slice sv = lpb_toslice(L, -1);
+            size_t svlen = pb_len(sv);
+            char buff[10];
+            if (sv.p != NULL && svlen != 0) {
+                e->extra += pb_write64(buff, svlen) + svlen;
+                break;
+            }
+        }
+        /* FALLTHROUGH */
     default:
         ltype = lpb_addtype(L, b, -1, f->type_id, plen);
         argcheck(L, ltype == 0,
@@ -1432,9 +1696,10 @@ static void lpbE_map(lpb_Env *e, pb_Field *f) {
     lpb_checktable(L, f);
     lua_pushnil(L);
     while (lua_next(L, -2)) {
-        size_t len, ignoredlen;
+        lpb_Len len;
+        size_t ignoredlen;
         pb_addvarint32(e->b, pb_pair(f->number, PB_TBYTES));
-        len = pb_bufflen(e->b);
+        lpbE_beginlen(e, &len);
         lua_pushvalue(L, -2);
         lpbE_tagfield(e, kf, &ignoredlen);
         e->b->size -= ignoredlen;
@@ -1442,7 +1707,7 @@ static void lpbE_map(lpb_Env *e, pb_Field *f) {
         lpbE_tagfield(e, vf, &ignoredlen);
         e->b->size -= ignoredlen;
         lua_pop(L, 1);
-        lpb_addlength(L, e->b, len);
+        lpbE_endlen(e, &len);
     }
 }
 
@@ -1452,14 +1717,14 @@ static void lpbE_repeated(lpb_Env *e, pb_Field *f) {
     int i;
     lpb_checktable(L, f);
     if (f->packed) {
-        size_t len;
+        lpb_Len len;
         pb_addvarint32(b, pb_pair(f->number, PB_TBYTES));
-        len = pb_bufflen(b);
+        lpbE_beginlen(e, &len);
         for (i = 1; lua53_rawgeti(L, -1, i) != LUA_TNIL; ++i) {
             lpbE_field(e, f, NULL);
             lua_pop(L, 1);
         }
-        lpb_addlength(L, b, len);
+        lpbE_endlen(e, &len);
     } else {
         for (i = 1; lua53_rawgeti(L, -1, i) != LUA_TNIL; ++i) {
             lpbE_tagfield(e, f, NULL);
@@ -1469,29 +1734,48 @@ static void lpbE_repeated(lpb_Env *e, pb_Field *f) {
     lua_pop(L, 1);
 }
 
+static void lpbE_value(lpb_Env *e, pb_Type *t, pb_Field *f) {
+    if (f->type && f->type->is_map)
+        lpbE_map(e, f);
+    else if (f->repeated)
+        lpbE_repeated(e, f);
+    else if (!f->type || !f->type->is_dead) {
+        size_t ignoredlen;
+        lpbE_tagfield(e, f, &ignoredlen);
+        if (t->is_proto3 && !f->oneof_idx)
+            e->b->size -= ignoredlen;
+    }
+}
+
 static void lpb_encode(lpb_Env *e, pb_Type *t) {
     lua_State *L = e->L;
-    luaL_checkstack(L, 3, "message too many levels");
-    lua_pushnil(L);
-    while (lua_next(L, -2)) {
-        if (lua_type(L, -2) == LUA_TSTRING) {
-            pb_Field *f = pb_fname(t,
-                    pb_name(&e->LS->base, lua_tostring(L, -2)));
-            if (f == NULL)
-                /* skip */;
-            else if (f->type && f->type->is_map)
-                lpbE_map(e, f);
-            else if (f->repeated)
-                lpbE_repeated(e, f);
-            else if (!f->type || !f->type->is_dead) {
-                size_t ignoredlen;
-                lpbE_tagfield(e, f, &ignoredlen);
-                if (t->is_proto3 && !f->oneof_idx)
-                    e->b->size -= ignoredlen;
-            }
+    int msg = lua_gettop(L);
+    lpb_Plan *p;
+    luaL_checkstack(L, 5, "message too many levels");
+    p = lpb_pushplan(L, e->plans, t);
+    if (e->LS->encode_mode == LPB_FIELDORDER) {
+        pb_Field **fields = lpb_planfields(p);
+        int i;
+        lua_getuservalue(L, -1);
+        for (i = 0; i < p->nfields; ++i) {
+            lua_rawgeti(L, -1, i + 1);
+            lua_rawget(L, msg);
+            if (!lua_isnil(L, -1))
+                lpbE_value(e, t, fields[i]);
+            lua_pop(L, 1);
         }
         lua_pop(L, 1);
+    } else {
+        lua_pushnil(L);
+        while (lua_next(L, msg)) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                pb_Field *f = lpb_planfield(e, p, t, lua_tostring(L, -2));
+                if (f != NULL) lpbE_value(e, t, f);
+            }
+            lua_pop(L, 1);
+        }
     }
+    lua_pop(L, 1);
 }
 
 static int Lpb_encode(lua_State *L) {
@@ -1502,8 +1786,26 @@ static int Lpb_encode(lua_State *L) {
     luaL_checktype(L, 2, LUA_TTABLE);
     e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
     if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    lpb_pushplantable(L, LS);
+    e.plans = lua_gettop(L);
+    e.pass = LPB_ONEPASS;
     lua_pushvalue(L, 2);
-    lpb_encode(&e, t);
+    if (!LS->encode_presize)
+        lpb_encode(&e, t);
+    else {
+        pb_Buffer *out = e.b;
+        size_t size;
+        e.b = &LS->buffer, e.pass = LPB_SIZING, e.extra = 0;
+        if (out != &LS->buffer) pb_resetbuffer(e.b);
+        LS->sizes.size = 0;
+        lpb_encode(&e, t);
+        size = pb_bufflen(e.b) + e.extra;
+        pb_resetbuffer(e.b);
+        e.b = out, e.pass = LPB_WRITING, e.next = 0;
+        if (pb_prepbuffsize(out, size) == NULL)
+            luaL_error(L, "encode bytes fail");
+        lpb_encode(&e, t);
+    }
     if (e.b != &LS->buffer)
         lua_settop(L, 3);
     else {
@@ -1547,7 +1849,8 @@ static void lpb_pushtypetable(lua_State *L, lpb_State *LS, pb_Type *t) {
 
 static void lpb_fetchtable(lpb_Env *e, pb_Field *f, pb_Type *t) {
     lua_State *L = e->L;
-    if (lua53_getfield(L, -1, (char*)f->name) == LUA_TNIL) {
+    /* not a table if another field shares the name, e.g. in a crafted schema */
+    if (lua53_getfield(L, -1, (char*)f->name) != LUA_TTABLE) {
         lua_pop(L, 1);
         lpb_pushtypetable(L, e->LS, t);
         lua_pushvalue(L, -1);
@@ -1689,6 +1992,356 @@ static int Lpb_decode(lua_State *L) {
 }
 
 
+/* protobuf lazy views */
+
+static void lpb_checkepoch(lua_State *L, lpb_State *LS, int epoch, const char *what) {
+    if (epoch != LS->epoch)
+        luaL_error(L, "types of %s have been cleared", what);
+}
+
+static lpb_View *lpbV_new(lua_State *L, lpb_State *LS, pb_Type *t, pb_Slice data) {
+    lpb_View *v = (lpb_View*)lua_newuserdata(L, sizeof(lpb_View));
+    memset(v, 0, sizeof(lpb_View));
+    v->LS = LS, v->epoch = LS->epoch;
+    v->type = t, v->data = data;
+    luaL_setmetatable(L, PB_VIEW);
+    return v;
+}
+
+static void lpbV_index(lua_State *L, lpb_View *v) {
+    pb_Slice s = v->data;
+    v->count = 0; /* a failed index may have left entries behind */
+    while (s.p < s.end) {
+        lpb_ViewEntry *ve;
+        const char *start = s.p;
+        uint32_t tag;
+        if (pb_readvarint32(&s, &tag) == 0)
+            luaL_error(L, "invalid tag at offset %d",
+                    (int)(start - v->data.p) + 1);
+        if (v->count == v->size) {
+            size_t newsize = v->size ? v->size * 2 : 8;
+            void *entries = realloc(v->entries, newsize * sizeof(lpb_ViewEntry));
+            if (entries == NULL) luaL_error(L, "out of memory");
+            v->entries = (lpb_ViewEntry*)entries, v->size = (int)newsize;
+        }
+        ve = &v->entries[v->count];
+        ve->tag = tag, ve->start = start, ve->value = s.p;
+        if (pb_skipvalue(&s, tag) == 0)
+            luaL_error(L, "invalid value for tag %d at offset %d",
+                    (int)pb_gettag(tag), (int)(start - v->data.p) + 1);
+        ve->end = s.p;
+        ++v->count;
+    }
+    v->indexed = 1;
+}
+
+static lpb_SliceEx lpbV_slice(lpb_View *v, lpb_ViewEntry *ve) {
+    lpb_SliceEx s;
+    s.base.p = ve->value, s.base.end = ve->end;
+    s.head = v->data.p;
+    return s;
+}
+
+static void lpbV_pushview(lua_State *L, lpb_View *v, pb_Field *f, lpb_ViewEntry *ve) {
+    lpb_SliceEx s = lpbV_slice(v, ve), sv;
+    if (pb_gettype(ve->tag) != PB_TBYTES)
+        lpbD_mismatch(L, f, &s, ve->tag);
+    lpb_readbytes(L, &s, &sv);
+    if (f->type == NULL || f->type->is_dead)
+        lua_pushnil(L);
+    else {
+        /* sub-views share the anchors of the view being indexed */
+        lpbV_new(L, v->LS, f->type, sv.base);
+        lua_getuservalue(L, 1);
+        lua_setuservalue(L, -2);
+    }
+}
+
+/* repeated and map fields are gathered into a table, sub-messages of
+ * repeated fields as views; a singular field takes its last occurrence */
+static void lpbV_pushfield(lua_State *L, lpb_View *v, pb_Field *f) {
+    lpb_ViewEntry *ve, *last = NULL, *end = v->entries + v->count;
+    lpb_SliceEx s;
+    lpb_Env e;
+    e.L = L, e.LS = v->LS, e.s = &s;
+    if (f->repeated && f->type_id == PB_Tmessage
+            && !(f->type && f->type->is_map)) {
+        int n = 0;
+        lua_newtable(L);
+        for (ve = v->entries; ve < end; ++ve)
+            if ((int32_t)pb_gettag(ve->tag) == f->number) {
+                lpbV_pushview(L, v, f, ve);
+                lua_rawseti(L, -2, ++n);
+            }
+        return;
+    }
+    if (f->repeated) {
+        lua_newtable(L);
+        for (ve = v->entries; ve < end; ++ve) {
+            if ((int32_t)pb_gettag(ve->tag) != f->number) continue;
+            s = lpbV_slice(v, ve);
+            if (f->type && f->type->is_map)
+                lpbD_map(&e, f);
+            else
+                lpbD_repeated(&e, f, ve->tag);
+        }
+        if (lua53_getfield(L, -1, (char*)f->name) == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+        }
+        lua_remove(L, -2);
+        return;
+    }
+    for (ve = v->entries; ve < end; ++ve)
+        if ((int32_t)pb_gettag(ve->tag) == f->number)
+            last = ve;
+    if (last == NULL) {
+        if (f->type_id == PB_Tmessage
+                || !lpb_pushdefault(L, v->LS, f, v->type->is_proto3))
+            lua_pushnil(L);
+    } else if (f->type_id == PB_Tmessage)
+        lpbV_pushview(L, v, f, last);
+    else {
+        s = lpbV_slice(v, last);
+        lpbD_field(&e, f, last->tag);
+    }
+}
+
+static pb_Field *lpbV_checkfield(lua_State *L, lpb_View *v, int idx) {
+    int isint, number = (int)lua_tointegerx(L, idx, &isint);
+    lpb_checkepoch(L, v->LS, v->epoch, "view");
+    if (isint) return pb_field(v->type, number);
+    if (lua_type(L, idx) != LUA_TSTRING) return NULL;
+    return pb_fname(v->type, pb_name(&v->LS->base, lua_tostring(L, idx)));
+}
+
+static int Lpb_view(lua_State *L) {
+    lpb_State *LS = default_lstate(L);
+    pb_Type *t = lpb_type(&LS->base, luaL_checkstring(L, 1));
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    lpbV_new(L, LS, t, pb_lslice(s, len));
+    /* the string and the state outlive all views into them */
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+    lua_rawseti(L, -2, 2);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int Lview_index(lua_State *L) {
+    lpb_View *v = check_view(L, 1);
+    pb_Field *f = lpbV_checkfield(L, v, 2);
+    if (f == NULL) return 0;
+    if (!v->indexed) lpbV_index(L, v);
+    lpbV_pushfield(L, v, f);
+    return 1;
+}
+
+static int Lview_len(lua_State *L) {
+    lpb_View *v = check_view(L, 1);
+    lua_pushinteger(L, (lua_Integer)pb_len(v->data));
+    return 1;
+}
+
+static int Lview_tostring(lua_State *L) {
+    lpb_View *v = check_view(L, 1);
+    lpb_checkepoch(L, v->LS, v->epoch, "view");
+    lua_pushfstring(L, "pb.View: %s: %p", (char*)v->type->name, v);
+    return 1;
+}
+
+static int Lview_delete(lua_State *L) {
+    lpb_View *v = check_view(L, 1);
+    free(v->entries);
+    v->entries = NULL, v->count = v->size = v->indexed = 0;
+    return 0;
+}
+
+/* pb.rewrite(view, patch[, buffer]): the message of view with the fields
+ * in patch replaced, splicing the unchanged bytes */
+static int Lpb_rewrite(lua_State *L) {
+    lpb_View *v = check_view(L, 1);
+    lpb_State *LS = v->LS;
+    lpb_ViewEntry *ve, *end;
+    const char *run = v->data.p;
+    lpb_Env e;
+    lpb_checkepoch(L, v->LS, v->epoch, "view");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!v->indexed) lpbV_index(L, v);
+    e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
+    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    for (ve = v->entries, end = ve + v->count; ve < end; ++ve) {
+        pb_Field *f = pb_field(v->type, pb_gettag(ve->tag));
+        if (f == NULL) continue;
+        if (lua53_getfield(L, 2, (char*)f->name) != LUA_TNIL) {
+            pb_addslice(e.b, pb_lslice(run, ve->start - run));
+            run = ve->end;
+        }
+        lua_pop(L, 1);
+    }
+    pb_addslice(e.b, pb_lslice(run, v->data.end - run));
+    lpb_pushplantable(L, LS);
+    e.plans = lua_gettop(L);
+    e.pass = LPB_ONEPASS;
+    lua_pushvalue(L, 2);
+    lpb_encode(&e, v->type);
+    if (e.b != &LS->buffer)
+        lua_settop(L, 3);
+    else {
+        lua_pushlstring(L, e.b->buff, e.b->size);
+        pb_resetbuffer(e.b);
+    }
+    return 1;
+}
+
+
+/* protobuf streams of length delimited messages */
+
+typedef struct lpb_Stream {
+    lpb_State *LS;
+    int        epoch;
+    pb_Type   *type;
+    pb_Buffer  buffer;  /* bytes fed but not decoded yet, from pos */
+    size_t     pos;
+    size_t     maxsize; /* longest message accepted */
+} lpb_Stream;
+
+/* decodes the next complete message, or returns 0 if there is none yet.
+ * A bad length prefix leaves no way to find the next message, so the
+ * bytes buffered are dropped before the error is raised. */
+static int lpbS_next(lua_State *L, lpb_Stream *st, int tidx) {
+    pb_Slice s = pb_lslice(st->buffer.buff + st->pos, st->buffer.size - st->pos);
+    lpb_SliceEx ms;
+    uint64_t len;
+    lpb_Env e;
+    if (pb_readvarint64(&s, &len) == 0) {
+        if (pb_len(s) < 10) return 0;
+        st->buffer.size = st->pos = 0;
+        luaL_error(L, "invalid message length in stream");
+    }
+    if (len > st->maxsize) {
+        st->buffer.size = st->pos = 0;
+        luaL_error(L, "message too long in stream (%f bytes)", (lua_Number)len);
+    }
+    if (pb_len(s) < len) return 0;
+    ms = lpb_initext(pb_lslice(s.p, (size_t)len));
+    /* consumed even if it fails to decode */
+    st->pos = ms.base.end - st->buffer.buff;
+    if (tidx == 0)
+        lpb_pushtypetable(L, st->LS, st->type);
+    else
+        lua_pushvalue(L, tidx);
+    e.L = L, e.LS = st->LS, e.s = &ms;
+    lpb_decode(&e, st->type);
+    return 1;
+}
+
+static lpb_Stream *lpbS_check(lua_State *L, int idx) {
+    lpb_Stream *st = check_stream(L, idx);
+    lpb_checkepoch(L, st->LS, st->epoch, "stream");
+    return st;
+}
+
+static int Lpb_stream(lua_State *L) {
+    lpb_State *LS = default_lstate(L);
+    pb_Type *t = lpb_type(&LS->base, luaL_checkstring(L, 1));
+    lua_Integer maxsize = luaL_optinteger(L, 2, 0);
+    lpb_Stream *st;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    argcheck(L, maxsize >= 0, 2, "invalid max message size");
+    st = (lpb_Stream*)lua_newuserdata(L, sizeof(lpb_Stream));
+    st->LS = LS, st->epoch = LS->epoch, st->type = t;
+    pb_initbuffer(&st->buffer);
+    st->pos = 0;
+    st->maxsize = maxsize ? (size_t)maxsize : PB_MAX_SIZET;
+    luaL_setmetatable(L, PB_STREAM);
+    /* the state outlives the stream; a table, as fenvs must be on 5.1 */
+    lua_createtable(L, 1, 0);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int Lstream_delete(lua_State *L) {
+    lpb_Stream *st = check_stream(L, 1);
+    pb_resetbuffer(&st->buffer);
+    st->pos = 0;
+    return 0;
+}
+
+static int Lstream_tostring(lua_State *L) {
+    lpb_Stream *st = check_stream(L, 1);
+    lua_pushfstring(L, "pb.Stream: %p", st);
+    return 1;
+}
+
+static int Lstream_len(lua_State *L) {
+    lpb_Stream *st = check_stream(L, 1);
+    lua_pushinteger(L, (lua_Integer)(st->buffer.size - st->pos));
+    return 1;
+}
+
+static int Lstream_reset(lua_State *L) {
+    lpb_Stream *st = check_stream(L, 1);
+    st->buffer.size = st->pos = 0;
+    return_self(L);
+}
+
+/* s:feed(data[, callback]): with a callback, it is called with each
+ * message completed and the count of messages is returned */
+static int Lstream_feed(lua_State *L) {
+    lpb_Stream *st = lpbS_check(L, 1);
+    pb_Slice data = lpb_checkslice(L, 2);
+    int count = 0;
+    if (st->pos != 0) {
+        /* keep only the partial message */
+        st->buffer.size -= st->pos;
+        memmove(st->buffer.buff, st->buffer.buff + st->pos, st->buffer.size);
+        st->pos = 0;
+    }
+    if (pb_addslice(&st->buffer, data) != pb_len(data))
+        return luaL_error(L, "out of memory");
+    if (lua_isnoneornil(L, 3)) return_self(L);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    while (lpbS_next(L, st, 0)) {
+        lua_pushvalue(L, 3);
+        lua_insert(L, -2);
+        lua_call(L, 1, 0);
+        ++count;
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/* s:next([table]): the next complete message, or nil */
+static int Lstream_next(lua_State *L) {
+    lpb_Stream *st = lpbS_check(L, 1);
+    int tidx = lua_istable(L, 2) ? 2 : 0;
+    return lpbS_next(L, st, tidx);
+}
+
+static int Lstream_iter(lua_State *L) {
+    return lpbS_next(L, lpbS_check(L, 1), 0);
+}
+
+/* for msg in s:each([data]) do ... end */
+static int Lstream_each(lua_State *L) {
+    if (!lua_isnoneornil(L, 2)) {
+        lua_settop(L, 2);
+        Lstream_feed(L);
+    }
+    lpbS_check(L, 1);
+    lua_pushcfunction(L, Lstream_iter);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+
 /* pb module interface */
 
 static int Lpb_option(lua_State *L) {
@@ -1702,6 +2355,10 @@ static int Lpb_option(lua_State *L) {
     X(6, no_default_values,     LS->default_mode = LPB_NODEF)      \
     X(7, use_default_values,    LS->default_mode = LPB_COPYDEF)    \
     X(8, use_default_metatable, LS->default_mode = LPB_METADEF)    \
+    X(9, encode_table_order,    LS->encode_mode = LPB_TABLEORDER)  \
+    X(10, encode_field_order,   LS->encode_mode = LPB_FIELDORDER)  \
+    X(11, encode_backpatch,     LS->encode_presize = 0)            \
+    X(12, encode_presize,       LS->encode_presize = 1)            \
 
     static const char *opts[] = {
 #define X(ID,NAME,CODE) #NAME,
@@ -1727,8 +2384,12 @@ LUALIB_API int luaopen_lpb(lua_State *L) {
         ENTRY(clear),
         ENTRY(load),
         ENTRY(loadfile),
+        ENTRY(snapshot),
         ENTRY(encode),
         ENTRY(decode),
+        ENTRY(view),
+        ENTRY(rewrite),
+        ENTRY(stream),
         ENTRY(types),
         ENTRY(fields),
         ENTRY(type),
@@ -1747,11 +2408,39 @@ LUALIB_API int luaopen_lpb(lua_State *L) {
         { "setdefault", Lpb_state },
         { NULL, NULL }
     };
+    luaL_Reg view_meta[] = {
+        { "__index", Lview_index },
+        { "__len", Lview_len },
+        { "__tostring", Lview_tostring },
+        { "__gc", Lview_delete },
+        { NULL, NULL }
+    };
     if (luaL_newmetatable(L, PB_STATE)) {
         luaL_setfuncs(L, meta, 0);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
     }
+    luaL_Reg stream_meta[] = {
+        { "__gc", Lstream_delete },
+        { "__len", Lstream_len },
+        { "__tostring", Lstream_tostring },
+#define ENTRY(name) { #name, Lstream_##name }
+        ENTRY(feed),
+        ENTRY(next),
+        ENTRY(each),
+        ENTRY(reset),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, PB_VIEW))
+        luaL_setfuncs(L, view_meta, 0);
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, PB_STREAM)) {
+        luaL_setfuncs(L, stream_meta, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
     luaL_newlib(L, libs);
     return 1;
 }
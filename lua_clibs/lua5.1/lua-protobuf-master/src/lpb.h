@@ -209,6 +209,7 @@ typedef struct pb_Field pb_Field;
 #define PB_ENOMEM 2
 
 PB_API int pb_load (pb_State *S, pb_Slice *s);
+PB_API int pb_dump (pb_State *S, pb_Buffer *b);
 
 PB_API pb_Type  *pb_newtype  (pb_State *S, pb_Name *tname);
 PB_API void      pb_deltype  (pb_State *S, pb_Type *t);
@@ -1622,10 +1623,223 @@ static void pbL_loadFile(pb_State *S, pbL_FileInfo *info, pb_Loader *L) {
     }
 }
 
+/* schema image */
+
+/* An image is the resolved form of a state: every live type with its
+ * oneofs and fields, type references stored as indexes into the type
+ * list.  pb_load() recognizes it by the leading zero byte, which can not
+ * start a FileDescriptorSet, and rebuilds the types in a single pass
+ * without parsing descriptors or resolving names.  The layout is plain
+ * varints and length-prefixed names, so images are position independent
+ * but only meant to be read back by the same version of this file. */
+
+#define PB_IMAGE_MAGIC    "\0pbI\1"
+#define PB_IMAGE_MAGICLEN 5
+
+typedef struct pbI_TypeIndex {
+    pb_Entry entry;
+    size_t   index;
+} pbI_TypeIndex;
+
+static void pbI_addname(pb_Buffer *b, pb_Name *name) {
+    size_t len;
+    if (name == NULL) { pb_addvarint32(b, 0); return; }
+    len = ((pb_NameEntry*)name - 1)->length;
+    pb_addvarint64(b, (uint64_t)len + 1);
+    pb_addslice(b, pb_lslice((const char*)name, len));
+}
+
+static void pbI_addfield(pb_Buffer *b, pb_Table *index, pb_Field *f) {
+    pbI_TypeIndex *ti = NULL;
+    if (f->type != NULL)
+        ti = (pbI_TypeIndex*)pb_gettable(index, (pb_Key)f->type);
+    pbI_addname(b, f->name);
+    pb_addvarint32(b, (uint32_t)f->number);
+    pb_addvarint64(b, ti ? (uint64_t)ti->index : 0);
+    pbI_addname(b, f->default_value);
+    pb_addvarint32(b, f->oneof_idx);
+    pb_addvarint32(b, f->type_id | f->repeated << 5 | f->packed << 6);
+}
+
+static int pbI_isalias(pb_Type *t, pb_Field *f)
+{ return f != NULL && pb_field(t, f->number) != f; }
+
+PB_API int pb_dump(pb_State *S, pb_Buffer *b) {
+    pb_Table index;
+    pb_Type *t = NULL;
+    size_t count = 0;
+    pb_inittable(&index, sizeof(pbI_TypeIndex));
+    while (pb_nexttype(S, &t)) {
+        pbI_TypeIndex *ti = (pbI_TypeIndex*)pb_settable(&index, (pb_Key)t);
+        if (ti == NULL) { pb_freetable(&index); return PB_ENOMEM; }
+        ti->index = ++count;
+    }
+    pb_addslice(b, pb_lslice(PB_IMAGE_MAGIC, PB_IMAGE_MAGICLEN));
+    pb_addvarint64(b, S->nametable.count);
+    pb_addvarint64(b, count);
+    while (pb_nexttype(S, &t))
+        pbI_addname(b, t->name);
+    while (pb_nexttype(S, &t)) {
+        pb_OneofEntry *oe = NULL;
+        pb_FieldEntry *fe = NULL;
+        pb_Field *f = NULL;
+        size_t n = 0;
+        pb_addvarint32(b, t->is_enum | t->is_map << 1 | t->is_proto3 << 2);
+        while (pb_nextentry(&t->oneof_index, (pb_Entry**)&oe)) ++n;
+        pb_addvarint64(b, n);
+        while (pb_nextentry(&t->oneof_index, (pb_Entry**)&oe)) {
+            pb_addvarint32(b, oe->index);
+            pbI_addname(b, oe->name);
+        }
+        /* aliases go first, so the field owning each number is the last
+         * one pb_newfield() sees for it when the image is loaded */
+        n = 0;
+        while (pb_nextentry(&t->field_names, (pb_Entry**)&fe))
+            if (pbI_isalias(t, fe->value)) ++n;
+        while (pb_nextfield(t, &f)) ++n;
+        pb_addvarint64(b, n);
+        while (pb_nextentry(&t->field_names, (pb_Entry**)&fe))
+            if (pbI_isalias(t, fe->value)) pbI_addfield(b, &index, fe->value);
+        while (pb_nextfield(t, &f))
+            pbI_addfield(b, &index, f);
+    }
+    pb_freetable(&index);
+    return PB_OK;
+}
+
+static int pbI_readname(pb_Slice *s, pb_Slice *pv) {
+    uint64_t len;
+    if (pb_readvarint64(s, &len) == 0) return 0;
+    if (len == 0) { pv->p = pv->end = NULL; return 1; }
+    if (--len > (uint64_t)pb_len(*s)) return 0;
+    /* names go back to Lua as C strings, so pb.types() would loop on a NUL */
+    if (memchr(s->p, 0, (size_t)len) != NULL) return 0;
+    pv->p = s->p, pv->end = s->p += (size_t)len;
+    return 1;
+}
+
+static int pbI_readcount(pb_Slice *s, size_t *pv) {
+    uint64_t n;
+    /* every counted item takes at least one byte */
+    if (pb_readvarint64(s, &n) == 0 || n > (uint64_t)pb_len(*s)) return 0;
+    *pv = (size_t)n;
+    return 1;
+}
+
+static int pbI_checkfield(uint32_t flags, uint32_t type_id, uint64_t tref) {
+    if (flags & 1) /* enum values */
+        return type_id == 0;
+    if (type_id < PB_Tdouble || type_id > PB_Tsint64)
+        return 0;
+    return tref != 0 || (type_id != PB_Tmessage && type_id != PB_Tenum);
+}
+
+/* With S == NULL only checks the body, so that a corrupt image is
+ * rejected before the state is touched; otherwise it must already have
+ * been checked, and `types` holds the types named in the header. */
+static int pbI_loadtypes(pb_State *S, pb_Slice *s, pb_Type **types, size_t count) {
+    size_t i, j, n;
+    for (i = 0; i < count; ++i) {
+        pb_Type *t = S ? types[i] : NULL;
+        uint32_t flags;
+        int keys = 0;
+        if (pb_readvarint32(s, &flags) == 0) return 0;
+        if (t != NULL) {
+            t->is_enum   = flags & 1;
+            t->is_map    = (flags >> 1) & 1;
+            t->is_proto3 = (flags >> 2) & 1;
+        }
+        if (!pbI_readcount(s, &n)) return 0;
+        for (j = 0; j < n; ++j) {
+            uint32_t idx;
+            pb_Slice name;
+            if (pb_readvarint32(s, &idx) == 0 || !pbI_readname(s, &name))
+                return 0;
+            if (t != NULL) {
+                pb_OneofEntry *e = (pb_OneofEntry*)pb_settable(
+                        &t->oneof_index, idx);
+                if (e == NULL) return 0;
+                e->name = pb_newname(S, name);
+                e->index = idx;
+            }
+        }
+        if (!pbI_readcount(s, &n)) return 0;
+        if (t != NULL && t->field_tags.size == 0 && n != 0) {
+            pb_resizetable(&t->field_names, n);
+            pb_resizetable(&t->field_tags, n);
+        }
+        for (j = 0; j < n; ++j) {
+            pb_Slice name, defvalue;
+            uint32_t number, oneof_idx, bits;
+            uint64_t tref;
+            pb_Field *f;
+            if (!pbI_readname(s, &name) || name.p == NULL
+                    || pb_readvarint32(s, &number) == 0
+                    || pb_readvarint64(s, &tref) == 0 || tref > count
+                    || !pbI_readname(s, &defvalue)
+                    || pb_readvarint32(s, &oneof_idx) == 0
+                    || pb_readvarint32(s, &bits) == 0
+                    || !pbI_checkfield(flags, bits & 0x1F, tref))
+                return 0;
+            if (number == 1 || number == 2) keys |= number;
+            if (t == NULL) continue;
+            f = pb_newfield(S, t, pb_newname(S, name), (int32_t)number);
+            if (f == NULL) return 0;
+            f->default_value = pb_newname(S, defvalue);
+            f->type      = tref ? types[tref-1] : NULL;
+            f->oneof_idx = oneof_idx;
+            f->type_id   = bits & 0x1F;
+            f->repeated  = (bits >> 5) & 1;
+            f->packed    = (bits >> 6) & 1;
+            if (f->type_id >= 9 && f->type_id <= 12) f->packed = 0;
+            f->scalar = (f->type == NULL);
+        }
+        /* decoding a map entry looks up its key and value fields */
+        if ((flags & 2) && keys != 3) return 0;
+    }
+    return 1;
+}
+
+static int pbI_loadimage(pb_State *S, pb_Slice *s) {
+    pb_Slice body;
+    pb_Type **types;
+    uint64_t names;
+    size_t i, count;
+    int ret = PB_ENOMEM;
+    s->p += PB_IMAGE_MAGICLEN;
+    if (pb_readvarint64(s, &names) == 0 || !pbI_readcount(s, &count))
+        return PB_ERROR;
+    body = *s;
+    for (i = 0; i < count; ++i) {
+        pb_Slice name;
+        if (!pbI_readname(&body, &name) || name.p == NULL) return PB_ERROR;
+    }
+    if (!pbI_loadtypes(NULL, &body, NULL, count)) return PB_ERROR;
+    if (count == 0) { *s = body; return PB_OK; }
+    types = (pb_Type**)malloc(count * sizeof(pb_Type*));
+    if (types == NULL) return PB_ENOMEM;
+    /* the name count is only a hint for sizing the name table */
+    if (names > (uint64_t)pb_len(*s)) names = pb_len(*s);
+    names += S->nametable.count;
+    if (names > S->nametable.size) pbN_resize(S, (size_t)names);
+    for (i = 0; i < count; ++i) {
+        pb_Slice name;
+        pbI_readname(s, &name);
+        if (!(types[i] = pb_newtype(S, pb_newname(S, name)))) break;
+    }
+    if (i == count && pbI_loadtypes(S, s, types, count))
+        ret = PB_OK;
+    free(types);
+    return ret;
+}
+
 PB_API int pb_load(pb_State *S, pb_Slice *s) {
     volatile int ret = PB_ERROR;
     pbL_FileInfo *files = NULL;
     pb_Loader L;
+    if (pb_len(*s) >= PB_IMAGE_MAGICLEN
+            && memcmp(s->p, PB_IMAGE_MAGIC, PB_IMAGE_MAGICLEN) == 0)
+        return pbI_loadimage(S, s);
     if (!setjmp(L.jbuf)) {
         L.s = *s;
         L.is_proto3 = 0;
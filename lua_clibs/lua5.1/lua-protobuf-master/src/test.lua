@@ -564,6 +564,251 @@ function _G.test_packed()
    assert(pb.type ".google.protobuf.FileDescriptorSet")
 end
 
+function _G.test_encode_order()
+   check_load [[
+      enum Color { RED = 0; GREEN = 1; }
+      message Sub { optional int32 x = 1; }
+      message TestOrder {
+         optional int32  c     = 3;
+         optional string a     = 1;
+         optional Color  color = 5;
+         repeated Sub    subs  = 4;
+         optional int32  b     = 2;
+      } ]]
+   local data = { a = "x", b = 2, c = 3, color = "GREEN", subs = { { x = 1 } },
+                  unknown = true }
+   pb.option "encode_field_order"
+   eq(pb.tohex(pb.encode("TestOrder", data)),
+      "0A 01 78 10 02 18 03 22 02 08 01 28 01")
+   check_msg("TestOrder", { a = "x", b = 2, c = 3, color = "GREEN",
+                            subs = { { x = 1 } } })
+   pb.option "encode_table_order"
+   check_msg("TestOrder", { a = "x", color = "GREEN" })
+   -- loading more fields must refresh the cached plan
+   check_load [[ message TestOrder { optional int32 d = 6; } ]]
+   pb.option "encode_field_order"
+   eq(pb.tohex(pb.encode("TestOrder", { b = 2, d = 6 })), "10 02 30 06")
+   pb.option "encode_table_order"
+   pb.clear "TestOrder"
+   pb.clear "Sub"
+   pb.clear "Color"
+end
+
+function _G.test_encode_presize()
+   check_load [[
+      syntax = "proto3";
+      message Node {
+         string       name     = 1;
+         repeated Node children = 2;
+         map<string, Node> named = 3;
+         repeated int32 values   = 4;
+      } ]]
+   local function tree(depth)
+      local n = { name = ("n"):rep(depth * 50), values = { 1, 300, 70000 } }
+      if depth > 0 then
+         n.children = { tree(depth - 1), tree(depth - 1) }
+         n.named = { left = tree(depth - 1) }
+      end
+      return n
+   end
+   local data = tree(5)
+   pb.option "encode_field_order"
+   local expected = pb.encode("Node", data)
+   pb.option "encode_presize"
+   eq(pb.encode("Node", data), expected)
+   eq(pb.decode("Node", expected), pb.decode("Node", pb.encode("Node", data)))
+   local b = buffer.new "prefix"
+   eq(pb.result(pb.encode("Node", data, b)), "prefix" .. expected)
+   eq(pb.encode("Node", {}), "")
+   fail("string expected for field 'name', got boolean",
+        function() pb.encode("Node", { children = { { name = true } } }) end)
+   eq(pb.encode("Node", data), expected)
+   pb.option "encode_backpatch"
+   pb.option "encode_table_order"
+   pb.clear "Node"
+end
+
+function _G.test_view()
+   check_load [[
+      enum Kind { A = 0; B = 1; }
+      message Header { optional int32 id = 1; optional string route = 2; }
+      message Packet {
+         optional Header header  = 1;
+         optional bytes  body    = 2;
+         repeated int32  ids     = 3 [packed=true];
+         repeated Header hops    = 4;
+         map<string, int32> tags = 5;
+         optional Kind   kind    = 6;
+         optional int32  ttl     = 7 [default = 64];
+      } ]]
+   local data = {
+      header = { id = 7, route = "a.b" },
+      body = ("x"):rep(300),
+      ids = { 1, 2, 3 },
+      hops = { { id = 1 }, { id = 2 } },
+      tags = { x = 1 },
+      kind = "B",
+   }
+   local chunk = pb.encode("Packet", data)
+   local v = pb.view("Packet", chunk)
+   eq(#v, #chunk)
+   eq(v.body, data.body)
+   eq(v.header.id, 7)
+   eq(v.header.route, "a.b")
+   eq(v[1].id, 7)
+   eq(v.ids, { 1, 2, 3 })
+   eq(v.hops[2].id, 2)
+   eq(#v.hops, 2)
+   eq(v.tags, { x = 1 })
+   eq(v.kind, "B")
+   eq(v.ttl, 64)
+   eq(v.nothing, nil)
+   eq(pb.view("Packet", "").header, nil)
+   eq(pb.view("Packet", "").hops, {})
+   eq(pb.decode("Packet", v), pb.decode("Packet", chunk))
+   eq(pb.decode("Header", v.header), data.header)
+   fail("invalid value for tag 2", function() return pb.view("Packet", "\18\5ab").body end)
+   local bad = pb.view("Packet", ("\24\1"):rep(40).."\18\5ab")
+   for _ = 1, 2 do
+      fail("invalid value for tag 2", function() return bad.body end)
+   end
+
+   -- a view stands for its message when encoding
+   eq(pb.encode("Packet", { header = v.header }),
+      pb.encode("Packet", { header = data.header }))
+
+   local out = pb.rewrite(v, { header = { id = 8 }, ttl = 1 })
+   local t = pb.decode("Packet", out)
+   eq(t.header, { id = 8 })
+   eq(t.ttl, 1)
+   eq(t.body, data.body)
+   eq(t.hops, data.hops)
+   eq(pb.rewrite(v, {}), chunk)
+   local b = buffer.new()
+   eq(pb.result(pb.rewrite(v, { kind = "A" }, b)):sub(1, 1), chunk:sub(1, 1))
+
+   pb.clear "Packet"
+   pb.clear "Header"
+   pb.clear "Kind"
+end
+
+function _G.test_stream()
+   check_load [[
+      message Event { optional int32 id = 1; optional string data = 2; } ]]
+   local b = buffer.new()
+   for i = 1, 100 do
+      b:pack("s", pb.encode("Event", { id = i, data = ("d"):rep(i * 3) }))
+   end
+   local bytes = b:result()
+
+   -- fed in chunks of every size, messages come out whole and in order
+   for _, size in ipairs { 1, 2, 7, 64, 1000, #bytes } do
+      local s, ids = pb.stream "Event", {}
+      for i = 1, #bytes, size do
+         eq(s:feed(bytes:sub(i, i+size-1), function(e)
+            eq(e.data, ("d"):rep(e.id * 3))
+            ids[#ids+1] = e.id
+         end) >= 0, true)
+      end
+      eq(#ids, 100)
+      eq(ids[100], 100)
+      eq(#s, 0)
+   end
+
+   local s = pb.stream "Event"
+   if debug.getfenv then eq(type(debug.getfenv(s)), "table") end
+   eq(s:next(), nil)
+   s:feed(bytes:sub(1, 3))
+   eq(s:next(), nil)
+   eq(#s, 3)
+   local n = 0
+   for e in s:each(bytes:sub(4)) do
+      n = n + 1
+      eq(e.id, n)
+   end
+   eq(n, 100)
+   local t = {}
+   eq(s:feed(pb.pack("s", pb.encode("Event", { id = 1 }))):next(t), t)
+   eq(t.id, 1)
+   eq(#s:feed("\1"):reset(), 0)
+
+   s = pb.stream("Event", 10)
+   fail("message too long in stream", function() s:feed("\11"):next() end)
+   -- the bad prefix is dropped, so the error is not raised again
+   eq(#s, 0)
+   eq(s:feed(pb.pack("s", pb.encode("Event", { id = 2 }))):next().id, 2)
+   fail("invalid message length", function()
+      pb.stream("Event"):feed(("\255"):rep(11)):next()
+   end)
+   pb.clear "Event"
+end
+
+function _G.test_snapshot()
+   local old = pb.state(nil)
+   protoc.reload()
+   check_load [[
+      syntax = "proto2";
+      package snap;
+      enum Color { option allow_alias = true;
+                   RED = 0; CRIMSON = 0; GREEN = 1; }
+      message Item {
+         optional int32  id    = 1 [default = 7];
+         optional string name  = 2 [default = "none"];
+         optional Color  color = 3;
+         repeated int32  nums  = 4 [packed = true];
+         map<string, Item> children = 5;
+         oneof kind { int64 n = 6; string s = 7; }
+      } ]]
+   local function info()
+      local r = {}
+      for name, basename, kind in pb.types() do
+         local fields = {}
+         for fname, number, ftype, default, label, oneof in pb.fields(name) do
+            fields[fname] = { number, ftype, default, label, oneof }
+         end
+         r[name] = { basename, kind, fields }
+      end
+      return r
+   end
+   local item = { id = 1, name = "a", color = "GREEN", nums = { 1, 2, 3 },
+                  children = { b = { id = 2, s = "x" } }, n = 5 }
+   local chunk = pb.encode("snap.Item", item)
+   local zero = pb.enum("snap.Color", 0)
+   local types = info()
+   local image = pb.snapshot()
+   eq(image:sub(1, 1), "\0")
+   eq(pb.snapshot(buffer.new()):result(), image)
+
+   pb.state(nil)
+   eq({pb.load(image)}, {true, #image + 1})
+   eq(info(), types)
+   eq(#pb.snapshot(), #image)
+   eq(pb.encode("snap.Item", item), chunk)
+   eq(pb.decode("snap.Item", chunk).children.b.s, "x")
+   eq(pb.enum("snap.Color", 0), zero)
+   eq(pb.enum("snap.Color", "RED"), 0)
+   eq(pb.enum("snap.Color", "CRIMSON"), 0)
+
+   eq(pb.load(image:sub(1, -2)), false)
+   eq(pb.load("\0pbI\1\1\5snap"), false)
+   local function image(flags, fields) -- fields: { name, number, tref, type_id }
+      local s = { "\0pbI\1", pb.pack("vvv", 0, 1, 2), "M",
+                  pb.pack("vvv", flags, 0, #fields) }
+      for _, f in ipairs(fields) do
+         s[#s+1] = pb.pack("v", #f[1] + 1)..f[1]..
+                   pb.pack("vvvvv", f[2], f[3], 0, 0, f[4])
+      end
+      return table.concat(s)
+   end
+   eq(pb.load(image(0, {{"a", 1, 0, 5}})), true)
+   eq(pb.load(image(0, {{"a", 1, 0, 19}})), false)
+   eq(pb.load(image(0, {{"a\0b", 1, 0, 5}})), false)
+   eq(pb.load(image(0, {{"a", 1, 0, 11}})), false)
+   eq(pb.load(image(2, {{"key", 1, 0, 9}})), false)
+   eq(pb.load(image(2, {{"key", 1, 0, 9}, {"value", 2, 0, 5}})), true)
+   pb.state(old)
+end
+
 function _G.test_map()
    check_load [[
    syntax = "proto3";
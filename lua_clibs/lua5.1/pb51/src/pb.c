@@ -23,6 +23,7 @@
 #include <lualib.h>
 #include <lauxlib.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -100,13 +101,105 @@ defined (BIT_ZERO_ON_LEFT) || defined(m68k) || defined(__sparc)
 #define checkiostring(L) \
     (IOString*) luaL_checkudata(L, 1, IOSTRING_META)
 
-#define IOSTRING_BUF_LEN 65535
+#define IOSTRING_INIT_LEN 256 /* inline buffer, used until the first growth */
+#define IOSTRING_KEEP_LEN 65536 /* clear() frees heap buffers larger than this */
 
 typedef struct {
 	size_t size;
-	char buf[IOSTRING_BUF_LEN];
+	size_t cap;
+	char* buf; /* init or a heap buffer */
+	char init[IOSTRING_INIT_LEN];
 } IOString;
 
+/* The IOString at idx, or NULL when it is something else (a write function). */
+static IOString* toiostring(lua_State *L, int idx) {
+	IOString* io = (IOString*)lua_touserdata(L, idx);
+	if (io != NULL && lua_getmetatable(L, idx)) {
+		luaL_getmetatable(L, IOSTRING_META);
+		if (!lua_rawequal(L, -1, -2)) {
+			io = NULL;
+		}
+		lua_pop(L, 2);
+		return io;
+	}
+	return NULL;
+}
+
+/* Make room for n more bytes, growing the buffer geometrically. */
+static char* iostring_reserve(lua_State *L, IOString *io, size_t n) {
+	if (io->size + n > io->cap) {
+		size_t cap = io->cap;
+		char* buf;
+		while (cap < io->size + n) {
+			if (cap > (size_t)-1 / 2) {
+				luaL_error(L, "Out of memory");
+			}
+			cap *= 2;
+		}
+		if (io->buf == io->init) {
+			buf = (char*)malloc(cap);
+			if (buf != NULL) {
+				memcpy(buf, io->init, io->size);
+			}
+		}
+		else {
+			buf = (char*)realloc(io->buf, cap);
+		}
+		if (buf == NULL) {
+			luaL_error(L, "Out of memory");
+		}
+		io->buf = buf;
+		io->cap = cap;
+	}
+	return io->buf + io->size;
+}
+
+static size_t encode_varint(char* p, uint64_t value) {
+	size_t n = 0;
+	while (value >= 0x80) {
+		p[n++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	p[n++] = (char)value;
+	return n;
+}
+
+static void iostring_add_varint(lua_State *L, IOString *io, uint64_t value) {
+	char* p = iostring_reserve(L, io, 10);
+	io->size += encode_varint(p, value);
+}
+
+static void iostring_add_fixed32(lua_State *L, IOString *io, uint8_t* value) {
+	char* p = iostring_reserve(L, io, 4);
+#ifdef IS_LITTLE_ENDIAN
+	memcpy(p, value, 4);
+#else
+	uint32_t v = htole32(*(uint32_t*)value);
+	memcpy(p, &v, 4);
+#endif
+	io->size += 4;
+}
+
+static void iostring_add_fixed64(lua_State *L, IOString *io, uint8_t* value) {
+	char* p = iostring_reserve(L, io, 8);
+#ifdef IS_LITTLE_ENDIAN
+	memcpy(p, value, 8);
+#else
+	uint64_t v = htole64(*(uint64_t*)value);
+	memcpy(p, &v, 8);
+#endif
+	io->size += 8;
+}
+
+static int64_t check_int64(lua_State *L, int idx) {
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, idx)) {
+		return (int64_t)lua_tointeger(L, idx);
+	}
+#endif
+	return (int64_t)luaL_checknumber(L, idx);
+}
+
 static void pack_varint(luaL_Buffer *b, uint64_t value) {
 	if (value >= 0x80) {
 
@@ -161,6 +254,12 @@ static int varint_encoder(lua_State *L) {
 	lua_Number l_value = luaL_checknumber(L, 2);
 	uint64_t value = (uint64_t)l_value;
 
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_varint(L, io, value);
+		return 0;
+	}
+
 	luaL_Buffer b;
 	luaL_buffinit(L, &b);
 
@@ -177,6 +276,12 @@ static int signed_varint_encoder(lua_State *L) {
 	lua_Number l_value = luaL_checknumber(L, 2);
 	int64_t value = (int64_t)l_value;
 
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_varint(L, io, (uint64_t)value);
+		return 0;
+	}
+
 	luaL_Buffer b;
 	luaL_buffinit(L, &b);
 
@@ -214,10 +319,59 @@ static int pack_fixed64(lua_State *L, uint8_t* value) {
 	return 0;
 }
 
+static void iostring_add_struct(lua_State *L, IOString *io, uint8_t format, lua_Number value) {
+
+	switch (format) {
+	case 'i': {
+		int32_t v = (int32_t)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'q': {
+		int64_t v = (int64_t)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'f': {
+		float v = (float)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'd': {
+		double v = (double)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'I': {
+		uint32_t v = (uint32_t)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+	case 'Q': {
+		uint64_t v = (uint64_t)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	default:
+		luaL_error(L, "Unknown, format");
+	}
+}
+
 static int struct_pack(lua_State *L) {
 
 	uint8_t format = luaL_checkinteger(L, 2);
 	lua_Number value = luaL_checknumber(L, 3);
+
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_struct(L, io, format, value);
+		return 0;
+	}
 	lua_settop(L, 1);
 
 	switch (format) {
@@ -473,12 +627,26 @@ static int new_iostring(lua_State* L) {
 
 	IOString* io = (IOString*)lua_newuserdata(L, sizeof(IOString));
 	io->size = 0;
+	io->cap = IOSTRING_INIT_LEN;
+	io->buf = io->init;
 
 	luaL_getmetatable(L, IOSTRING_META);
 	lua_setmetatable(L, -2);
 	return 1;
 }
 
+static int iostring_gc(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	if (io->buf != io->init) {
+		free(io->buf);
+		io->buf = io->init;
+		io->cap = IOSTRING_INIT_LEN;
+	}
+	io->size = 0;
+	return 0;
+}
+
 static int iostring_str(lua_State* L) {
 
 	IOString *io = checkiostring(L);
@@ -498,14 +666,58 @@ static int iostring_write(lua_State* L) {
 	IOString *io = checkiostring(L);
 	size_t size;
 	const char* str = luaL_checklstring(L, 2, &size);
-	if (io->size + size > IOSTRING_BUF_LEN) {
-		luaL_error(L, "Out of range");
-	}
-	memcpy(io->buf + io->size, str, size);
+	memcpy(iostring_reserve(L, io, size), str, size);
 	io->size += size;
 	return 0;
 }
 
+static int iostring_write_varint(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	iostring_add_varint(L, io, (uint64_t)check_int64(L, 2));
+	return 0;
+}
+
+static int iostring_write_zigzag32(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	int32_t n = (int32_t)check_int64(L, 2);
+	iostring_add_varint(L, io, ((uint32_t)n << 1) ^ (uint32_t)(n >> 31));
+	return 0;
+}
+
+static int iostring_write_zigzag64(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	int64_t n = check_int64(L, 2);
+	iostring_add_varint(L, io, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+	return 0;
+}
+
+static int iostring_write_fixed32(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint32_t v = (uint32_t)check_int64(L, 2);
+	iostring_add_fixed32(L, io, (uint8_t*)&v);
+	return 0;
+}
+
+static int iostring_write_fixed64(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint64_t v = (uint64_t)check_int64(L, 2);
+	iostring_add_fixed64(L, io, (uint8_t*)&v);
+	return 0;
+}
+
+static int iostring_write_struct(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint8_t format = luaL_checkinteger(L, 2);
+	iostring_add_struct(L, io, format, luaL_checknumber(L, 3));
+	return 0;
+}
+
 static int iostring_sub(lua_State* L) {
 
 	IOString *io = checkiostring(L);
@@ -522,6 +734,11 @@ static int iostring_sub(lua_State* L) {
 static int iostring_clear(lua_State* L) {
 
 	IOString *io = checkiostring(L);
+	if (io->cap > IOSTRING_KEEP_LEN) {
+		free(io->buf);
+		io->buf = io->init;
+		io->cap = IOSTRING_INIT_LEN;
+	}
 	io->size = 0;
 	return 0;
 }
@@ -545,7 +762,15 @@ static const struct luaL_Reg _pb[] = {
 static const struct luaL_Reg _c_iostring_m[] = {
 	{ "__tostring", iostring_str },
 	{ "__len", iostring_len },
+	{ "__gc", iostring_gc },
+	{ "__call", iostring_write },
 	{ "write", iostring_write },
+	{ "write_varint", iostring_write_varint },
+	{ "write_zigzag32", iostring_write_zigzag32 },
+	{ "write_zigzag64", iostring_write_zigzag64 },
+	{ "write_fixed32", iostring_write_fixed32 },
+	{ "write_fixed64", iostring_write_fixed64 },
+	{ "write_struct", iostring_write_struct },
 	{ "sub", iostring_sub },
 	{ "clear", iostring_clear },
 	{ NULL, NULL }
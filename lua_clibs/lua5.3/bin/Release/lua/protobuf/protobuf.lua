@@ -466,6 +466,24 @@ local function _AddPropertiesForExtensions(descriptor, message_meta)
   end
 end
 
+-- field number -> { name, type, repeated, nested fields }, for pb.decode_message
+local function _CompileFields(message_descriptor)
+    local fields = rawget(message_descriptor, "_pb_fields")
+    if fields then
+        return fields
+    end
+    fields = {}
+    rawset(message_descriptor, "_pb_fields", fields)
+    for _, field in ipairs(message_descriptor.fields) do
+        local nested
+        if field.type == FieldDescriptor.TYPE_MESSAGE then
+            nested = _CompileFields(field.message_type)
+        end
+        fields[field.number] = { field.name, field.type, field.label == FieldDescriptor.LABEL_REPEATED, nested }
+    end
+    return fields
+end
+
 local function _AddStaticMethods(message_meta)
     message_meta._member.RegisterExtension = function(extension_handle)
         extension_handle.containing_type = message_meta._descriptor
@@ -487,6 +505,11 @@ local function _AddStaticMethods(message_meta)
         message.MergeFromString(s)
         return message
     end
+
+    -- decode into a plain table in one C call, returns the table and the end position
+    message_meta._member.DecodeToTable = function(s, pos, pend)
+        return pb.decode_message(_CompileFields(message_meta._descriptor), s, pos, pend)
+    end
 end
 
 local function _IsPresent(descriptor, value)
@@ -642,11 +665,8 @@ local function _AddSerializePartialToStringMethod(message_descriptor, message_me
     end
 
     local _serialize_partial_to_iostring = function(self, iostring)
-        local w = iostring.write
-        local write = function(value)
-            w(iostring, value) 
-        end
-        _internal_serialize(self, write)
+        -- an IOString is callable, and the pb encoders append to it directly
+        _internal_serialize(self, iostring)
         return 
     end
 
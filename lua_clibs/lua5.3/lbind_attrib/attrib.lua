@@ -79,4 +79,28 @@ function attrib.new(e)
 	return setmetatable(obj, meta)
 end
 
+local pool_meta = {
+	__index = {
+		get = function(t, i, key)
+			return t.__cobj:get(i, t.__map[key])
+		end,
+		set = function(t, i, key, value)
+			t.__cobj:set(i, t.__map[key], value)
+		end,
+		read = function(t, key, out)
+			return t.__cobj:read(t.__map[key], out)
+		end,
+		write = function(t, key, values)
+			t.__cobj:write(t.__map[key], values)
+		end,
+	},
+	__len = function(t) return #t.__cobj end,
+}
+
+-- n entities sharing the expression e, stored and evaluated column by column
+function attrib.pool(e, n)
+	local obj = { __cobj = c.pool(e.__cobj, n), __map = e.__map, __e = e }
+	return setmetatable(obj, pool_meta)
+end
+
 return attrib
\ No newline at end of file
@@ -5,11 +5,20 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define ATTRIB_SSE
+#include <xmmintrin.h>
+#endif
 
-#define EXPRESSION_MAX 16
-#define REGISTER_MAX 64
 #define STACK_DEPTH_MAX 256
 
+// Blocks sized from an expression, register or entity count can be empty,
+// and malloc(0) may return NULL; one spare byte keeps them valid pointers
+// that can be offset into and passed to memset.
+#define BLOCK_ALLOC(sz) malloc((sz) + 1)
+
 #define OPT_REG 0
 #define OPT_ADD 1
 #define OPT_SUB 2
@@ -40,24 +49,57 @@ union rpn_stack {
 	uint32_t r_opt; // register index | operator
 };
 
+#define ARG_REG 0 // attribute register
+#define ARG_TMP 1 // evaluation temporary
+#define ARG_CONST 2 // constant pool
+#define ARG(kind, idx) ((idx) << 2 | (kind))
+#define ARG_KIND(arg) ((arg) & 3)
+#define ARG_INDEX(arg) ((arg) >> 2)
+
+// register-based instruction lowered from the rpn stack, OPT_REG is a move
+struct attrib_inst {
+	int op;
+	int dst; // ARG_REG or ARG_TMP
+	int a;
+	int b; // unused by OPT_REG, OPT_NEG and OPT_SQR
+};
+
 struct attrib_expression {
 	int er; // register index of expression
 	int depth;
+	int icount; // instruction count
+	int kcount; // constant count
+	int tcount; // temporary count
+	struct attrib_inst * code; // icount instructions followed by kcount constants
+	float * k;
 	union rpn_stack stack[1];
 };
 
+#define BITSET_WORDS(n) (((n) + 31) / 32)
+#define BITSET_TEST(set, i) ((set)[(i) >> 5] & (1u << ((i) & 31)))
+#define BITSET_SET(set, i) ((set)[(i) >> 5] |= (1u << ((i) & 31)))
+
+// Dirty sets are bitsets over the topological position of the expressions,
+// so walking the set bits in order evaluates the inputs before their users.
 struct attrib_e {
 	int ecount; // expression count
-	struct attrib_expression * exps[EXPRESSION_MAX];
+	int ecap;
+	struct attrib_expression ** exps;
 	int rcount; // register count
-	int *depend[REGISTER_MAX];
+	int words; // words of an expression bitset
+	int ** depend; // block of depend, emap, dmask and umask, built by attrib_einit
+	int * emap; // register -> topological position of its expression, or -1
+	uint32_t * dmask; // per register, expressions to dirty when it changes
+	uint32_t * umask; // per expression, expressions it needs, itself included
+	attrib_native native;
 };
 
 struct attrib {
 	struct attrib_e * e;
-	bool dirty[REGISTER_MAX];
-	float reg[REGISTER_MAX];
-	bool calc;
+	size_t cap; // size of the block holding reg, dirty and work
+	float * reg;
+	uint32_t * dirty;
+	uint32_t * work;
 };
 
 struct attrib *
@@ -69,38 +111,44 @@ attrib_new() {
 
 void
 attrib_delete(struct attrib * a) {
+	free(a->reg);
 	free(a);
 }
 
 void
 attrib_attach(struct attrib * a, struct attrib_e * e) {
+	size_t sz = sizeof(float) * e->rcount + sizeof(uint32_t) * e->words * 2;
+	if (sz > a->cap) {
+		free(a->reg);
+		a->reg = malloc(sz);
+		a->cap = sz;
+	}
 	a->e = e;
+	a->dirty = (uint32_t *)(a->reg + e->rcount);
+	a->work = a->dirty + e->words;
+	memset(a->reg, 0, sz);
 	{
 		int i;
-		for (i = 0; i < e->rcount; ++i) {
-			a->dirty[i] = true;
-			a->reg[i] = 0;
+		for (i = 0; i < e->ecount; ++i) {
+			BITSET_SET(a->dirty, i);
 		}
 	}
-	a->calc = false;
 }
 
 float
 attrib_write(struct attrib * a, int r, float val) {
+	if (a->e == NULL || (uint32_t)r >= (uint32_t)a->e->rcount) {
+		return 0.0f;
+	}
 	float ret = a->reg[r];
 	if (ret != val) {
 		a->reg[r] = val;
-		if (!a->dirty[r]) {
-			a->dirty[r] = true;
-			{
-				int i;
-				int * depend = a->e->depend[r];
-				if (depend) {
-					for (i = 0; depend[i] >= 0; ++i) {
-						a->dirty[depend[i]] = true;
-					}
-					a->calc = false;
-				}
+		{
+			int i;
+			int words = a->e->words;
+			const uint32_t * dmask = a->e->dmask + r * words;
+			for (i = 0; i < words; ++i) {
+				a->dirty[i] |= dmask[i];
 			}
 		}
 	}
@@ -109,89 +157,81 @@ attrib_write(struct attrib * a, int r, float val) {
 
 static void
 _calc_exp(struct attrib_expression * exp, float *reg) {
-	float v[STACK_DEPTH_MAX];
-	int vp = 0;
-	int i;
-	for (i = 0; exp->stack[i].r_opt != ~OPT_END; ++i) {
-		uint32_t r_opt = exp->stack[i].r_opt;
-		if ((int)r_opt < 0) {
-			r_opt = ~r_opt;
-			int opt = r_opt & OPT_MASK;
-			switch (opt) {
-			case OPT_REG:
-				assert(vp < STACK_DEPTH_MAX);
-				v[vp++] = reg[r_opt >> R_SHIFT];
-				break;
-			case OPT_ADD:
-				assert(vp >= 2);
-				v[vp - 2] += v[vp - 1];
-				--vp;
-				break;
-			case OPT_SUB:
-				assert(vp >= 2);
-				v[vp - 2] -= v[vp - 1];
-				--vp;
-				break;
-			case OPT_MUL:
-				assert(vp >= 2);
-				v[vp - 2] *= v[vp - 1];
-				--vp;
-				break;
-			case OPT_DIV:
-				assert(vp >= 2);
-				v[vp - 2] /= v[vp - 1];
-				--vp;
-				break;
-			case OPT_NEG:
-				assert(vp >= 1);
-				v[vp - 1] = -v[vp - 1];
-				break;
-			case OPT_SQR:
-				assert(vp >= 1);
-				v[vp - 1] *= v[vp - 1];
-				break;
-			default:
-				assert(0);
-			}
-		}
-		else {
-			assert(vp < STACK_DEPTH_MAX);
-			v[vp++] = exp->stack[i].constant;
+	float t[STACK_DEPTH_MAX];
+	float * base[3] = { reg, t, exp->k };
+	const struct attrib_inst * ins = exp->code;
+	const struct attrib_inst * end = ins + exp->icount;
+	for (; ins != end; ++ins) {
+		float a = base[ARG_KIND(ins->a)][ARG_INDEX(ins->a)];
+		float * dst = &base[ARG_KIND(ins->dst)][ARG_INDEX(ins->dst)];
+		switch (ins->op) {
+		case OPT_REG:
+			*dst = a;
+			break;
+		case OPT_ADD:
+			*dst = a + base[ARG_KIND(ins->b)][ARG_INDEX(ins->b)];
+			break;
+		case OPT_SUB:
+			*dst = a - base[ARG_KIND(ins->b)][ARG_INDEX(ins->b)];
+			break;
+		case OPT_MUL:
+			*dst = a * base[ARG_KIND(ins->b)][ARG_INDEX(ins->b)];
+			break;
+		case OPT_DIV:
+			*dst = a / base[ARG_KIND(ins->b)][ARG_INDEX(ins->b)];
+			break;
+		case OPT_NEG:
+			*dst = -a;
+			break;
+		case OPT_SQR:
+			*dst = a * a;
+			break;
+		default:
+			assert(0);
 		}
 	}
-	assert(vp == 1);
-	reg[exp->er] = v[0];
 }
 
+// evaluate the dirty expressions in the bitset work, in topological order
 static void
-_calc(struct attrib * a) {
+_calc(struct attrib * a, const uint32_t * work) {
 	struct attrib_e * e = a->e;
 	int i;
-	for (i = 0; i < e->ecount; ++i) {
-		struct attrib_expression * exp = e->exps[i];
-		int r = exp->er;
-		if (!a->dirty[r]) {
-			continue;
+	if (e->native) {
+		e->native(a->reg, work);
+	}
+	else {
+		for (i = 0; i < e->ecount; ++i) {
+			if (work[i >> 5] == 0) { // skip a clean word
+				i |= 31;
+				continue;
+			}
+			if (BITSET_TEST(work, i)) {
+				_calc_exp(e->exps[i], a->reg);
+			}
 		}
-		_calc_exp(exp, a->reg);
+	}
+	for (i = 0; i < e->words; ++i) {
+		a->dirty[i] &= ~work[i];
 	}
 }
 
 float
 attrib_read(struct attrib * a, int r) {
-	uint32_t idx = r;
-	if (!a->calc) {
-		_calc(a);
-		assert(a->e);
-		{
-			int i;
-			for (i = 0; i < a->e->rcount; ++i) {
-				a->dirty[i] = false;
-			}
+	if (a->e == NULL || (uint32_t)r >= (uint32_t)a->e->rcount) {
+		return 0.0f;
+	}
+	int x = a->e->emap[r];
+	if (x >= 0 && BITSET_TEST(a->dirty, x)) {
+		int i;
+		int words = a->e->words;
+		const uint32_t * umask = a->e->umask + x * words;
+		for (i = 0; i < words; ++i) {
+			a->work[i] = a->dirty[i] & umask[i];
 		}
-		a->calc = true;
+		_calc(a, a->work);
 	}
-	return (idx < REGISTER_MAX) ? a->reg[idx] : 0.0f;
+	return a->reg[r];
 }
 
 struct attrib_e *
@@ -205,10 +245,15 @@ void
 attrib_edelete(struct attrib_e * e) {
 	int i;
 	for (i = 0; i < e->ecount; ++i) {
+		free(e->exps[i]->code);
 		free(e->exps[i]);
 	}
-	for (i = 0; i < e->rcount; ++i) {
-		free(e->depend[i]);
+	free(e->exps);
+	if (e->depend) {
+		for (i = 0; i < e->rcount; ++i) {
+			free(e->depend[i]);
+		}
+		free(e->depend);
 	}
 	free(e);
 }
@@ -362,15 +407,25 @@ _compile(const char * expression, union rpn_stack * rs, const char ** err, int *
 						break;
 					}
 					else {
+						// n is the depth of the rpn stack emitted so far, so an
+						// operator without its operands is caught here, as in "2*-R3"
 						switch (to) {
 						case OPT_ADD:
 						case OPT_SUB:
 						case OPT_MUL:
 						case OPT_DIV:
+							if (n < 2) {
+								*err = "Operator syntax error";
+								return -1;
+							}
 							n--;
 							break;
 						case OPT_NEG:
 						case OPT_SQR:
+							if (n < 1) {
+								*err = "Operator syntax error";
+								return -1;
+							}
 							break;
 						default:
 							assert(0);
@@ -409,6 +464,11 @@ attrib_compile(const char * expression, const char ** err) {
 	if (n > 0) {
 		struct attrib_expression * exp = malloc(sizeof(*exp) + sizeof(union rpn_stack) * n);
 		exp->er = -1;
+		exp->icount = 0;
+		exp->kcount = 0;
+		exp->tcount = 0;
+		exp->code = NULL;
+		exp->k = NULL;
 		memcpy(exp->stack, rs, sizeof(union rpn_stack) * n);
 		exp->stack[n].r_opt = ~OPT_END;
 		exp->depth = depth;
@@ -429,15 +489,20 @@ attrib_epush(struct attrib_e * e, int r, const char * expression) {
 		}
 	}
 	struct attrib_expression * exp = attrib_compile(expression, &err);
+	if (exp == NULL) {
+		return err;
+	}
 	exp->er = r;
+	if (e->ecount >= e->ecap) {
+		e->ecap = (e->ecap + 1) * 2;
+		e->exps = realloc(e->exps, e->ecap * sizeof(struct attrib_expression *));
+	}
 	e->exps[e->ecount++] = exp;
 	return err;
 }
 
 static int
 _top_sort(struct attrib_expression ** exp, int n) {
-	assert(n < EXPRESSION_MAX);
-	struct attrib_expression *tmp[EXPRESSION_MAX];
 	int i, j;
 	int max = 0;
 	for (i = 0; i < n; ++i) {
@@ -457,10 +522,9 @@ _top_sort(struct attrib_expression ** exp, int n) {
 	}
 	++max;
 
-	assert(max < REGISTER_MAX);
-
-	bool rflag[REGISTER_MAX];
-	memset(rflag, 0, sizeof(rflag));
+	struct attrib_expression ** tmp = BLOCK_ALLOC(n * sizeof(struct attrib_expression *));
+	bool * rflag = malloc(max * sizeof(bool));
+	memset(rflag, 0, max * sizeof(bool));
 	for (i = 0; i < n; ++i) {
 		rflag[exp[i]->er] = true;
 	}
@@ -492,10 +556,20 @@ _top_sort(struct attrib_expression ** exp, int n) {
 			continue;
 		}
 		if (count == last_count) {
-			return -1;
+			// put the rest back, so attrib_edelete still frees them
+			for (i = 0; i < n; ++i) {
+				if (exp[i]) {
+					tmp[p++] = exp[i];
+				}
+			}
+			max = -1;
+			break;
 		}
+		last_count = count;
 	} while (count > 0);
 	memcpy(exp, tmp, n * sizeof(struct attrib_expression *));
+	free(rflag);
+	free(tmp);
 	return max;
 }
 
@@ -554,9 +628,8 @@ _gen_depend(struct attrib_e * e) {
 			d[p] = -1;
 		}
 	}
+	bool * mark = malloc(sizeof(bool) * e->rcount);
 	for (i = 0; i < e->rcount; ++i) {
-		assert(e->rcount < REGISTER_MAX);
-		bool mark[REGISTER_MAX];
 		memset(mark, 0, sizeof(bool) * e->rcount);
 		int * root = e->depend[i];
 		if (root) {
@@ -570,6 +643,163 @@ _gen_depend(struct attrib_e * e) {
 			root[p] = -1;
 		}
 	}
+	free(mark);
+}
+
+static void
+_gen_mask(struct attrib_e * e) {
+	int i, j;
+	int words = e->words;
+	for (i = 0; i < e->rcount; ++i) {
+		e->emap[i] = -1;
+	}
+	for (i = 0; i < e->ecount; ++i) {
+		e->emap[e->exps[i]->er] = i;
+	}
+	for (i = 0; i < e->rcount; ++i) {
+		// writing an expression register dirties the expression itself, as before
+		if (e->emap[i] >= 0) {
+			BITSET_SET(e->dmask + i * words, e->emap[i]);
+		}
+		int * d = e->depend[i];
+		if (d) {
+			for (j = 0; d[j] >= 0; ++j) {
+				BITSET_SET(e->dmask + i * words, e->emap[d[j]]);
+			}
+		}
+	}
+	for (i = 0; i < e->ecount; ++i) {
+		const uint32_t * dmask = e->dmask + e->exps[i]->er * words;
+		for (j = 0; j < e->ecount; ++j) {
+			if (BITSET_TEST(dmask, j)) {
+				BITSET_SET(e->umask + j * words, i);
+			}
+		}
+	}
+}
+
+struct lower_slot {
+	int arg; // ARG_REG or ARG_TMP, or -1 for a constant not in the pool yet
+	float constant;
+};
+
+static int
+_lower_arg(struct lower_slot * s, float * k, int * kcount) {
+	if (s->arg >= 0) {
+		return s->arg;
+	}
+	int i;
+	for (i = 0; i < *kcount; ++i) {
+		if (memcmp(&k[i], &s->constant, sizeof(float)) == 0) {
+			return ARG(ARG_CONST, i);
+		}
+	}
+	k[*kcount] = s->constant;
+	return ARG(ARG_CONST, (*kcount)++);
+}
+
+static bool
+_fold(int opt, float a, float b, float * r) {
+	switch (opt) {
+	case OPT_ADD:
+		*r = a + b;
+		break;
+	case OPT_SUB:
+		*r = a - b;
+		break;
+	case OPT_MUL:
+		*r = a * b;
+		break;
+	case OPT_DIV:
+		*r = a / b;
+		break;
+	case OPT_NEG:
+		*r = -a;
+		break;
+	case OPT_SQR:
+		*r = a * a;
+		break;
+	default:
+		assert(0);
+	}
+	// keep inf and nan out of the constant pool, so generated c stays valid
+	return isfinite(*r);
+}
+
+// Lower the rpn stack to register instructions. Stack slot i evaluates into
+// temporary i, operations on constants are folded, and the last instruction
+// writes the expression register directly. Returns an error if an operator
+// lacks its operands, which _compile should already have rejected.
+static const char *
+_lower(struct attrib_expression * exp) {
+	struct lower_slot s[STACK_DEPTH_MAX];
+	struct attrib_inst code[STACK_DEPTH_MAX];
+	float k[STACK_DEPTH_MAX];
+	int sp = 0;
+	int n = 0;
+	int kcount = 0;
+	int i;
+	for (i = 0; exp->stack[i].r_opt != ~OPT_END; ++i) {
+		uint32_t r_opt = exp->stack[i].r_opt;
+		if ((int)r_opt >= 0) {
+			s[sp].arg = -1;
+			s[sp].constant = exp->stack[i].constant;
+			++sp;
+			continue;
+		}
+		r_opt = ~r_opt;
+		int opt = r_opt & OPT_MASK;
+		if (opt == OPT_REG) {
+			s[sp].arg = ARG(ARG_REG, r_opt >> R_SHIFT);
+			++sp;
+			continue;
+		}
+		bool unary = (opt == OPT_NEG || opt == OPT_SQR);
+		if (sp < (unary ? 1 : 2)) {
+			return "Operator syntax error";
+		}
+		struct lower_slot * a = &s[unary ? sp - 1 : sp - 2];
+		struct lower_slot * b = unary ? a : &s[sp - 1];
+		float r;
+		if (a->arg < 0 && b->arg < 0 && _fold(opt, a->constant, b->constant, &r)) {
+			a->constant = r;
+		}
+		else {
+			struct attrib_inst * ins = &code[n++];
+			ins->op = opt;
+			ins->a = _lower_arg(a, k, &kcount);
+			ins->b = unary ? 0 : _lower_arg(b, k, &kcount);
+			ins->dst = ARG(ARG_TMP, (int)(a - s));
+			a->arg = ins->dst;
+			if (ARG_INDEX(ins->dst) >= exp->tcount) {
+				exp->tcount = ARG_INDEX(ins->dst) + 1;
+			}
+		}
+		if (!unary) {
+			--sp;
+		}
+	}
+	if (sp != 1) {
+		return "Operator syntax error";
+	}
+	if (s[0].arg >= 0 && ARG_KIND(s[0].arg) == ARG_TMP) {
+		// the last instruction produced slot 0
+		code[n - 1].dst = ARG(ARG_REG, exp->er);
+	}
+	else {
+		struct attrib_inst * ins = &code[n++];
+		ins->op = OPT_REG;
+		ins->a = _lower_arg(&s[0], k, &kcount);
+		ins->b = 0;
+		ins->dst = ARG(ARG_REG, exp->er);
+	}
+	exp->code = malloc(sizeof(struct attrib_inst) * n + sizeof(float) * kcount);
+	exp->k = (float *)(exp->code + n);
+	memcpy(exp->code, code, sizeof(struct attrib_inst) * n);
+	memcpy(exp->k, k, sizeof(float) * kcount);
+	exp->icount = n;
+	exp->kcount = kcount;
+	return NULL;
 }
 
 const char *
@@ -580,14 +810,321 @@ attrib_einit(struct attrib_e * e) {
 	}
 	assert(e->rcount == 0);
 	e->rcount = rcount;
-	memset(e->depend, 0, rcount * sizeof(int *));
+	e->words = BITSET_WORDS(e->ecount);
+	{
+		size_t dsz = rcount * sizeof(int *);
+		size_t esz = rcount * sizeof(int);
+		size_t msz = (rcount + e->ecount) * e->words * sizeof(uint32_t);
+		char * block = BLOCK_ALLOC(dsz + esz + msz);
+		memset(block, 0, dsz + esz + msz);
+		e->depend = (int **)block;
+		e->emap = (int *)(block + dsz);
+		e->dmask = (uint32_t *)(block + dsz + esz);
+		e->umask = e->dmask + rcount * e->words;
+	}
 	_gen_depend(e);
+	_gen_mask(e);
+	{
+		int i;
+		for (i = 0; i < e->ecount; ++i) {
+			const char * err = _lower(e->exps[i]);
+			if (err) {
+				return err;
+			}
+		}
+	}
 
 	return NULL;
 }
 
+#define POOL_CHUNK 256 // entities evaluated per pass of one instruction
+
+// n entities sharing one attrib_e, one column of n floats per register
+struct attrib_pool {
+	struct attrib_e * e;
+	int n; // entity count
+	float * col; // rcount columns
+	int * lo; // dirty entity range [lo, hi) per register
+	int * hi;
+	float * tmp; // temporary and constant columns of POOL_CHUNK floats
+	bool calc;
+};
+
+struct attrib_pool *
+attrib_pool_new(struct attrib_e * e, int n) {
+	assert(n >= 0);
+	int rcount = e->rcount;
+	int tcount = 0;
+	int i;
+	for (i = 0; i < e->ecount; ++i) {
+		struct attrib_expression * exp = e->exps[i];
+		if (exp->tcount + exp->kcount > tcount) {
+			tcount = exp->tcount + exp->kcount;
+		}
+	}
+	struct attrib_pool * p = malloc(sizeof(*p));
+	p->e = e;
+	p->n = n;
+	p->col = BLOCK_ALLOC(sizeof(float) * rcount * n);
+	memset(p->col, 0, sizeof(float) * rcount * n);
+	p->lo = BLOCK_ALLOC(sizeof(int) * rcount * 2);
+	p->hi = p->lo + rcount;
+	for (i = 0; i < rcount; ++i) {
+		p->lo[i] = 0;
+		p->hi[i] = n;
+	}
+	p->tmp = BLOCK_ALLOC(sizeof(float) * POOL_CHUNK * tcount);
+	p->calc = false;
+	return p;
+}
+
+void
+attrib_pool_delete(struct attrib_pool * p) {
+	free(p->col);
+	free(p->lo);
+	free(p->tmp);
+	free(p);
+}
+
+int
+attrib_pool_size(struct attrib_pool * p) {
+	return p->n;
+}
+
+int
+attrib_pool_registers(struct attrib_pool * p) {
+	return p->e->rcount;
+}
+
+static void
+_pool_dirty(struct attrib_pool * p, int r, int lo, int hi) {
+	if (p->lo[r] > lo) {
+		p->lo[r] = lo;
+	}
+	if (p->hi[r] < hi) {
+		p->hi[r] = hi;
+	}
+}
+
+static void
+_pool_touch(struct attrib_pool * p, int r, int lo, int hi) {
+	int * depend = p->e->depend[r];
+	// writing an expression register dirties the expression itself, as attrib_write does
+	if (p->e->emap[r] >= 0) {
+		_pool_dirty(p, r, lo, hi);
+		p->calc = false;
+	}
+	if (depend) {
+		int i;
+		for (i = 0; depend[i] >= 0; ++i) {
+			_pool_dirty(p, depend[i], lo, hi);
+		}
+		p->calc = false;
+	}
+}
+
+float
+attrib_pool_write(struct attrib_pool * p, int i, int r, float val) {
+	assert(i >= 0 && i < p->n && r >= 0 && r < p->e->rcount);
+	float * v = &p->col[r * p->n + i];
+	float ret = *v;
+	if (ret != val) {
+		*v = val;
+		_pool_touch(p, r, i, i + 1);
+	}
+	return ret;
+}
+
+void
+attrib_pool_writes(struct attrib_pool * p, int r, const float * val) {
+	assert(r >= 0 && r < p->e->rcount);
+	float * v = &p->col[r * p->n];
+	int lo = p->n;
+	int hi = 0;
+	int i;
+	for (i = 0; i < p->n; ++i) {
+		if (v[i] != val[i]) {
+			v[i] = val[i];
+			if (lo > i) {
+				lo = i;
+			}
+			hi = i + 1;
+		}
+	}
+	if (lo < hi) {
+		_pool_touch(p, r, lo, hi);
+	}
+}
+
+// dst = a op b over n floats, dst may alias a or b
+static void
+_pool_op(int op, float * dst, const float * a, const float * b, int n) {
+	int i = 0;
+#ifdef ATTRIB_SSE
+	switch (op) {
+	case OPT_REG:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_loadu_ps(a + i));
+		}
+		break;
+	case OPT_ADD:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		}
+		break;
+	case OPT_SUB:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		}
+		break;
+	case OPT_MUL:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		}
+		break;
+	case OPT_DIV:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_div_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		}
+		break;
+	case OPT_NEG:
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(dst + i, _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(a + i)));
+		}
+		break;
+	case OPT_SQR:
+		for (; i + 4 <= n; i += 4) {
+			__m128 x = _mm_loadu_ps(a + i);
+			_mm_storeu_ps(dst + i, _mm_mul_ps(x, x));
+		}
+		break;
+	}
+#endif
+	for (; i < n; ++i) {
+		switch (op) {
+		case OPT_REG:
+			dst[i] = a[i];
+			break;
+		case OPT_ADD:
+			dst[i] = a[i] + b[i];
+			break;
+		case OPT_SUB:
+			dst[i] = a[i] - b[i];
+			break;
+		case OPT_MUL:
+			dst[i] = a[i] * b[i];
+			break;
+		case OPT_DIV:
+			dst[i] = a[i] / b[i];
+			break;
+		case OPT_NEG:
+			dst[i] = -a[i];
+			break;
+		case OPT_SQR:
+			dst[i] = a[i] * a[i];
+			break;
+		default:
+			assert(0);
+		}
+	}
+}
+
+static float *
+_pool_arg(struct attrib_pool * p, struct attrib_expression * exp, int arg, int offset) {
+	switch (ARG_KIND(arg)) {
+	case ARG_REG:
+		return &p->col[ARG_INDEX(arg) * p->n + offset];
+	case ARG_TMP:
+		return &p->tmp[ARG_INDEX(arg) * POOL_CHUNK];
+	default:
+		return &p->tmp[(exp->tcount + ARG_INDEX(arg)) * POOL_CHUNK];
+	}
+}
+
+static void
+_pool_calc_exp(struct attrib_pool * p, struct attrib_expression * exp, int lo, int hi) {
+	int i, j;
+	// constants are broadcast to columns once, after the temporaries
+	for (i = 0; i < exp->kcount; ++i) {
+		float * k = &p->tmp[(exp->tcount + i) * POOL_CHUNK];
+		for (j = 0; j < POOL_CHUNK; ++j) {
+			k[j] = exp->k[i];
+		}
+	}
+	int offset;
+	for (offset = lo; offset < hi; offset += POOL_CHUNK) {
+		int n = hi - offset < POOL_CHUNK ? hi - offset : POOL_CHUNK;
+		for (i = 0; i < exp->icount; ++i) {
+			struct attrib_inst * ins = &exp->code[i];
+			float * a = _pool_arg(p, exp, ins->a, offset);
+			float * b = (ins->op == OPT_REG || ins->op == OPT_NEG || ins->op == OPT_SQR) ? a : _pool_arg(p, exp, ins->b, offset);
+			_pool_op(ins->op, _pool_arg(p, exp, ins->dst, offset), a, b, n);
+		}
+	}
+}
+
+static void
+_pool_calc(struct attrib_pool * p) {
+	struct attrib_e * e = p->e;
+	int i;
+	for (i = 0; i < e->ecount; ++i) {
+		struct attrib_expression * exp = e->exps[i];
+		int r = exp->er;
+		if (p->lo[r] < p->hi[r]) {
+			_pool_calc_exp(p, exp, p->lo[r], p->hi[r]);
+		}
+	}
+	for (i = 0; i < e->rcount; ++i) {
+		p->lo[i] = p->n;
+		p->hi[i] = 0;
+	}
+	p->calc = true;
+}
+
+float
+attrib_pool_read(struct attrib_pool * p, int i, int r) {
+	assert(i >= 0 && i < p->n && r >= 0 && r < p->e->rcount);
+	if (!p->calc) {
+		_pool_calc(p);
+	}
+	return p->col[r * p->n + i];
+}
+
+const float *
+attrib_pool_reads(struct attrib_pool * p, int r) {
+	assert(r >= 0 && r < p->e->rcount);
+	if (!p->calc) {
+		_pool_calc(p);
+	}
+	return &p->col[r * p->n];
+}
+
 #include <stdio.h>
 
+static void
+_printarg(int arg) {
+	switch (ARG_KIND(arg)) {
+	case ARG_REG:
+		printf("reg[%d]", ARG_INDEX(arg));
+		break;
+	case ARG_TMP:
+		printf("t[%d]", ARG_INDEX(arg));
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static void
+_printsrc(struct attrib_expression * exp, int arg) {
+	if (ARG_KIND(arg) == ARG_CONST) {
+		printf("(float)%.9e", exp->k[ARG_INDEX(arg)]);
+	}
+	else {
+		_printarg(arg);
+	}
+}
+
 static void
 _dumpe(struct attrib_expression * exp) {
 	int i = 0;
@@ -635,6 +1172,7 @@ attrib_edump(struct attrib_e * e) {
 		printf("R%d = ", e->exps[i]->er);
 		_dumpe(e->exps[i]);
 	}
+
 	int j;
 	for (i = 0; i < e->rcount; ++i) {
 		int * d = e->depend[i];
@@ -646,4 +1184,64 @@ attrib_edump(struct attrib_e * e) {
 			printf("\n");
 		}
 	}
+	printf("----------------\n");
+	attrib_egen(e, "attrib_calc");
+}
+
+void
+attrib_egen(struct attrib_e * e, const char * name) {
+	static const char * opname[] = { "", " + ", " - ", " * ", " / " };
+	int i, j;
+	int tcount = 0;
+	for (i = 0; i < e->ecount; ++i) {
+		if (e->exps[i]->tcount > tcount) {
+			tcount = e->exps[i]->tcount;
+		}
+	}
+	printf("void\n%s(float * reg, const uint32_t * dirty) {\n", name);
+	if (tcount > 0) {
+		printf("\tfloat t[%d];\n", tcount);
+	}
+	for (i = 0; i < e->ecount; ++i) {
+		struct attrib_expression * exp = e->exps[i];
+		printf("\tif (dirty[%d] & 0x%xu) {\n", i >> 5, 1u << (i & 31));
+		for (j = 0; j < exp->icount; ++j) {
+			struct attrib_inst * ins = &exp->code[j];
+			printf("\t\t");
+			_printarg(ins->dst);
+			printf(" = ");
+			switch (ins->op) {
+			case OPT_REG:
+				_printsrc(exp, ins->a);
+				break;
+			case OPT_ADD:
+			case OPT_SUB:
+			case OPT_MUL:
+			case OPT_DIV:
+				_printsrc(exp, ins->a);
+				printf("%s", opname[ins->op]);
+				_printsrc(exp, ins->b);
+				break;
+			case OPT_NEG:
+				printf("-");
+				_printsrc(exp, ins->a);
+				break;
+			case OPT_SQR:
+				_printsrc(exp, ins->a);
+				printf(" * ");
+				_printsrc(exp, ins->a);
+				break;
+			default:
+				assert(0);
+			}
+			printf(";\n");
+		}
+		printf("\t}\n");
+	}
+	printf("}\n");
+}
+
+void
+attrib_ebind(struct attrib_e * e, attrib_native f) {
+	e->native = f;
 }
@@ -1,14 +1,22 @@
 #ifndef ATTRIB_CALC_H
 #define ATTRIB_CALC_H
 
+#include <stdint.h>
+
 struct attrib;
 struct attrib_e;
+struct attrib_pool;
+
+// evaluates the expressions in the dirty bitset, see attrib_egen
+typedef void (*attrib_native)(float * reg, const uint32_t * dirty);
 
 struct attrib_e * attrib_enew();
 const char * attrib_epush(struct attrib_e * e, int r, const char * expression);
 const char * attrib_einit(struct attrib_e * e);
 void attrib_edelete(struct attrib_e * e);
 void attrib_edump(struct attrib_e * e);
+void attrib_egen(struct attrib_e * e, const char * name);
+void attrib_ebind(struct attrib_e * e, attrib_native f);
 
 struct attrib *attrib_new();
 void attrib_delete(struct attrib * a);
@@ -16,4 +24,13 @@ void attrib_attach(struct attrib * a, struct attrib_e *);
 float attrib_write(struct attrib * a, int r, float val);
 float attrib_read(struct attrib * a, int r);
 
+struct attrib_pool * attrib_pool_new(struct attrib_e * e, int n);
+void attrib_pool_delete(struct attrib_pool * p);
+int attrib_pool_size(struct attrib_pool * p);
+int attrib_pool_registers(struct attrib_pool * p);
+float attrib_pool_write(struct attrib_pool * p, int i, int r, float val);
+void attrib_pool_writes(struct attrib_pool * p, int r, const float * val);
+float attrib_pool_read(struct attrib_pool * p, int i, int r);
+const float * attrib_pool_reads(struct attrib_pool * p, int r);
+
 #endif
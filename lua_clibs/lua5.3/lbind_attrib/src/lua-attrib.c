@@ -134,6 +134,148 @@ _expression_update(lua_State *L) {
 	return 0;
 }
 
+static int
+_pool(lua_State *L) {
+	struct attrib_e ** e = lua_touserdata(L, 1);
+	if (e == NULL) {
+		luaL_error(L, "Need expression");
+	}
+	if (*e == NULL) {
+		luaL_error(L, "Empty expression");
+	}
+	int n = (int)luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "Invalid size");
+	struct attrib_pool ** box = lua_newuserdata(L, sizeof(struct attrib_pool *));
+	*box = attrib_pool_new(*e, n);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int
+_pool_delete(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	if (*box) {
+		attrib_pool_delete(*box);
+		*box = NULL;
+	}
+
+	return 0;
+}
+
+static int
+_pool_size(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	lua_pushinteger(L, attrib_pool_size(*box));
+
+	return 1;
+}
+
+// pool:get(i, r), i is 1-based
+static int
+_pool_get(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	int i = (int)luaL_checkinteger(L, 2);
+	int r = (int)luaL_checkinteger(L, 3);
+	luaL_argcheck(L, i >= 1 && i <= attrib_pool_size(*box), 2, "Invalid index");
+	luaL_argcheck(L, r >= 0 && r < attrib_pool_registers(*box), 3, "Invalid register");
+	lua_pushnumber(L, attrib_pool_read(*box, i - 1, r));
+
+	return 1;
+}
+
+// pool:set(i, r, v)
+static int
+_pool_set(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	int i = (int)luaL_checkinteger(L, 2);
+	int r = (int)luaL_checkinteger(L, 3);
+	float v = (float)luaL_checknumber(L, 4);
+	luaL_argcheck(L, i >= 1 && i <= attrib_pool_size(*box), 2, "Invalid index");
+	luaL_argcheck(L, r >= 0 && r < attrib_pool_registers(*box), 3, "Invalid register");
+	attrib_pool_write(*box, i - 1, r, v);
+
+	return 0;
+}
+
+// pool:read(r [, t]) returns register r of every entity as an array, t is reused if given
+static int
+_pool_read(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	int r = (int)luaL_checkinteger(L, 2);
+	luaL_argcheck(L, r >= 0 && r < attrib_pool_registers(*box), 2, "Invalid register");
+	int n = attrib_pool_size(*box);
+	if (lua_istable(L, 3)) {
+		lua_settop(L, 3);
+	}
+	else {
+		lua_settop(L, 2);
+		lua_createtable(L, n, 0);
+	}
+	const float * v = attrib_pool_reads(*box, r);
+	int i;
+	for (i = 0; i < n; ++i) {
+		lua_pushnumber(L, v[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+// pool:write(r, v) sets register r of every entity, v is an array or one number for all
+static int
+_pool_write(lua_State *L) {
+	struct attrib_pool ** box = lua_touserdata(L, 1);
+	int r = (int)luaL_checkinteger(L, 2);
+	luaL_argcheck(L, r >= 0 && r < attrib_pool_registers(*box), 2, "Invalid register");
+	int n = attrib_pool_size(*box);
+	int i;
+	// gather the column first, so the dependents are dirtied once
+	float * v = lua_newuserdata(L, sizeof(float) * n);
+	if (lua_istable(L, 3)) {
+		for (i = 0; i < n; ++i) {
+			int isnum;
+			lua_rawgeti(L, 3, i + 1);
+			v[i] = (float)lua_tonumberx(L, -1, &isnum);
+			luaL_argcheck(L, isnum, 3, lua_pushfstring(L, "number expected at [%d]", i + 1));
+			lua_pop(L, 1);
+		}
+	}
+	else {
+		float x = (float)luaL_checknumber(L, 3);
+		for (i = 0; i < n; ++i) {
+			v[i] = x;
+		}
+	}
+	attrib_pool_writes(*box, r, v);
+
+	return 0;
+}
+
+static void
+_pushpool(lua_State *L) {
+	lua_createtable(L, 0, 3);
+	lua_createtable(L, 0, 5);
+	lua_pushcfunction(L, _pool_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, _pool_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, _pool_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, _pool_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, _pool_size);
+	lua_setfield(L, -2, "size");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, _pool_size);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, _pool_delete);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcclosure(L, _pool, 1);
+}
+
 static void
 _pushattrib(lua_State *L) {
 	lua_createtable(L, 0, 3);
@@ -163,11 +305,13 @@ luaopen_attrib_c(lua_State *L) {
 
 	int top = lua_gettop(L);
 
-	lua_createtable(L, 0, 2);
+	lua_createtable(L, 0, 3);
 	_pushattrib(L);
 	lua_setfield(L, -2, "attrib");
 	_pushexpression(L);
 	lua_setfield(L, -2, "expression");
+	_pushpool(L);
+	lua_setfield(L, -2, "pool");
 
 	assert(1 == lua_gettop(L) - top);
 	return 1;
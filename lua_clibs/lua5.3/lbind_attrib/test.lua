@@ -18,3 +18,21 @@ a("力量",1)
 for k,v in pairs(a) do
 	print(k,v)
 end
+
+local p = attrib.pool(e, 4)
+
+p:write("力量", { 1, 2, 3, 4 })
+print(table.concat(p:read "防御", " "))
+
+p:write("力量", 2)
+p:set(4, "力量", 5)
+print(p:get(4, "攻击"), table.concat(p:read "防御", " "))
+
+-- writing an expression register is recomputed on the next read, as with attrib
+a["攻击"] = 100
+p:write("攻击", 100)
+print(a["攻击"], table.concat(p:read "攻击", " "))
+assert(a["攻击"] == 40 and p:get(4, "攻击") == 50)
+
+-- an operator without its operands is rejected when the expression is built
+assert(not pcall(attrib.expression, { "攻击 = 2 * - 力量" }))
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef ABENCH_POOL
+#include "../../lbind_attrib/src/attrib.h"
+#else
+#include "attrib.h"
+#endif
+
+// Micro-benchmark : evaluations per second of an attribute sheet.
+// Usage : abench [entities] [rounds]
+// Build it against ../../lbind_attrib/src/attrib.c to compare the evaluators,
+// with -DABENCH_POOL (as "make abench_compiled" does) it includes that attrib.h
+// and also measures the same work on an attrib pool.
+
+int
+main(int argc, char *argv[]) {
+	int entities = argc > 1 ? atoi(argv[1]) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 100;
+	const char * exp[] = {
+		"R0*10+R1*2",	// R8 attack
+		"(R8-3)*R0",	// R9 defense
+		"R2*(1+R3/100)",	// R10 speed
+		"R8*(1+R4/100)+R5",	// R11 damage
+		"R9/(R9+100)",	// R12 reduce
+		"R11*(1-R12)+R6^",	// R13 hit
+		"-(-R10*(2+R7/(1.2-0.3)))",	// R14 dodge
+		"R13+R14*0.5+2*3",	// R15 power
+	};
+	int n = sizeof(exp) / sizeof(exp[0]);
+	struct attrib_e * ae = attrib_enew();
+	int i, j;
+	for (i=0;i<n;i++) {
+		const char * err = attrib_epush(ae, 8+i, exp[i]);
+		if (err) {
+			printf("%s : %s\n",exp[i], err);
+			exit(1);
+		}
+	}
+	const char * err = attrib_einit(ae);
+	if (err) {
+		printf("%s\n",err);
+		exit(1);
+	}
+
+	struct attrib ** a = malloc(entities * sizeof(struct attrib *));
+	for (i=0;i<entities;i++) {
+		a[i] = attrib_new();
+		attrib_attach(a[i], ae);
+		for (j=0;j<8;j++) {
+			attrib_write(a[i], j, (float)(i % 7 + j));
+		}
+	}
+
+	double sum = 0;
+	clock_t t = clock();
+	for (j=0;j<rounds;j++) {
+		for (i=0;i<entities;i++) {
+			// a buff changes a base attribute, every expression is recomputed
+			attrib_write(a[i], j & 7, (float)(i + j));
+			sum += attrib_read(a[i], 15);
+		}
+	}
+	double sec = (double)(clock() - t) / CLOCKS_PER_SEC;
+	double evals = (double)entities * rounds * n;
+	printf("%d entities x %d rounds : %.3f s, %.0f evaluations/s (%g)\n",
+		entities, rounds, sec, sec > 0 ? evals / sec : 0, sum);
+
+#ifdef ABENCH_POOL
+	struct attrib_pool * p = attrib_pool_new(ae, entities);
+	float * v = malloc(entities * sizeof(float));
+	for (j=0;j<8;j++) {
+		for (i=0;i<entities;i++) {
+			v[i] = (float)(i % 7 + j);
+		}
+		attrib_pool_writes(p, j, v);
+	}
+	sum = 0;
+	t = clock();
+	for (j=0;j<rounds;j++) {
+		for (i=0;i<entities;i++) {
+			v[i] = (float)(i + j);
+		}
+		attrib_pool_writes(p, j & 7, v);
+		const float * r = attrib_pool_reads(p, 15);
+		for (i=0;i<entities;i++) {
+			sum += r[i];
+		}
+	}
+	sec = (double)(clock() - t) / CLOCKS_PER_SEC;
+	printf("pool : %.3f s, %.0f evaluations/s (%g)\n",
+		sec, sec > 0 ? evals / sec : 0, sum);
+	free(v);
+	attrib_pool_delete(p);
+#endif
+
+	for (i=0;i<entities;i++) {
+		attrib_delete(a[i]);
+	}
+	free(a);
+	attrib_edelete(ae);
+	return 0;
+}
@@ -0,0 +1,199 @@
+-- lua bench.lua [width] [height] [queries] [depth]
+-- Build the old and the new module and run this script with each of them
+-- (via LUA_CPATH) to compare the node expansions per second of
+-- pathfinding.path. Only the weighted map ('A'..'Z') means the same to both;
+-- builds before jps read '#' as a free cell, so the '#' benchmarks run only
+-- where '#' blocks.
+
+local pf = require "pathfinding"
+
+local width = tonumber(arg[1]) or 512
+local height = tonumber(arg[2]) or 512
+local queries = tonumber(arg[3]) or 1000
+local depth = tonumber(arg[4]) or 1024
+
+math.randomseed(1)
+
+-- the map, and the weight of each cell at y * width + x
+local function newmap(weighted)
+	local obstacle = {}
+	local weight = {}
+	for i = 1, height do
+		local line = {}
+		for j = 1, width do
+			local r = math.random()
+			local w = 0
+			if r < 0.1 then
+				line[j] = weighted and "Z" or "#"
+				w = weighted and 26 or 255
+			elseif weighted and r < 0.15 then
+				w = math.random(0, 5)
+				line[j] = string.char(string.byte "A" + w)
+				w = w + 1
+			else
+				line[j] = "."
+			end
+			weight[(i - 1) * width + j - 1] = w
+		end
+		obstacle[i] = table.concat(line)
+	end
+	return pf.new {
+		width = width,
+		height = height,
+		obstacle = obstacle,
+	}, weight
+end
+
+local weighted, weights = newmap(true)
+local blocked = newmap(false)
+local blocks = pf.block(pf.new { width = 1, height = 1, obstacle = { "#" } }, 0, 0) ~= 0
+
+local q = {}
+for i = 1, queries do
+	local sx = math.random(0, width - 1)
+	local sy = math.random(0, height - 1)
+	-- keep the goal in reach of the search depth
+	local ex = math.min(width - 1, math.max(0, sx + math.random(-32, 32)))
+	local ey = math.min(height - 1, math.max(0, sy + math.random(-32, 32)))
+	q[i] = { sx, sy, ex, ey }
+end
+
+local OFF = {
+	{ -1, -1, 7 }, { 0, -1, 5 }, { 1, -1, 7 }, { 1, 0, 5 },
+	{ 1, 1, 7 }, { 0, 1, 5 }, { -1, 1, 7 }, { -1, 0, 5 },
+}
+
+-- Builds without pathfinding.expanded (the linear scan A*) cannot count
+-- their expansions. Replay their search here, with the same scan order and
+-- depth limit, only to count the nodes it expands; it is not timed.
+local function old_expansions(w, sx, sy, ex, ey)
+	local function dist(x, y)
+		local dx, dy = math.abs(x - ex), math.abs(y - ey)
+		if dx < dy then
+			return dx * 7 + (dy - dx) * 5
+		else
+			return dy * 7 + (dx - dy) * 5
+		end
+	end
+	local nx, ny, ng, nf = {}, {}, {}, {}
+	local open, index, closed = {}, {}, {}
+	local n, expanded = 0, 0
+	local function add(x, y, g)
+		if n >= depth then
+			return false
+		end
+		n = n + 1
+		nx[n], ny[n], ng[n], nf[n] = x, y, g, g + dist(x, y)
+		open[#open + 1] = n
+		index[y * width + x] = n
+		return true
+	end
+	add(sx, sy, 0)
+	while #open > 0 do
+		local best = 1
+		for i = 2, #open do
+			if nf[open[i]] < nf[open[best]] then
+				best = i
+			end
+		end
+		local c = open[best]
+		open[best] = open[#open]
+		open[#open] = nil
+		expanded = expanded + 1
+		local x, y = nx[c], ny[c]
+		if x == ex and y == ey then
+			break
+		end
+		index[y * width + x] = nil
+		closed[y * width + x] = true
+		for i = 1, 8 do
+			local o = OFF[i]
+			local x2, y2 = x + o[1], y + o[2]
+			local cell = y2 * width + x2
+			local wt = (x2 >= 0 and x2 < width and y2 >= 0 and y2 < height) and w[cell] or 255
+			if wt ~= 255 and not closed[cell] then
+				local g = ng[c] + o[3] + o[3] * wt
+				local nb = index[cell]
+				if nb then
+					if g < ng[nb] then
+						ng[nb] = g
+						nf[nb] = g + dist(x2, y2)
+					end
+				elseif not add(x2, y2, g) then
+					break
+				end
+			end
+		end
+	end
+	return expanded
+end
+
+local function report(name, t, steps, expanded)
+	local line = string.format("%-10s %d queries in %.3fs, %.0f queries/s",
+		name, queries, t, queries / t)
+	if expanded then
+		line = line .. string.format(", %d expanded, %.0f expansions/s",
+			expanded, expanded / t)
+	end
+	if steps then
+		line = line .. string.format(", %d steps", steps)
+	end
+	print(line)
+end
+
+-- counted: f expands nodes of m that pathfinding.expanded counts
+-- w: the cell weights, to count them in a build without pathfinding.expanded
+local function bench(name, f, m, counted, w)
+	local steps = 0
+	local before = counted and pf.expanded and pf.expanded(m)
+	local t = os.clock()
+	for i = 1, queries do
+		local p = q[i]
+		steps = steps + select("#", f(m, p[1], p[2], p[3], p[4], depth)) // 2
+	end
+	t = os.clock() - t
+	local expanded
+	if before then
+		expanded = pf.expanded(m) - before
+	elseif counted and w then
+		expanded = 0
+		for i = 1, queries do
+			local p = q[i]
+			expanded = expanded + old_expansions(w, p[1], p[2], p[3], p[4])
+		end
+	end
+	report(name, t, steps, expanded)
+end
+
+bench("path", pf.path, weighted, true, weights)
+if pf.path_batch then
+	local flat = {}
+	for i = 1, queries do
+		local p = q[i]
+		flat[#flat + 1] = p[1]
+		flat[#flat + 1] = p[2]
+		flat[#flat + 1] = p[3]
+		flat[#flat + 1] = p[4]
+	end
+	local out = {}
+	local before = pf.expanded and pf.expanded(weighted)
+	local t = os.clock()
+	pf.path_batch(weighted, flat, out, depth)
+	t = os.clock() - t
+	report("path_batch", t, nil, before and pf.expanded(weighted) - before)
+end
+if blocks then
+	bench("path#", pf.path, blocked, true)
+	if pf.jps then
+		bench("jps#", pf.jps, blocked, true)
+	end
+	if pf.hpath then
+		-- hpath searches the cluster graph, which pathfinding.expanded does not count
+		pf.hierarchy(blocked)
+		bench("hpath#", function(m, sx, sy, ex, ey)
+			return pf.hpath(m, sx, sy, ex, ey, true)
+		end, blocked, false)
+	end
+else
+	print("path#      skipped, this build reads '#' as a free cell")
+end
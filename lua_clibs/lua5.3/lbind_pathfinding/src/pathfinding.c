@@ -5,12 +5,28 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#ifndef PATHFINDING_NOTHREAD
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 #define SEARCH_DEPTH 1024
 #define BLOCK_WEIGHT 255
+#define CLUSTER_SIZE 16
+#define CLUSTER_SIZE_MAX 64
+#define HIERARCHY "pathfinding.hierarchy"
+#define FLOW_THREADS_MAX 16
+// the costliest step (7 + BLOCK_WEIGHT * 5) must fit in the circular buckets
+#define ROUTE_BUCKETS (7 + BLOCK_WEIGHT * 5 + 1)
 
 struct map {
 	int width;
 	int height;
+	int weighted;	// number of cells with a weight other than 0 and BLOCK_WEIGHT
 	uint8_t m[0];
 };
 
@@ -20,24 +36,59 @@ struct pathnode {
 	int camefrom;
 	int gscore;
 	int fscore;
+	int heap;	// position in the open heap, -1 when closed
 };
 
 struct path {
 	int depth;
-	int *set;
+	int *set;	// open heap of node indices
 	struct pathnode *n;
 };
 
-struct route_coord {
+/*
+	Each map keeps a node index (as its uservalue), so a search can find the
+	node of a cell in O(1). A stamp is valid only when its generation equals
+	the generation of the current search, so nothing needs clearing per call.
+*/
+struct node_index {
+	uint32_t generation;
+	int size;
+	uint64_t expanded;	// nodes expanded by the searches on this map, see pathfinding.expanded
+	struct node_stamp {
+		uint32_t generation;
+		int node;
+	} s[0];
+};
+
+/*
+	The optional abstraction layer of HPA*: the map is cut into clusters of
+	size * size cells. Each cluster keeps the entrance nodes on its borders
+	(a node links to the cell across the border on the sides set in links)
+	and the cost of the best path between any two of them inside the cluster.
+*/
+struct cluster_node {
 	int x;
 	int y;
+	int links;
 };
 
-struct route_queue {
-	int head;
-	int tail;
+struct cluster {
 	int n;
-	struct route_coord q[0];
+	int cap;
+	struct cluster_node *node;
+	int *cost;	// cost[i * n + j] from node i to node j, -1 when unreachable
+};
+
+struct hierarchy {
+	int size;
+	int cw;
+	int ch;
+	struct cluster *c;
+	// scratch of a search inside one cluster, size * size each
+	int *dist;
+	int *parent;
+	int *heap;
+	int *pos;
 };
 
 static inline int
@@ -90,10 +141,17 @@ addobstacle(lua_State *L, struct map *m, int line, const char *obstacle, size_t
 		c = obstacle[i];
 		if (c >= 'A' && c <= 'Z') {
 			weight = (c - 'A' + 1);
-			v = map_set(m, x, y, weight);
-			if (v != 0) {
-				luaL_error(L, "add obstacle (%d, %d) fail", x, y);
-			}
+			++m->weighted;
+		}
+		else if (c == '#') {
+			weight = BLOCK_WEIGHT;
+		}
+		else {
+			continue;
+		}
+		v = map_set(m, x, y, weight);
+		if (v != 0) {
+			luaL_error(L, "add obstacle (%d, %d) fail", x, y);
 		}
 	}
 }
@@ -112,6 +170,7 @@ lnewmap(lua_State *L) {
 	m = lua_newuserdata(L, (size_t)(sizeof(struct map) + width * height * sizeof(m->m[0])));
 	m->width = width;
 	m->height = height;
+	m->weighted = 0;
 	memset(m->m, 0, width * height * sizeof(m->m[0]));
 
 	lua_getfield(L, 1, "obstacle");
@@ -139,10 +198,24 @@ lnewmap(lua_State *L) {
 6  5  4
 */
 
+static void update_hierarchy(lua_State *L, struct map *m, int index, int x, int y);
+
+static inline int
+is_weighted(int w) {
+	return w != 0 && w != BLOCK_WEIGHT;
+}
+
+/*
+userdata map
+integer x, y
+integer weight (optional: set the weight of the cell)
+
+return the (old) weight of the cell
+*/
 static int
 lblock(lua_State *L) {
 	struct map *m;
-	int x, y;
+	int x, y, v, w;
 
 	luaL_checktype(L, 1, LUA_TUSERDATA);
 	m = lua_touserdata(L, 1);
@@ -152,7 +225,18 @@ lblock(lua_State *L) {
 		y < 0 || y >= m->height) {
 		luaL_error(L, "Position (%d,%d) is out of map", x, y);
 	}
-	lua_pushinteger(L, map_get(m, x, y));
+	if (lua_isnoneornil(L, 4)) {
+		lua_pushinteger(L, map_get(m, x, y));
+		return 1;
+	}
+	w = (int)luaL_checkinteger(L, 4);
+	luaL_argcheck(L, w >= 0 && w <= BLOCK_WEIGHT, 4, "invalid weight");
+	v = map_set(m, x, y, w);
+	m->weighted += is_weighted(w) - is_weighted(v);
+	if (v != w) {
+		update_hierarchy(L, m, 1, x, y);
+	}
+	lua_pushinteger(L, v);
 	return 1;
 }
 
@@ -176,104 +260,170 @@ distance(int x1, int y1, int x2, int y2) {
 
 struct context {
 	struct path *P;
+	struct node_index *index;
+	int width;
 	int open;
-	int closed;
 	int n;
 	int end_x;
 	int end_y;
 };
 
+/*
+	The uservalue of a map is a table of the data cached on it.
+	Push the cache table and the cached value of name.
+*/
+static int
+get_cache(lua_State *L, int index, const char *name) {
+	index = lua_absindex(L, index);
+	if (lua_getuservalue(L, index) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, -1);
+		lua_setuservalue(L, index);
+	}
+	return lua_getfield(L, -1, name);
+}
+
+static struct node_index *
+check_index(lua_State *L, struct map *m, int index) {
+	struct node_index *ni;
+	int size;
+
+	if (get_cache(L, index, "index") == LUA_TUSERDATA) {
+		ni = lua_touserdata(L, -1);
+		lua_pop(L, 2);
+		return ni;
+	}
+	lua_pop(L, 1);
+	size = m->width * m->height;
+	ni = lua_newuserdata(L, sizeof(struct node_index) + size * sizeof(ni->s[0]));
+	ni->generation = 0;
+	ni->size = size;
+	ni->expanded = 0;
+	memset(ni->s, 0, size * sizeof(ni->s[0]));
+	lua_setfield(L, -2, "index");
+	lua_pop(L, 1);
+	return ni;
+}
+
+static void
+next_generation(struct node_index *ni) {
+	if (++ni->generation == 0) {
+		// stamps wrapped around, forget all of them
+		memset(ni->s, 0, ni->size * sizeof(ni->s[0]));
+		ni->generation = 1;
+	}
+}
+
+static inline int
+heap_less(struct path *P, int a, int b) {
+	return P->n[a].fscore < P->n[b].fscore;
+}
+
+static inline void
+heap_place(struct path *P, int pos, int idx) {
+	P->set[pos] = idx;
+	P->n[idx].heap = pos;
+}
+
+static void
+heap_up(struct path *P, int pos) {
+	int idx, parent;
+
+	idx = P->set[pos];
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!heap_less(P, idx, P->set[parent]))
+			break;
+		heap_place(P, pos, P->set[parent]);
+		pos = parent;
+	}
+	heap_place(P, pos, idx);
+}
+
+static void
+heap_down(struct path *P, int pos, int size) {
+	int idx, child;
+
+	idx = P->set[pos];
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && heap_less(P, P->set[child + 1], P->set[child]))
+			++child;
+		if (!heap_less(P, P->set[child], idx))
+			break;
+		heap_place(P, pos, P->set[child]);
+		pos = child;
+	}
+	heap_place(P, pos, idx);
+}
+
 static struct pathnode *
 add_open(struct context *ctx, int x, int y, int camefrom, int gscore) {
 	struct path *P;
 	struct pathnode *pn;
+	struct node_stamp *s;
 
 	P = ctx->P;
 	if (ctx->n >= P->depth) {
 		return NULL;
 	}
-	P->set[ctx->open++] = ctx->n;
-	pn = &P->n[ctx->n++];
+	s = &ctx->index->s[y * ctx->width + x];
+	s->generation = ctx->index->generation;
+	s->node = ctx->n;
+	pn = &P->n[ctx->n];
 	pn->x = x;
 	pn->y = y;
 	pn->camefrom = camefrom;
 	pn->gscore = gscore;
 	pn->fscore = gscore + distance(x, y, ctx->end_x, ctx->end_y);
+	P->set[ctx->open] = ctx->n++;
+	heap_up(P, ctx->open++);
 	return pn;
 };
 
 static struct pathnode *
 lowest_fscore(struct context *ctx) {
-	int idx, fscore, i;
+	struct path *P;
 	struct pathnode *pn;
 
-	idx = 0;
-	pn = &ctx->P->n[ctx->P->set[idx]];
-	fscore = pn->fscore;
-	for (i = 1;i<ctx->open;i++) {
-		struct pathnode *tmp = &ctx->P->n[ctx->P->set[i]];
-		if (tmp->fscore < fscore) {
-			pn = tmp;
-			idx = i;
-			fscore = tmp->fscore;
-		}
-	}
-	// remove from open set
-	--ctx->open;
-	if (idx != ctx->open) {
-		ctx->P->set[idx] = ctx->P->set[ctx->open];
+	P = ctx->P;
+	pn = &P->n[P->set[0]];
+	// remove from open set, and mark it closed
+	pn->heap = -1;
+	if (--ctx->open > 0) {
+		P->set[0] = P->set[ctx->open];
+		heap_down(P, 0, ctx->open);
 	}
 	return pn;
 }
 
-static void
-add_closed(struct context *ctx, int idx) {
-	ctx->P->set[ctx->P->depth - 1 - ctx->closed++] = idx;
-}
-
-static int
-in_closed(struct context *ctx, int x, int y) {
-	int i, idx;
-	struct pathnode *pn;
-
-	for (i = 0;i<ctx->closed;i++) {
-		idx = ctx->P->set[ctx->P->depth - 1 - i];
-		pn = &ctx->P->n[idx];
-		if (pn->x == x && pn->y == y)
-			return 1;
-	}
-	return 0;
-}
-
 static struct pathnode *
-find_open(struct context *ctx, int x, int y) {
-	int i, idx;
-	struct pathnode *pn;
+find_node(struct context *ctx, int x, int y) {
+	struct node_stamp *s;
 
-	for (i = 0;i<ctx->open;i++) {
-		idx = ctx->P->set[i];
-		pn = &ctx->P->n[idx];
-		if (pn->x == x && pn->y == y)
-			return pn;
-	}
-	return NULL;
+	s = &ctx->index->s[y * ctx->width + x];
+	if (s->generation != ctx->index->generation)
+		return NULL;
+	return &ctx->P->n[s->node];
 }
 
+// the node with the lowest fscore, the one nearer to the end wins a tie
 static int
-nearest(struct path *P, int from, int to) {
-	int ret, fscore, i;
-	struct pathnode *pn;
-
-	ret = P->set[from];
-	pn = &P->n[ret];
-	fscore = pn->fscore;
-
-	for (i = from + 1;i<to;i++) {
-		int idx = P->set[i];
-		pn = &P->n[idx];
-		if (pn->fscore < fscore) {
-			fscore = pn->fscore;
-			ret = idx;
+nearest(struct path *P, int n) {
+	int ret, i;
+	struct pathnode *best, *pn;
+
+	ret = 0;
+	best = &P->n[0];
+	for (i = 1;i<n;i++) {
+		pn = &P->n[i];
+		if (pn->fscore < best->fscore ||
+			(pn->fscore == best->fscore && pn->gscore > best->gscore)) {
+			best = pn;
+			ret = i;
 		}
 	}
 	return ret;
@@ -295,24 +445,26 @@ static struct {
 };
 
 static int
-path_finding(struct map *m, struct path *P, int start_x, int start_y, int end_x, int end_y) {
+path_finding(struct map *m, struct node_index *ni, struct path *P, int start_x, int start_y, int end_x, int end_y) {
 	struct context ctx;
 	struct pathnode *pn, *neighbor;
 	int current, i, x, y, weight, tentative_gscore;
 
+	next_generation(ni);
 	ctx.P = P;
+	ctx.index = ni;
+	ctx.width = m->width;
 	ctx.open = 0;
-	ctx.closed = 0;
 	ctx.n = 0;
 	ctx.end_x = end_x;
 	ctx.end_y = end_y;
 	add_open(&ctx, start_x, start_y, -1, 0);
 	while (ctx.open > 0) {
 		pn = lowest_fscore(&ctx);
+		++ni->expanded;
 		current = pn - P->n;
 		if (pn->x == end_x && pn->y == end_y)
 			return current;
-		add_closed(&ctx, current);
 
 		for (i = 0;i<8;i++) {
 			x = pn->x + OFF[i].dx;
@@ -320,15 +472,16 @@ path_finding(struct map *m, struct path *P, int start_x, int start_y, int end_x,
 			weight = map_get(m, x, y);
 			if (weight == BLOCK_WEIGHT)
 				continue;
-			if (in_closed(&ctx, x, y))
-				continue;
+			neighbor = find_node(&ctx, x, y);
+			if (neighbor && neighbor->heap < 0)
+				continue;	// closed
 			tentative_gscore = pn->gscore + OFF[i].distance + OFF[i].distance * weight;
-			neighbor = find_open(&ctx, x, y);
 			if (neighbor) {
 				if (tentative_gscore < neighbor->gscore) {
 					neighbor->camefrom = current;
 					neighbor->gscore = tentative_gscore;
 					neighbor->fscore = tentative_gscore + distance(x, y, end_x, end_y);
+					heap_up(P, neighbor->heap);
 				}
 			}
 			else if (add_open(&ctx, x, y, current, tentative_gscore) == NULL) {
@@ -338,18 +491,166 @@ path_finding(struct map *m, struct path *P, int start_x, int start_y, int end_x,
 		}
 	}
 	if (ctx.open > 0) {
-		return nearest(P, 0, ctx.open);
+		return P->set[0];
 	}
 	else {
-		return nearest(P, P->depth - ctx.closed, P->depth);
+		return nearest(P, ctx.n);
 	}
 }
 
-static void
-close_path(struct path *P) {
-	if (P->depth > SEARCH_DEPTH) {
-		free(P->set);
-		free(P->n);
+static inline int
+walkable(struct map *m, int x, int y) {
+	return map_get(m, x, y) != BLOCK_WEIGHT;
+}
+
+static inline int
+sign(int v) {
+	return (v > 0) - (v < 0);
+}
+
+/*
+	Jump from (x,y) in direction (dx,dy) until a jump point (the end, or a cell
+	with a forced neighbor) is found. Diagonal moves may cut corners, the same
+	as path_finding does.
+*/
+static int
+jump(struct map *m, int x, int y, int dx, int dy, int end_x, int end_y, int *jx, int *jy) {
+	int tx, ty;
+
+	for (;;) {
+		x += dx;
+		y += dy;
+		if (!walkable(m, x, y))
+			return 0;
+		if (x == end_x && y == end_y)
+			break;
+		if (dx && dy) {
+			if ((walkable(m, x - dx, y + dy) && !walkable(m, x - dx, y)) ||
+				(walkable(m, x + dx, y - dy) && !walkable(m, x, y - dy)))
+				break;
+			if (jump(m, x, y, dx, 0, end_x, end_y, &tx, &ty) ||
+				jump(m, x, y, 0, dy, end_x, end_y, &tx, &ty))
+				break;
+		}
+		else if (dx) {
+			if ((walkable(m, x + dx, y + 1) && !walkable(m, x, y + 1)) ||
+				(walkable(m, x + dx, y - 1) && !walkable(m, x, y - 1)))
+				break;
+		}
+		else {
+			if ((walkable(m, x + 1, y + dy) && !walkable(m, x + 1, y)) ||
+				(walkable(m, x - 1, y + dy) && !walkable(m, x - 1, y)))
+				break;
+		}
+	}
+	*jx = x;
+	*jy = y;
+	return 1;
+}
+
+// directions worth jumping to from pn, pruned by the direction it was reached from
+static int
+jps_neighbors(struct map *m, struct path *P, struct pathnode *pn, int dir[8][2]) {
+	struct pathnode *parent;
+	int x, y, dx, dy, n, i;
+
+	if (pn->camefrom < 0) {
+		for (i = 0;i<8;i++) {
+			dir[i][0] = OFF[i].dx;
+			dir[i][1] = OFF[i].dy;
+		}
+		return 8;
+	}
+	parent = &P->n[pn->camefrom];
+	x = pn->x;
+	y = pn->y;
+	dx = sign(x - parent->x);
+	dy = sign(y - parent->y);
+	n = 0;
+#define DIRECTION(a, b) dir[n][0] = (a); dir[n][1] = (b); ++n;
+	if (dx && dy) {
+		DIRECTION(dx, 0)
+		DIRECTION(0, dy)
+		DIRECTION(dx, dy)
+		if (!walkable(m, x - dx, y)) {
+			DIRECTION(-dx, dy)
+		}
+		if (!walkable(m, x, y - dy)) {
+			DIRECTION(dx, -dy)
+		}
+	}
+	else if (dx) {
+		DIRECTION(dx, 0)
+		if (!walkable(m, x, y + 1)) {
+			DIRECTION(dx, 1)
+		}
+		if (!walkable(m, x, y - 1)) {
+			DIRECTION(dx, -1)
+		}
+	}
+	else {
+		DIRECTION(0, dy)
+		if (!walkable(m, x + 1, y)) {
+			DIRECTION(1, dy)
+		}
+		if (!walkable(m, x - 1, y)) {
+			DIRECTION(-1, dy)
+		}
+	}
+#undef DIRECTION
+	return n;
+}
+
+// Jump Point Search, only valid when every cell weighs 0 or BLOCK_WEIGHT
+static int
+jps_finding(struct map *m, struct node_index *ni, struct path *P, int start_x, int start_y, int end_x, int end_y) {
+	struct context ctx;
+	struct pathnode *pn, *neighbor;
+	int current, i, n, x, y, tentative_gscore;
+	int dir[8][2];
+
+	next_generation(ni);
+	ctx.P = P;
+	ctx.index = ni;
+	ctx.width = m->width;
+	ctx.open = 0;
+	ctx.n = 0;
+	ctx.end_x = end_x;
+	ctx.end_y = end_y;
+	add_open(&ctx, start_x, start_y, -1, 0);
+	while (ctx.open > 0) {
+		pn = lowest_fscore(&ctx);
+		++ni->expanded;
+		current = pn - P->n;
+		if (pn->x == end_x && pn->y == end_y)
+			return current;
+
+		n = jps_neighbors(m, P, pn, dir);
+		for (i = 0;i<n;i++) {
+			if (!jump(m, pn->x, pn->y, dir[i][0], dir[i][1], end_x, end_y, &x, &y))
+				continue;
+			neighbor = find_node(&ctx, x, y);
+			if (neighbor && neighbor->heap < 0)
+				continue;	// closed
+			tentative_gscore = pn->gscore + distance(pn->x, pn->y, x, y);
+			if (neighbor) {
+				if (tentative_gscore < neighbor->gscore) {
+					neighbor->camefrom = current;
+					neighbor->gscore = tentative_gscore;
+					neighbor->fscore = tentative_gscore + distance(x, y, end_x, end_y);
+					heap_up(P, neighbor->heap);
+				}
+			}
+			else if (add_open(&ctx, x, y, current, tentative_gscore) == NULL) {
+				break;
+			}
+		}
+	}
+	if (ctx.open > 0) {
+		return P->set[0];
+	}
+	else {
+		return nearest(P, ctx.n);
 	}
 }
 
@@ -361,20 +662,110 @@ check_position(lua_State *L, struct map *m, int x, int y) {
 	}
 }
 
+typedef int (*search_func)(struct map *m, struct node_index *ni, struct path *P, int start_x, int start_y, int end_x, int end_y);
+
+/*
+	The search arena of a map is cached with its node index, so a search
+	doesn't allocate. It grows to the largest depth ever asked for.
+*/
+struct arena {
+	int depth;
+	int *set;
+	struct pathnode *n;
+};
+
+static struct arena *
+check_arena(lua_State *L, int index, int depth) {
+	struct arena *a;
+
+	if (get_cache(L, index, "arena") == LUA_TUSERDATA) {
+		a = lua_touserdata(L, -1);
+		if (a->depth >= depth) {
+			lua_pop(L, 2);
+			return a;
+		}
+	}
+	lua_pop(L, 1);
+	if (depth < SEARCH_DEPTH)
+		depth = SEARCH_DEPTH;
+	a = lua_newuserdata(L, sizeof(struct arena) + depth * (sizeof(struct pathnode) + sizeof(int)));
+	a->depth = depth;
+	a->n = (struct pathnode *)(a + 1);
+	a->set = (int *)(a->n + depth);
+	lua_setfield(L, -2, "arena");
+	lua_pop(L, 1);
+	return a;
+}
+
+static void
+init_path(struct path *P, struct arena *a, int depth) {
+	P->depth = depth;
+	P->set = a->set;
+	P->n = a->n;
+}
+
+/*
+	Reverse the nodes of the path ending at node into P->set (the open heap
+	is no longer needed). Return the number of cells on the path, the nodes
+	of a jump point search may be apart.
+*/
 static int
-lpath(lua_State *L) {
+trace_path(struct path *P, int node, int *n) {
+	struct pathnode *from;
+	int steps, dx, dy;
+
+	*n = 0;
+	steps = 1;
+	while (node >= 0) {
+		P->set[(*n)++] = node;
+		if (P->n[node].camefrom >= 0) {
+			from = &P->n[P->n[node].camefrom];
+			dx = abs(P->n[node].x - from->x);
+			dy = abs(P->n[node].y - from->y);
+			steps += dx > dy ? dx : dy;
+		}
+		node = P->n[node].camefrom;
+	}
+	return steps;
+}
+
+typedef void (*emit_func)(void *ud, int x, int y);
+
+// emit every cell of a path reversed by trace_path, from the start
+static void
+walk_path(struct path *P, int n, emit_func emit, void *ud) {
+	struct pathnode *to;
+	int i, x, y, dx, dy;
+
+	x = P->n[P->set[n - 1]].x;
+	y = P->n[P->set[n - 1]].y;
+	emit(ud, x, y);
+	for (i = n - 2;i >= 0;i--) {
+		to = &P->n[P->set[i]];
+		dx = sign(to->x - x);
+		dy = sign(to->y - y);
+		while (x != to->x || y != to->y) {
+			x += dx;
+			y += dy;
+			emit(ud, x, y);
+		}
+	}
+}
+
+static void
+emit_stack(void *ud, int x, int y) {
+	lua_State *L = ud;
+	lua_pushinteger(L, x);
+	lua_pushinteger(L, y);
+}
+
+static int
+search_path(lua_State *L, search_func search) {
 	struct map *m;
+	struct node_index *ni;
 	int start_x, start_y, end_x, end_y;
 	struct path P;
-
-	int set[SEARCH_DEPTH];
-	struct pathnode pn[SEARCH_DEPTH];
-	int stack_size, node, n, idx, i;
-
-	struct {
-		int x;
-		int y;
-	} pos[SEARCH_DEPTH];
+	int depth, node, n, steps;
 
 	luaL_checktype(L, 1, LUA_TUSERDATA);
 	m = lua_touserdata(L, 1);
@@ -386,177 +777,1033 @@ lpath(lua_State *L) {
 	check_position(L, m, start_x, start_y);
 	check_position(L, m, end_x, end_y);
 
-	P.depth = (int)luaL_optinteger(L, 6, SEARCH_DEPTH);
-	stack_size = P.depth > SEARCH_DEPTH ? 0 : P.depth;
+	depth = (int)luaL_optinteger(L, 6, SEARCH_DEPTH);
+	luaL_argcheck(L, depth > 0, 6, "invalid depth");
+	ni = check_index(L, m, 1);
+	init_path(&P, check_arena(L, 1, depth), depth);
 
-	if (P.depth > SEARCH_DEPTH) {
-		P.set = malloc(sizeof(int) * P.depth);
-		P.n = malloc(sizeof(struct pathnode) * P.depth);
-	}
-	else {
-		P.set = set;
-		P.n = pn;
-	}
+	node = search(m, ni, &P, start_x, start_y, end_x, end_y);
+	steps = trace_path(&P, node, &n);
 
-	node = path_finding(m, &P, start_x, start_y, end_x, end_y);
-	n = 1;
-	idx = node;
-	while (P.n[idx].camefrom >= 0) {
-		idx = P.n[idx].camefrom;
-		++n;
-	}
+	lua_settop(L, 0);
+	luaL_checkstack(L, steps * 2, "path too long");
+	walk_path(&P, n, emit_stack, L);
+	return steps * 2;
+}
 
-	for (i = 0;i<n;i++) {
-		struct pathnode *pn = &P.n[node];
-		pos[i].x = pn->x;
-		pos[i].y = pn->y;
-		node = P.n[node].camefrom;
-	}
+struct emit_table {
+	lua_State *L;
+	int index;
+	lua_Integer i;
+};
 
-	close_path(&P);
+static void
+emit_table(void *ud, int x, int y) {
+	struct emit_table *t = ud;
+	lua_pushinteger(t->L, x);
+	lua_rawseti(t->L, t->index, ++t->i);
+	lua_pushinteger(t->L, y);
+	lua_rawseti(t->L, t->index, ++t->i);
+}
 
-	lua_settop(L, 0);
-	luaL_checkstack(L, n * 2, NULL);
-	for (i = n - 1;i >= 0;i--) {
-		lua_pushinteger(L, pos[i].x);
-		lua_pushinteger(L, pos[i].y);
-	}
-	return n * 2;
+static void
+emit_buffer(void *ud, int x, int y) {
+	int32_t v[2];
+	v[0] = x;
+	v[1] = y;
+	luaL_addlstring((luaL_Buffer *)ud, (const char *)v, sizeof(v));
 }
 
-struct map *
-	new_flowgraph(lua_State *L, struct map *m, int index) {
-	if (lua_type(L, index) == LUA_TUSERDATA) {
-		struct map * result = lua_touserdata(L, index);
-		if (m->width == result->width && m->height == result->height) {
-			return result;
-		}
-		lua_settop(L, index - 1);
+static int
+query_number(lua_State *L, int index, lua_Integer i) {
+	int isnum;
+	lua_Integer v;
+
+	lua_rawgeti(L, index, i);
+	v = lua_tointegerx(L, -1, &isnum);
+	lua_pop(L, 1);
+	if (!isnum) {
+		return luaL_error(L, "invalid query [%d]", (int)i);
 	}
-	struct map * result = lua_newuserdata(L, sizeof(struct map) + m->width * m->height * sizeof(m->m[0]));
-	result->width = m->width;
-	result->height = m->height;
-	memset(result->m, 0, m->width * m->height * sizeof(result->m[0]));
-	return result;
+	return (int)v;
 }
 
+/*
+userdata map
+table queries { sx1, sy1, ex1, ey1, sx2, sy2, ex2, ey2, ... }
+table out (optional)
+integer depth (optional)
+
+Run every query against the search arena of the map. For each query, write
+n, x1, y1, ..., xn, yn into out from out[1], and return the number of
+integers written. Without out, return them packed as native int32 in a string.
+*/
+static int
+lpath_batch(lua_State *L) {
+	struct map *m;
+	struct node_index *ni;
+	struct path P;
+	struct emit_table t;
+	luaL_Buffer b;
+	int32_t count;
+	int depth, q, nq, sx, sy, ex, ey, node, n, steps, packed;
 
-static void
-addtarget_map(lua_State *L, struct map *m, const char * target, char mark) {
-	int x = 0, y = 0;
-	int i;
-	char c;
-	for (i = 0;(c = target[i]);i++) {
-		if (c == '\n') {
-			++y;
-			if (y >= m->height)
-				break;
-			x = 0;
-			continue;
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	packed = lua_isnoneornil(L, 3);
+	if (!packed)
+		luaL_checktype(L, 3, LUA_TTABLE);
+	depth = (int)luaL_optinteger(L, 4, SEARCH_DEPTH);
+	luaL_argcheck(L, depth > 0, 4, "invalid depth");
+	ni = check_index(L, m, 1);
+	init_path(&P, check_arena(L, 1, depth), depth);
+
+	nq = (int)(lua_rawlen(L, 2) / 4);
+	t.L = L;
+	t.index = 3;
+	t.i = 0;
+	if (packed)
+		luaL_buffinit(L, &b);
+	for (q = 0;q<nq;q++) {
+		sx = query_number(L, 2, q * 4 + 1);
+		sy = query_number(L, 2, q * 4 + 2);
+		ex = query_number(L, 2, q * 4 + 3);
+		ey = query_number(L, 2, q * 4 + 4);
+		check_position(L, m, sx, sy);
+		check_position(L, m, ex, ey);
+		node = path_finding(m, ni, &P, sx, sy, ex, ey);
+		steps = trace_path(&P, node, &n);
+		if (packed) {
+			count = steps;
+			luaL_addlstring(&b, (const char *)&count, sizeof(count));
+			walk_path(&P, n, emit_buffer, &b);
 		}
-		if (c == '\r')
-			continue;
-		if (c == mark && x < m->width) {
-			m->m[y * m->width + x] = 1;
+		else {
+			lua_pushinteger(L, steps);
+			lua_rawseti(L, 3, ++t.i);
+			walk_path(&P, n, emit_table, &t);
 		}
-		++x;
 	}
+	if (packed) {
+		luaL_pushresult(&b);
+	}
+	else {
+		lua_pushinteger(L, t.i);
+	}
+	return 1;
 }
 
-static struct route_queue *
-create_queue(int n) {
-	struct route_queue * q = malloc(sizeof(struct route_queue) + sizeof(q->q[0]) * n);
-	q->head = 0;
-	q->tail = 0;
-	q->n = n;
-	return q;
+static int
+lpath(lua_State *L) {
+	return search_path(L, path_finding);
 }
 
-static void
-enter_queue(struct route_queue *q, int x, int y) {
-	struct route_coord *c = &q->q[q->tail];
-	c->x = x;
-	c->y = y;
-	++q->tail;
-	if (q->tail >= q->n)
-		q->tail = 0;
-	assert(q->head != q->tail);
-}
+/*
+userdata map
+integer start_x, start_y, end_x, end_y
+integer depth (optional: number of jump points)
 
-static struct route_coord *
-leave_queue(struct route_queue *q) {
-	if (q->head == q->tail)
-		return NULL;
-	struct route_coord * c = &q->q[q->head];
-	++q->head;
-	if (q->head >= q->n)
-		q->head = 0;
-	return c;
-}
+return x1, y1, x2, y2, ... the same as path
+Falls back to path when the map has weighted cells.
+*/
+static int
+ljps(lua_State *L) {
+	struct map *m;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	return search_path(L, m->weighted ? path_finding : jps_finding);
+}
+
+/*
+userdata map
+
+return the number of nodes expanded so far by path, path_batch and jps on this map
+*/
+static int
+lexpanded(lua_State *L) {
+	struct map *m;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	lua_pushinteger(L, (lua_Integer)check_index(L, m, 1)->expanded);
+	return 1;
+}
+
+static struct cluster_node *
+cluster_add(struct cluster *c, int x, int y, int side) {
+	int i;
+
+	for (i = 0;i<c->n;i++) {
+		if (c->node[i].x == x && c->node[i].y == y) {
+			c->node[i].links |= 1 << side;
+			return &c->node[i];
+		}
+	}
+	if (c->n >= c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 8;
+		c->node = realloc(c->node, c->cap * sizeof(struct cluster_node));
+	}
+	c->node[c->n].x = x;
+	c->node[c->n].y = y;
+	c->node[c->n].links = 1 << side;
+	return &c->node[c->n++];
+}
 
 static int
-queue_exist(struct route_queue *q, int x, int y) {
-	int head = q->head;
-	while (head != q->tail) {
-		struct route_coord * c = &q->q[head];
-		if (c->x == x && c->y == y)
+cluster_find(struct cluster *c, int x, int y) {
+	int i;
+
+	for (i = 0;i<c->n;i++) {
+		if (c->node[i].x == x && c->node[i].y == y)
+			return i;
+	}
+	return -1;
+}
+
+static const int SIDE[4][2] = {
+	{ 0, -1 },	// up
+	{ 1, 0 },	// right
+	{ 0, 1 },	// down
+	{ -1, 0 },	// left
+};
+
+/*
+	Add the entrances on one side of cluster (cx, cy). Both clusters of a
+	border scan the same pairs of cells in the same order, so they agree on
+	where the transitions are: one in the middle of a short open segment,
+	one at each end of a long one.
+*/
+static void
+cluster_border(struct map *m, struct hierarchy *h, struct cluster *c, int cx, int cy, int side) {
+	int dx, dy, x, y, ax, ay, len, i, begin, mid;
+	int size = h->size;
+
+	dx = SIDE[side][0];
+	dy = SIDE[side][1];
+	if (dx) {
+		x = dx > 0 ? (cx + 1) * size - 1 : cx * size;
+		if (x + dx < 0 || x + dx >= m->width)
+			return;
+		y = cy * size;
+		len = m->height - y < size ? m->height - y : size;
+	}
+	else {
+		y = dy > 0 ? (cy + 1) * size - 1 : cy * size;
+		if (y + dy < 0 || y + dy >= m->height)
+			return;
+		x = cx * size;
+		len = m->width - x < size ? m->width - x : size;
+	}
+	begin = -1;
+	for (i = 0;i<=len;i++) {
+		ax = dx ? x : x + i;
+		ay = dx ? y + i : y;
+		if (i < len && walkable(m, ax, ay) && walkable(m, ax + dx, ay + dy)) {
+			if (begin < 0)
+				begin = i;
+			continue;
+		}
+		if (begin < 0)
+			continue;
+		if (i - begin < 6) {
+			mid = (begin + i - 1) / 2;
+			cluster_add(c, dx ? x : x + mid, dx ? y + mid : y, side);
+		}
+		else {
+			cluster_add(c, dx ? x : x + begin, dx ? y + begin : y, side);
+			cluster_add(c, dx ? x : x + i - 1, dx ? y + i - 1 : y, side);
+		}
+		begin = -1;
+	}
+}
+
+static inline int
+cluster_less(struct hierarchy *h, int a, int b) {
+	return h->dist[a] < h->dist[b];
+}
+
+static void
+cluster_heap_up(struct hierarchy *h, int pos) {
+	int idx = h->heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (!cluster_less(h, idx, h->heap[parent]))
+			break;
+		h->heap[pos] = h->heap[parent];
+		h->pos[h->heap[pos]] = pos;
+		pos = parent;
+	}
+	h->heap[pos] = idx;
+	h->pos[idx] = pos;
+}
+
+static void
+cluster_heap_down(struct hierarchy *h, int pos, int size) {
+	int idx = h->heap[pos];
+	for (;;) {
+		int child = pos * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && cluster_less(h, h->heap[child + 1], h->heap[child]))
+			++child;
+		if (!cluster_less(h, h->heap[child], idx))
+			break;
+		h->heap[pos] = h->heap[child];
+		h->pos[h->heap[pos]] = pos;
+		pos = child;
+	}
+	h->heap[pos] = idx;
+	h->pos[idx] = pos;
+}
+
+/*
+	Dijkstra from (sx, sy) bounded to cluster (cx, cy). The results are in
+	h->dist and h->parent, indexed by (y - cy * size) * size + (x - cx * size).
+	When reverse is set, dist is the cost from each cell to (sx, sy) instead.
+*/
+static void
+cluster_search(struct map *m, struct hierarchy *h, int cx, int cy, int sx, int sy, int reverse) {
+	int size = h->size;
+	int x0 = cx * size;
+	int y0 = cy * size;
+	int x1 = x0 + size < m->width ? x0 + size : m->width;
+	int y1 = y0 + size < m->height ? y0 + size : m->height;
+	int open, i, cur, x, y, nx, ny, idx, w, d;
+
+	for (i = 0;i<size * size;i++) {
+		h->dist[i] = -1;
+		h->pos[i] = -1;
+	}
+	idx = (sy - y0) * size + (sx - x0);
+	h->dist[idx] = 0;
+	h->parent[idx] = -1;
+	h->heap[0] = idx;
+	h->pos[idx] = 0;
+	open = 1;
+	while (open > 0) {
+		cur = h->heap[0];
+		h->pos[cur] = -2;	// closed
+		if (--open > 0) {
+			h->heap[0] = h->heap[open];
+			cluster_heap_down(h, 0, open);
+		}
+		x = x0 + cur % size;
+		y = y0 + cur / size;
+		for (i = 0;i<8;i++) {
+			nx = x + OFF[i].dx;
+			ny = y + OFF[i].dy;
+			if (nx < x0 || nx >= x1 || ny < y0 || ny >= y1)
+				continue;
+			w = m->m[ny * m->width + nx];
+			if (w == BLOCK_WEIGHT)
+				continue;
+			idx = (ny - y0) * size + (nx - x0);
+			if (h->pos[idx] == -2)
+				continue;
+			// the cost of a step is paid by the cell it enters
+			if (reverse) {
+				w = m->m[y * m->width + x];
+				if (w == BLOCK_WEIGHT)
+					break;
+			}
+			d = h->dist[cur] + OFF[i].distance + OFF[i].distance * w;
+			if (h->pos[idx] < 0) {
+				h->dist[idx] = d;
+				h->parent[idx] = cur;
+				h->heap[open] = idx;
+				h->pos[idx] = open;
+				cluster_heap_up(h, open++);
+			}
+			else if (d < h->dist[idx]) {
+				h->dist[idx] = d;
+				h->parent[idx] = cur;
+				cluster_heap_up(h, h->pos[idx]);
+			}
+		}
+	}
+}
+
+static inline int
+cluster_dist(struct hierarchy *h, int cx, int cy, int x, int y) {
+	return h->dist[(y - cy * h->size) * h->size + (x - cx * h->size)];
+}
+
+static void
+cluster_build(struct map *m, struct hierarchy *h, int cx, int cy) {
+	struct cluster *c = &h->c[cy * h->cw + cx];
+	int side, i, j;
+
+	c->n = 0;
+	for (side = 0;side<4;side++) {
+		cluster_border(m, h, c, cx, cy, side);
+	}
+	free(c->cost);
+	c->cost = NULL;
+	if (c->n == 0)
+		return;
+	c->cost = malloc(c->n * c->n * sizeof(int));
+	for (i = 0;i<c->n;i++) {
+		cluster_search(m, h, cx, cy, c->node[i].x, c->node[i].y, 0);
+		for (j = 0;j<c->n;j++) {
+			c->cost[i * c->n + j] = cluster_dist(h, cx, cy, c->node[j].x, c->node[j].y);
+		}
+	}
+}
+
+static int
+lhierarchy_gc(lua_State *L) {
+	struct hierarchy *h = lua_touserdata(L, 1);
+	int i;
+
+	for (i = 0;i<h->cw * h->ch;i++) {
+		free(h->c[i].node);
+		free(h->c[i].cost);
+	}
+	h->cw = h->ch = 0;
+	return 0;
+}
+
+static struct hierarchy *
+new_hierarchy(lua_State *L, struct map *m, int index, int size) {
+	struct hierarchy *h;
+	int cw, ch, cx, cy, cells;
+
+	index = lua_absindex(L, index);
+	cw = (m->width + size - 1) / size;
+	ch = (m->height + size - 1) / size;
+	cells = size * size;
+	h = lua_newuserdata(L, sizeof(struct hierarchy) + cw * ch * sizeof(struct cluster) + cells * 4 * sizeof(int));
+	h->size = size;
+	h->cw = cw;
+	h->ch = ch;
+	h->c = (struct cluster *)(h + 1);
+	h->dist = (int *)(h->c + cw * ch);
+	h->parent = h->dist + cells;
+	h->heap = h->parent + cells;
+	h->pos = h->heap + cells;
+	memset(h->c, 0, cw * ch * sizeof(struct cluster));
+	luaL_setmetatable(L, HIERARCHY);
+	for (cy = 0;cy<ch;cy++) {
+		for (cx = 0;cx<cw;cx++) {
+			cluster_build(m, h, cx, cy);
+		}
+	}
+	get_cache(L, index, "hierarchy");
+	lua_pop(L, 1);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, "hierarchy");
+	lua_pop(L, 2);
+	return h;
+}
+
+static struct hierarchy *
+check_hierarchy(lua_State *L, struct map *m, int index) {
+	struct hierarchy *h;
+
+	if (get_cache(L, index, "hierarchy") == LUA_TUSERDATA) {
+		h = lua_touserdata(L, -1);
+		lua_pop(L, 2);
+		return h;
+	}
+	lua_pop(L, 2);
+	return new_hierarchy(L, m, index, CLUSTER_SIZE);
+}
+
+// rebuild the clusters whose entrances or costs may change with cell (x, y)
+static void
+update_hierarchy(lua_State *L, struct map *m, int index, int x, int y) {
+	struct hierarchy *h;
+	int cx, cy;
+
+	if (get_cache(L, index, "hierarchy") != LUA_TUSERDATA) {
+		lua_pop(L, 2);
+		return;
+	}
+	h = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	cx = x / h->size;
+	cy = y / h->size;
+	cluster_build(m, h, cx, cy);
+	if (x == cx * h->size && cx > 0)
+		cluster_build(m, h, cx - 1, cy);
+	if (x == (cx + 1) * h->size - 1 && cx < h->cw - 1)
+		cluster_build(m, h, cx + 1, cy);
+	if (y == cy * h->size && cy > 0)
+		cluster_build(m, h, cx, cy - 1);
+	if (y == (cy + 1) * h->size - 1 && cy < h->ch - 1)
+		cluster_build(m, h, cx, cy + 1);
+}
+
+/*
+userdata map
+integer cluster_size (optional: default CLUSTER_SIZE)
+
+Build (or rebuild) the HPA* abstraction layer of the map. pathfinding.hpath
+builds it with the default size on demand, and pathfinding.block keeps it up
+to date.
+*/
+static int
+lhierarchy(lua_State *L) {
+	struct map *m;
+	int size;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	size = (int)luaL_optinteger(L, 2, CLUSTER_SIZE);
+	luaL_argcheck(L, size >= 4 && size <= CLUSTER_SIZE_MAX, 2, "invalid cluster size");
+	new_hierarchy(L, m, 1, size);
+	return 0;
+}
+
+/*
+	Abstract search state. Nodes are numbered cluster by cluster (from offset),
+	the start and the end take the last two ids.
+*/
+struct abstract {
+	struct map *m;
+	struct hierarchy *h;
+	int n;
+	int *offset;
+	int *g;
+	int *f;
+	int *camefrom;
+	int *heap;
+	int *pos;
+	int open;
+	int start;
+	int end;
+	int start_x, start_y, start_cluster;
+	int end_x, end_y, end_cluster;
+	int *start_cost;	// cost from start to the nodes of its cluster
+	int *end_cost;	// cost from the nodes of its cluster to end
+	int direct;	// cost from start to end inside one cluster, -1 if none
+};
+
+static void
+abstract_position(struct abstract *A, int id, int *x, int *y, int *cluster) {
+	struct hierarchy *h = A->h;
+	int lo, hi, mid;
+
+	if (id == A->start) {
+		*x = A->start_x;
+		*y = A->start_y;
+		*cluster = A->start_cluster;
+		return;
+	}
+	if (id == A->end) {
+		*x = A->end_x;
+		*y = A->end_y;
+		*cluster = A->end_cluster;
+		return;
+	}
+	// the last cluster whose offset <= id
+	lo = 0;
+	hi = h->cw * h->ch - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (A->offset[mid] <= id)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*cluster = lo;
+	*x = h->c[lo].node[id - A->offset[lo]].x;
+	*y = h->c[lo].node[id - A->offset[lo]].y;
+}
+
+static inline int
+abstract_less(struct abstract *A, int a, int b) {
+	return A->f[a] < A->f[b];
+}
+
+static void
+abstract_up(struct abstract *A, int pos) {
+	int idx = A->heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (!abstract_less(A, idx, A->heap[parent]))
+			break;
+		A->heap[pos] = A->heap[parent];
+		A->pos[A->heap[pos]] = pos;
+		pos = parent;
+	}
+	A->heap[pos] = idx;
+	A->pos[idx] = pos;
+}
+
+static void
+abstract_down(struct abstract *A, int pos, int size) {
+	int idx = A->heap[pos];
+	for (;;) {
+		int child = pos * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && abstract_less(A, A->heap[child + 1], A->heap[child]))
+			++child;
+		if (!abstract_less(A, A->heap[child], idx))
+			break;
+		A->heap[pos] = A->heap[child];
+		A->pos[A->heap[pos]] = pos;
+		pos = child;
+	}
+	A->heap[pos] = idx;
+	A->pos[idx] = pos;
+}
+
+static void
+abstract_relax(struct abstract *A, int from, int to, int cost) {
+	int g, x, y, cluster;
+
+	if (cost < 0 || A->pos[to] == -2)
+		return;
+	g = A->g[from] + cost;
+	if (A->pos[to] >= 0 && g >= A->g[to])
+		return;
+	abstract_position(A, to, &x, &y, &cluster);
+	A->g[to] = g;
+	A->f[to] = g + distance(x, y, A->end_x, A->end_y);
+	A->camefrom[to] = from;
+	if (A->pos[to] < 0) {
+		A->heap[A->open] = to;
+		A->pos[to] = A->open;
+		abstract_up(A, A->open++);
+	}
+	else {
+		abstract_up(A, A->pos[to]);
+	}
+}
+
+static void
+abstract_expand(struct abstract *A, int id) {
+	struct hierarchy *h = A->h;
+	struct cluster *c, *nc;
+	struct cluster_node *node;
+	int x, y, k, i, j, side, nx, ny, nk;
+
+	if (id == A->start) {
+		c = &h->c[A->start_cluster];
+		for (j = 0;j<c->n;j++) {
+			abstract_relax(A, id, A->offset[A->start_cluster] + j, A->start_cost[j]);
+		}
+		abstract_relax(A, id, A->end, A->direct);
+		return;
+	}
+	abstract_position(A, id, &x, &y, &k);
+	c = &h->c[k];
+	i = id - A->offset[k];
+	for (j = 0;j<c->n;j++) {
+		if (j != i)
+			abstract_relax(A, id, A->offset[k] + j, c->cost[i * c->n + j]);
+	}
+	node = &c->node[i];
+	for (side = 0;side<4;side++) {
+		if (!(node->links & (1 << side)))
+			continue;
+		nx = x + SIDE[side][0];
+		ny = y + SIDE[side][1];
+		nk = (ny / h->size) * h->cw + nx / h->size;
+		nc = &h->c[nk];
+		j = cluster_find(nc, nx, ny);
+		if (j >= 0)
+			abstract_relax(A, id, A->offset[nk] + j, 5 + 5 * map_get(A->m, nx, ny));
+	}
+	if (k == A->end_cluster)
+		abstract_relax(A, id, A->end, A->end_cost[i]);
+}
+
+// A* over the cluster graph, returns 0 when end can't be reached through it
+static int
+abstract_search(struct abstract *A) {
+	int id, i;
+
+	for (i = 0;i<A->n;i++) {
+		A->pos[i] = -1;
+	}
+	A->g[A->start] = 0;
+	A->f[A->start] = distance(A->start_x, A->start_y, A->end_x, A->end_y);
+	A->camefrom[A->start] = -1;
+	A->heap[0] = A->start;
+	A->pos[A->start] = 0;
+	A->open = 1;
+	while (A->open > 0) {
+		id = A->heap[0];
+		A->pos[id] = -2;	// closed
+		if (--A->open > 0) {
+			A->heap[0] = A->heap[A->open];
+			abstract_down(A, 0, A->open);
+		}
+		if (id == A->end)
 			return 1;
-		++head;
-		if (head > q->n)
-			head = 0;
+		abstract_expand(A, id);
 	}
 	return 0;
 }
 
+static int
+push_step(lua_State *L, int x, int y, int *n) {
+	if (!lua_checkstack(L, 2))
+		return 0;
+	lua_pushinteger(L, x);
+	lua_pushinteger(L, y);
+	++*n;
+	return 1;
+}
+
+// push the cells after (fx, fy) to (tx, ty), both inside the cluster
+static int
+refine_segment(lua_State *L, struct abstract *A, int cluster, int fx, int fy, int tx, int ty, int *n) {
+	struct hierarchy *h = A->h;
+	int cx, cy, idx, len, i;
+
+	cx = cluster % h->cw;
+	cy = cluster / h->cw;
+	cluster_search(A->m, h, cx, cy, fx, fy, 0);
+	// the heap is free after the search, use it to reverse the steps
+	len = 0;
+	idx = (ty - cy * h->size) * h->size + (tx - cx * h->size);
+	if (h->dist[idx] < 0)
+		return 1;
+	while (h->parent[idx] >= 0) {
+		h->heap[len++] = idx;
+		idx = h->parent[idx];
+	}
+	for (i = len - 1;i >= 0;i--) {
+		idx = h->heap[i];
+		if (!push_step(L, cx * h->size + idx % h->size, cy * h->size + idx / h->size, n))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+push_abstract(lua_State *L, struct abstract *A, int refine, int *n) {
+	int id, len, i, x, y, k, px, py, pk;
+
+	px = py = pk = -1;
+
+	// reverse the path in the heap, it's free now
+	len = 0;
+	for (id = A->end;id >= 0;id = A->camefrom[id]) {
+		A->heap[len++] = id;
+	}
+	*n = 0;
+	for (i = len - 1;i >= 0;i--) {
+		abstract_position(A, A->heap[i], &x, &y, &k);
+		if (x == px && y == py) {
+			// the start or the end is on an entrance
+		}
+		else if (!refine || i == len - 1) {
+			if (!push_step(L, x, y, n))
+				return 0;
+		}
+		else if (k != pk) {
+			// crossing a border
+			if (!push_step(L, x, y, n))
+				return 0;
+		}
+		else if (!refine_segment(L, A, k, px, py, x, y, n)) {
+			return 0;
+		}
+		px = x;
+		py = y;
+		pk = k;
+	}
+	return 1;
+}
+
+static int *
+endpoint_cost(struct abstract *A, int cluster, int x, int y, int reverse) {
+	struct hierarchy *h = A->h;
+	struct cluster *c = &h->c[cluster];
+	int cx = cluster % h->cw;
+	int cy = cluster / h->cw;
+	int *cost;
+	int i;
+
+	cluster_search(A->m, h, cx, cy, x, y, reverse);
+	cost = malloc((c->n + 1) * sizeof(int));
+	for (i = 0;i<c->n;i++) {
+		cost[i] = cluster_dist(h, cx, cy, c->node[i].x, c->node[i].y);
+	}
+	return cost;
+}
+
+/*
+userdata map
+integer start_x, start_y, end_x, end_y
+boolean refine (optional)
+
+return x1, y1, x2, y2, ...
+Plan on the cluster graph and return the waypoints, two successive waypoints
+are in the same cluster (or next to each other), so pathfinding.path between
+them is cheap. With refine, return every cell of the path instead.
+Falls back to path when the cluster graph doesn't connect them.
+*/
+static int
+lhpath(lua_State *L) {
+	struct map *m;
+	struct hierarchy *h;
+	struct abstract A;
+	int refine, i, n, found, ok;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	A.start_x = (int)luaL_checkinteger(L, 2);
+	A.start_y = (int)luaL_checkinteger(L, 3);
+	A.end_x = (int)luaL_checkinteger(L, 4);
+	A.end_y = (int)luaL_checkinteger(L, 5);
+	refine = lua_toboolean(L, 6);
+	check_position(L, m, A.start_x, A.start_y);
+	check_position(L, m, A.end_x, A.end_y);
+
+	h = check_hierarchy(L, m, 1);
+	A.m = m;
+	A.h = h;
+	A.offset = malloc((h->cw * h->ch) * sizeof(int));
+	A.n = 0;
+	for (i = 0;i<h->cw * h->ch;i++) {
+		A.offset[i] = A.n;
+		A.n += h->c[i].n;
+	}
+	A.start = A.n++;
+	A.end = A.n++;
+	A.g = malloc(A.n * 5 * sizeof(int));
+	A.f = A.g + A.n;
+	A.camefrom = A.f + A.n;
+	A.heap = A.camefrom + A.n;
+	A.pos = A.heap + A.n;
+	A.start_cluster = (A.start_y / h->size) * h->cw + A.start_x / h->size;
+	A.end_cluster = (A.end_y / h->size) * h->cw + A.end_x / h->size;
+	A.start_cost = endpoint_cost(&A, A.start_cluster, A.start_x, A.start_y, 0);
+	A.direct = -1;
+	if (A.start_cluster == A.end_cluster) {
+		A.direct = cluster_dist(h, A.start_cluster % h->cw, A.start_cluster / h->cw, A.end_x, A.end_y);
+	}
+	A.end_cost = endpoint_cost(&A, A.end_cluster, A.end_x, A.end_y, 1);
+
+	found = abstract_search(&A);
+	ok = 1;
+	n = 0;
+	if (found) {
+		lua_settop(L, 0);
+		ok = push_abstract(L, &A, refine, &n);
+	}
+	free(A.start_cost);
+	free(A.end_cost);
+	free(A.g);
+	free(A.offset);
+	if (!ok) {
+		return luaL_error(L, "path too long");
+	}
+	if (!found) {
+		lua_settop(L, 5);
+		return search_path(L, path_finding);
+	}
+	return n * 2;
+}
+
+struct map *
+	new_flowgraph(lua_State *L, struct map *m, int index) {
+	if (lua_type(L, index) == LUA_TUSERDATA) {
+		struct map * result = lua_touserdata(L, index);
+		if (m->width == result->width && m->height == result->height) {
+			memset(result->m, 0, m->width * m->height * sizeof(result->m[0]));
+			return result;
+		}
+		lua_settop(L, index - 1);
+	}
+	struct map * result = lua_newuserdata(L, sizeof(struct map) + m->width * m->height * sizeof(m->m[0]));
+	result->width = m->width;
+	result->height = m->height;
+	// a flow map holds directions, never search it with jps
+	result->weighted = m->width * m->height;
+	memset(result->m, 0, m->width * m->height * sizeof(result->m[0]));
+	return result;
+}
+
+
 static void
-init_route(struct map * block, struct map *m, int *route, struct route_queue *q) {
-	int width = m->width;
-	int height = m->height;
-	int i, j;
-	for (i = 0;i<height;i++) {
-		for (j = 0;j<width;j++) {
-			int w = m->m[i * width + j];
-			int b = block->m[i * width + j];
-			if (w && b != BLOCK_WEIGHT) {
-				route[i * width + j] = w + b * 5;
-				enter_queue(q, j, i);
-			}
+addtarget_map(lua_State *L, struct map *m, const char * target, char mark) {
+	int x = 0, y = 0;
+	int i;
+	char c;
+	for (i = 0;(c = target[i]);i++) {
+		if (c == '\n') {
+			++y;
+			if (y >= m->height)
+				break;
+			x = 0;
+			continue;
+		}
+		if (c == '\r')
+			continue;
+		if (c == mark && x < m->width) {
+			m->m[y * m->width + x] = 1;
 		}
+		++x;
 	}
 }
 
+/*
+	Buffers of one flow field, cached on the flow map (as "route" of its
+	uservalue), so it can be repaired when a cell changes. The distances are
+	computed with Dial's algorithm: the costs are small integers, so the open
+	cells are kept in circular buckets of doubly linked lists indexed by
+	distance.
+*/
+struct route {
+	struct map *block;
+	struct map *result;
+	int size;
+	int *route;	// distance to the nearest target, 0 when not reached
+	int *next;
+	int *prev;	// -2 when the cell is not in a bucket
+	int *head;
+	uint8_t *target;	// the marks of the targets
+	uint8_t *mark;	// scratch of flowrepair
+	int count;
+	int current;
+};
+
+static struct route *
+check_route(lua_State *L, struct map *block, int index) {
+	struct route *r;
+	int n;
+
+	index = lua_absindex(L, index);
+	n = block->width * block->height;
+	if (get_cache(L, index, "route") == LUA_TUSERDATA) {
+		r = lua_touserdata(L, -1);
+		if (r->size == n) {
+			lua_pop(L, 2);
+			r->block = block;
+			r->result = lua_touserdata(L, index);
+			return r;
+		}
+	}
+	lua_pop(L, 1);
+	r = lua_newuserdata(L, sizeof(struct route) + (n * 3 + ROUTE_BUCKETS) * sizeof(int) + n * 2);
+	r->size = n;
+	r->route = (int *)(r + 1);
+	r->next = r->route + n;
+	r->prev = r->next + n;
+	r->head = r->prev + n;
+	r->target = (uint8_t *)(r->head + ROUTE_BUCKETS);
+	r->mark = r->target + n;
+	memset(r->mark, 0, n);
+	lua_setfield(L, -2, "route");
+	lua_pop(L, 1);
+	r->block = block;
+	r->result = lua_touserdata(L, index);
+	return r;
+}
+
+static void
+bucket_insert(struct route *r, int cell, int dist) {
+	int *head = &r->head[dist % ROUTE_BUCKETS];
+	r->prev[cell] = -1;
+	r->next[cell] = *head;
+	if (*head >= 0)
+		r->prev[*head] = cell;
+	*head = cell;
+	++r->count;
+}
+
+static void
+bucket_remove(struct route *r, int cell, int dist) {
+	if (r->prev[cell] >= 0)
+		r->next[r->prev[cell]] = r->next[cell];
+	else
+		r->head[dist % ROUTE_BUCKETS] = r->next[cell];
+	if (r->next[cell] >= 0)
+		r->prev[r->next[cell]] = r->prev[cell];
+	r->prev[cell] = -2;
+	--r->count;
+}
+
 static void
-gen_route(struct map *m, int *route, struct route_queue *q) {
-	struct route_coord *c = NULL;
+init_route(struct route *r) {
+	struct map *block = r->block;
+	struct map *m = r->result;
+	int n = m->width * m->height;
+	int i, w, b;
+
+	r->count = 0;
+	r->current = -1;
+	for (i = 0;i<ROUTE_BUCKETS;i++) {
+		r->head[i] = -1;
+	}
+	for (i = 0;i<n;i++) {
+		r->prev[i] = -2;
+		r->route[i] = 0;
+		r->target[i] = m->m[i];
+		w = m->m[i];
+		b = block->m[i];
+		if (w && b != BLOCK_WEIGHT) {
+			r->route[i] = w + b * 5;
+			bucket_insert(r, i, r->route[i]);
+			if (r->current < 0 || r->route[i] < r->current)
+				r->current = r->route[i];
+		}
+	}
+}
+
+static void
+gen_route(struct route *r) {
+	struct map *m = r->block;
+	int *route = r->route;
 	int width = m->width;
 	int height = m->height;
-	while ((c = leave_queue(q))) {
-		int weight = m->m[c->y * width + c->x];
-		if (weight == BLOCK_WEIGHT)
+	int cell, cx, cy, i, x, y, dis, w;
+
+	while (r->count > 0) {
+		while ((cell = r->head[r->current % ROUTE_BUCKETS]) < 0) {
+			++r->current;
+		}
+		bucket_remove(r, cell, route[cell]);
+		if (m->m[cell] == BLOCK_WEIGHT)
 			continue;
-		int i;
-		int odis = route[c->y * width + c->x];
+		cx = cell % width;
+		cy = cell / width;
 		for (i = 0;i<8;i++) {
-			int x = c->x + OFF[i].dx;
-			int y = c->y + OFF[i].dy;
+			x = cx + OFF[i].dx;
+			y = cy + OFF[i].dy;
 			if (x >= 0 && x < width && y >= 0 && y < height) {
-				int dis = odis + OFF[i].distance + m->m[y * width + x] * 5;
-				int w = route[y * width + x];
-				if (w == 0) {
+				dis = route[cell] + OFF[i].distance + m->m[y * width + x] * 5;
+				w = route[y * width + x];
+				if (w == 0 || w > dis) {
+					if (r->prev[y * width + x] != -2)
+						bucket_remove(r, y * width + x, w);
 					route[y * width + x] = dis;
-					enter_queue(q, x, y);
+					bucket_insert(r, y * width + x, dis);
 				}
-				else {
-					if (w > dis) {
-						route[y * width + x] = dis;
-						if (!queue_exist(q, x, y)) {
-							enter_queue(q, x, y);
-						}
-					}
+			}
+		}
+	}
+}
+
+static int
+route_direction(int *route, int width, int height, int j, int i) {
+	int w = route[i*width + j];
+	int min_id = 0;
+	if (w > 1) {
+		int k;
+		int min = w + 7;
+		for (k = 0;k<8;k++) {
+			int x = j + OFF[k].dx;
+			int y = i + OFF[k].dy;
+			if (x >= 0 && x < width && y >= 0 && y < height) {
+				int weight = route[y*width + x] + OFF[k].distance;
+				if (weight > 0 && weight < min) {
+					min = weight;
+					min_id = k + 1;
 				}
 			}
 		}
 	}
+	return min_id;
 }
 
 static void
@@ -566,28 +1813,42 @@ convert_route(int *route, struct map *m) {
 	int i, j;
 	for (i = 0;i<height;i++) {
 		for (j = 0;j<width;j++) {
-			int w = route[i*width + j];
-			int min_id = 0;
-			if (w > 1) {
-				int k;
-				int min = w + 7;
-				for (k = 0;k<8;k++) {
-					int x = j + OFF[k].dx;
-					int y = i + OFF[k].dy;
-					if (x >= 0 && x < width && y >= 0 && y < height) {
-						int weight = route[y*width + x] + OFF[k].distance;
-						if (weight > 0 && weight < min) {
-							min = weight;
-							min_id = k + 1;
-						}
-					}
-				}
-			}
-			m->m[i*width + j] = min_id;
+			m->m[i*width + j] = route_direction(route, width, height, j, i);
 		}
 	}
 }
 
+static void
+compute_route(struct route *r) {
+	init_route(r);
+	gen_route(r);
+	convert_route(r->route, r->result);
+}
+
+// mark the targets of table at index into result
+static void
+flow_target(lua_State *L, struct map *result, int index) {
+	const char *target_map, *mark;
+
+	lua_rawgeti(L, index, 1);
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		target_map = lua_tostring(L, -1);
+		lua_pop(L, 1);	// the string is in the table
+
+		lua_rawgeti(L, index, 2);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			luaL_error(L, "Invalid target map");
+		}
+		mark = lua_tostring(L, -1);
+		lua_pop(L, 1);
+
+		addtarget_map(L, result, target_map, mark[0]);
+	}
+	else {
+		lua_pop(L, 1);
+	}
+}
+
 /*
 userdata buildingmap
 table target {
@@ -606,48 +1867,474 @@ lflowgraph(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TUSERDATA);
 	struct map * m = lua_touserdata(L, 1);
 	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 3);
 	struct map * result = new_flowgraph(L, m, 3);
+
+	flow_target(L, result, 2);
+	compute_route(check_route(L, m, -1));
+
+	return 1;
+}
+
+struct flow_worker {
+	struct route **r;
+	int n;
+	int from;
+	int step;
+};
+
+static void
+flow_work(struct flow_worker *w) {
+	int i;
+	for (i = w->from;i<w->n;i += w->step) {
+		compute_route(w->r[i]);
+	}
+}
+
+#ifndef PATHFINDING_NOTHREAD
+#if defined(_WIN32)
+
+static unsigned __stdcall
+flow_thread(void *ud) {
+	flow_work(ud);
+	return 0;
+}
+
+static void
+flow_parallel(struct flow_worker *w, int threads) {
+	HANDLE h[FLOW_THREADS_MAX];
+	int i;
+	for (i = 1;i<threads;i++) {
+		h[i] = (HANDLE)_beginthreadex(NULL, 0, flow_thread, &w[i], 0, NULL);
+		if (h[i] == 0)
+			flow_work(&w[i]);
+	}
+	flow_work(&w[0]);
+	for (i = 1;i<threads;i++) {
+		if (h[i]) {
+			WaitForSingleObject(h[i], INFINITE);
+			CloseHandle(h[i]);
+		}
+	}
+}
+
+#else
+
+static void *
+flow_thread(void *ud) {
+	flow_work(ud);
+	return NULL;
+}
+
+static void
+flow_parallel(struct flow_worker *w, int threads) {
+	pthread_t pid[FLOW_THREADS_MAX];
+	int created[FLOW_THREADS_MAX];
+	int i;
+	for (i = 1;i<threads;i++) {
+		created[i] = pthread_create(&pid[i], NULL, flow_thread, &w[i]) == 0;
+		if (!created[i])
+			flow_work(&w[i]);
+	}
+	flow_work(&w[0]);
+	for (i = 1;i<threads;i++) {
+		if (created[i])
+			pthread_join(pid[i], NULL);
+	}
+}
+
+#endif
+#else
+
+static void
+flow_parallel(struct flow_worker *w, int threads) {
+	int i;
+	for (i = 0;i<threads;i++) {
+		flow_work(&w[i]);
+	}
+}
+
+#endif
+
+/*
+userdata buildingmap
+table targets { target1, target2, ... } (each target is the same as flowgraph)
+table results { flowmap1, flowmap2, ... } (optional: reuse)
+integer threads (optional: default is one per target, FLOW_THREADS_MAX at most)
+
+return table results
+
+Compute the flow field of each target concurrently, the building map must not
+change meanwhile.
+*/
+static int
+lflowgraphs(lua_State *L) {
+	struct map *m, *result;
+	struct route **r;
+	struct flow_worker w[FLOW_THREADS_MAX];
+	int n, threads, i, target;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (int)lua_rawlen(L, 2);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_createtable(L, n, 0);
+	}
+	else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+	threads = (int)luaL_optinteger(L, 4, n);
+	if (threads > n)
+		threads = n;
+	if (threads > FLOW_THREADS_MAX)
+		threads = FLOW_THREADS_MAX;
+	if (threads < 1)
+		threads = 1;
+	lua_settop(L, 3);
+
+	r = lua_newuserdata(L, n * sizeof(struct route *));
+	for (i = 0;i<n;i++) {
+		if (lua_rawgeti(L, 2, i + 1) != LUA_TTABLE) {
+			return luaL_error(L, "Invalid target %d", i + 1);
+		}
+		target = lua_gettop(L);
+		lua_rawgeti(L, 3, i + 1);
+		result = new_flowgraph(L, m, target + 1);
+		r[i] = check_route(L, m, -1);
+		lua_rawseti(L, 3, i + 1);
+		flow_target(L, result, target);
+		lua_settop(L, target - 1);
+	}
+	for (i = 0;i<threads;i++) {
+		w[i].r = r;
+		w[i].n = n;
+		w[i].from = i;
+		w[i].step = threads;
+	}
+	flow_parallel(w, threads);
+	lua_settop(L, 3);
+	return 1;
+}
+
+/*
+	flowrepair works on the few cells around a change, so it uses a binary
+	heap (lazy deletion) and a list of touched cells, both grown on demand,
+	instead of the buckets which need the distances to be close.
+*/
+struct repair {
+	struct route *r;
+	int heap_n;
+	int heap_cap;
+	struct repair_node {
+		int dist;
+		int cell;
+	} *heap;
+	int touched_n;
+	int touched_cap;
+	int *touched;
+	int ok;
+};
+
+#define REPAIR_CANDIDATE 1
+#define REPAIR_AFFECTED 2
+
+static void
+repair_push(struct repair *rp, int dist, int cell) {
+	struct repair_node *e;
+	int pos, parent;
+
+	if (rp->heap_n >= rp->heap_cap) {
+		int cap = rp->heap_cap ? rp->heap_cap * 2 : 64;
+		e = realloc(rp->heap, cap * sizeof(*e));
+		if (e == NULL) {
+			rp->ok = 0;
+			return;
+		}
+		rp->heap = e;
+		rp->heap_cap = cap;
+	}
+	e = rp->heap;
+	pos = rp->heap_n++;
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (e[parent].dist <= dist)
+			break;
+		e[pos] = e[parent];
+		pos = parent;
+	}
+	e[pos].dist = dist;
+	e[pos].cell = cell;
+}
+
+static struct repair_node
+repair_pop(struct repair *rp) {
+	struct repair_node *e = rp->heap;
+	struct repair_node top = e[0];
+	struct repair_node last = e[--rp->heap_n];
+	int pos = 0, child;
+
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= rp->heap_n)
+			break;
+		if (child + 1 < rp->heap_n && e[child + 1].dist < e[child].dist)
+			++child;
+		if (last.dist <= e[child].dist)
+			break;
+		e[pos] = e[child];
+		pos = child;
+	}
+	if (rp->heap_n > 0)
+		e[pos] = last;
+	return top;
+}
+
+static void
+repair_touch(struct repair *rp, int cell) {
+	int *t;
+
+	if (rp->touched_n >= rp->touched_cap) {
+		int cap = rp->touched_cap ? rp->touched_cap * 2 : 64;
+		t = realloc(rp->touched, cap * sizeof(int));
+		if (t == NULL) {
+			rp->ok = 0;
+			return;
+		}
+		rp->touched = t;
+		rp->touched_cap = cap;
+	}
+	rp->touched[rp->touched_n++] = cell;
+}
+
+// the distance of the cell as a target, 0 if it isn't one
+static inline int
+route_source(struct route *r, int cell) {
+	int b = r->block->m[cell];
+	if (r->target[cell] && b != BLOCK_WEIGHT)
+		return r->target[cell] + b * 5;
+	return 0;
+}
+
+// the best distance of the cell from its neighbors not affected, 0 if none
+static int
+route_support(struct route *r, int cell) {
+	struct map *m = r->block;
+	int width = m->width;
+	int cx = cell % width;
+	int cy = cell / width;
+	int best = route_source(r, cell);
+	int i, x, y, u, d;
+
+	for (i = 0;i<8;i++) {
+		x = cx + OFF[i].dx;
+		y = cy + OFF[i].dy;
+		if (x < 0 || x >= width || y < 0 || y >= m->height)
+			continue;
+		u = y * width + x;
+		if (r->route[u] == 0 || m->m[u] == BLOCK_WEIGHT || r->mark[u] == REPAIR_AFFECTED)
+			continue;
+		d = r->route[u] + OFF[i].distance + m->m[cell] * 5;
+		if (best == 0 || d < best)
+			best = d;
+	}
+	return best;
+}
+
+static void
+repair_candidate(struct repair *rp, int cell) {
+	struct route *r = rp->r;
+	if (r->route[cell] == 0 || r->mark[cell])
+		return;
+	r->mark[cell] = REPAIR_CANDIDATE;
+	repair_touch(rp, cell);
+	repair_push(rp, r->route[cell], cell);
+}
+
+static void
+repair_neighbors(struct repair *rp, int cell, int candidate) {
+	struct route *r = rp->r;
+	int width = r->block->width;
+	int height = r->block->height;
+	int cx = cell % width;
+	int cy = cell / width;
+	int i, x, y;
+
+	for (i = 0;i<8;i++) {
+		x = cx + OFF[i].dx;
+		y = cy + OFF[i].dy;
+		if (x < 0 || x >= width || y < 0 || y >= height)
+			continue;
+		if (candidate) {
+			if (r->route[y * width + x] > r->route[cell])
+				repair_candidate(rp, y * width + x);
+		}
+		else {
+			repair_touch(rp, y * width + x);
+		}
+	}
+}
+
+/*
+	Repair the distances after the weight of one cell changed, then rewrite
+	the direction of the cells around the changed distances.
+	Return the number of directions changed, -1 when out of memory.
+*/
+static int
+repair_route(struct route *r, int cell) {
+	struct map *m = r->block;
+	struct repair rp;
+	struct repair_node e;
 	int width = m->width;
 	int height = m->height;
+	int i, n, v, x, y, d, dir, changed;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.r = r;
+	rp.ok = 1;
+
+	/*
+		1. The cells whose distance may rise: in the order of their old
+		distance, a cell is affected when no neighbor not affected (nor
+		being a target) supports its distance any more.
+	*/
+	repair_candidate(&rp, cell);
+	repair_neighbors(&rp, cell, 1);
+	while (rp.heap_n > 0 && rp.ok) {
+		v = repair_pop(&rp).cell;
+		if (route_support(r, v) == r->route[v])
+			continue;
+		r->mark[v] = REPAIR_AFFECTED;
+		repair_neighbors(&rp, v, 1);
+	}
+	n = rp.touched_n;
 
-	int i = 1;
-	lua_rawgeti(L, 2, i);
-	if (lua_type(L, -1) == LUA_TSTRING) {
-		const char * target_map = lua_tostring(L, -1);
-		lua_pop(L, 1);	// the string is in the table
+	// 2. Forget the affected distances, and restart them from their borders.
+	for (i = 0;i<n;i++) {
+		v = rp.touched[i];
+		if (r->mark[v] == REPAIR_AFFECTED)
+			r->route[v] = 0;
+	}
+	for (i = 0;i<n && rp.ok;i++) {
+		v = rp.touched[i];
+		if (r->mark[v] == REPAIR_AFFECTED) {
+			r->route[v] = route_support(r, v);
+			if (r->route[v])
+				repair_push(&rp, r->route[v], v);
+		}
+	}
+	for (i = 0;i<n;i++) {
+		r->mark[rp.touched[i]] = 0;
+	}
+	// the changed cell may be cheaper (or open) now
+	d = route_support(r, cell);
+	if (d && (r->route[cell] == 0 || d < r->route[cell])) {
+		r->route[cell] = d;
+		repair_touch(&rp, cell);
+	}
+	if (r->route[cell])
+		repair_push(&rp, r->route[cell], cell);
 
-		lua_rawgeti(L, 2, i);
-		if (lua_type(L, -1) != LUA_TSTRING) {
-			return luaL_error(L, "Invalid target map");
+	// 3. Dijkstra from there, only the improvements spread.
+	while (rp.heap_n > 0 && rp.ok) {
+		e = repair_pop(&rp);
+		if (e.dist != r->route[e.cell] || m->m[e.cell] == BLOCK_WEIGHT)
+			continue;
+		for (i = 0;i<8;i++) {
+			x = e.cell % width + OFF[i].dx;
+			y = e.cell / width + OFF[i].dy;
+			if (x < 0 || x >= width || y < 0 || y >= height)
+				continue;
+			v = y * width + x;
+			d = e.dist + OFF[i].distance + m->m[v] * 5;
+			if (r->route[v] == 0 || r->route[v] > d) {
+				r->route[v] = d;
+				repair_touch(&rp, v);
+				repair_push(&rp, d, v);
+			}
 		}
-		const char * mark = lua_tostring(L, -1);
-		lua_pop(L, 1);
+	}
 
-		addtarget_map(L, result, target_map, mark[0]);
+	// 4. A direction depends on the distances of the cell and its neighbors.
+	n = rp.touched_n;
+	for (i = 0;i<n;i++) {
+		repair_neighbors(&rp, rp.touched[i], 0);
 	}
-	else {
-		lua_pop(L, 1);
+	changed = 0;
+	for (i = 0;i<rp.touched_n;i++) {
+		v = rp.touched[i];
+		dir = route_direction(r->route, width, height, v % width, v / width);
+		if (r->result->m[v] != dir) {
+			r->result->m[v] = dir;
+			++changed;
+		}
 	}
-	int *route = malloc(width * height * sizeof(int));
-	memset(route, 0, width * height * sizeof(int));
-	struct route_queue *q = create_queue(width * height);
-	init_route(m, result, route, q);
-	gen_route(m, route, q);
-	convert_route(route, result);
-	free(route);
-	free(q);
+	free(rp.heap);
+	free(rp.touched);
+	return rp.ok ? changed : -1;
+}
 
+/*
+userdata buildingmap
+userdata flowmap (computed by flowgraph or flowgraphs from the building map)
+integer x, y (the cell changed by pathfinding.block)
+
+return the number of directions changed in flowmap
+
+Repair the flow map after one cell of the building map changed, the cost
+depends on the region affected by the change, not on the size of the map.
+*/
+static int
+lflowrepair(lua_State *L) {
+	struct map *m, *result;
+	struct route *r;
+	int x, y, changed;
+
+	luaL_checktype(L, 1, LUA_TUSERDATA);
+	m = lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TUSERDATA);
+	result = lua_touserdata(L, 2);
+	x = (int)luaL_checkinteger(L, 3);
+	y = (int)luaL_checkinteger(L, 4);
+	check_position(L, m, x, y);
+	if (result->width != m->width || result->height != m->height) {
+		return luaL_error(L, "The size of flow map mismatch");
+	}
+	if (get_cache(L, 2, "route") != LUA_TUSERDATA) {
+		return luaL_error(L, "No route in flow map, call flowgraph first");
+	}
+	r = lua_touserdata(L, -1);
+	r->block = m;
+	r->result = result;
+	changed = repair_route(r, y * m->width + x);
+	if (changed < 0) {
+		return luaL_error(L, "Out of memory");
+	}
+	lua_pushinteger(L, changed);
 	return 1;
 }
 
 int
 luaopen_pathfinding(lua_State *L) {
 	//luaL_checkversion(L);
+	if (luaL_newmetatable(L, HIERARCHY)) {
+		lua_pushcfunction(L, lhierarchy_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
 	luaL_Reg l[] = {
 		{ "new", lnewmap },
 		{ "block", lblock },
 		{ "path", lpath },
+		{ "path_batch", lpath_batch },
+		{ "jps", ljps },
+		{ "expanded", lexpanded },
+		{ "hierarchy", lhierarchy },
+		{ "hpath", lhpath },
 		{ "flowgraph", lflowgraph },
+		{ "flowgraphs", lflowgraphs },
+		{ "flowrepair", lflowrepair },
 		{ NULL, NULL },
 	};
 #if LUA_VERSION_NUM < 502
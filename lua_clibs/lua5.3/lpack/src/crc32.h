@@ -1,5 +1,12 @@
-#pragma once
-#include <stdint.h>
-
-extern uint32_t CalcCRC(const char* str, size_t length);
-//uint32_t CalcCRCNoCase(const char* str, size_t length);
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// builds the tables; call once before any of the functions below, e.g. when the module is opened
+extern void InitCRC(void);
+
+extern uint32_t CalcCRC(const char* str, size_t length);
+// standard (zlib compatible) CRC-32 and CRC-32C, continuing from prev (0 to start)
+extern uint32_t CalcCRC32(uint32_t prev, const char* str, size_t length);
+extern uint32_t CalcCRC32C(uint32_t prev, const char* str, size_t length);
+//uint32_t CalcCRCNoCase(const char* str, size_t length);
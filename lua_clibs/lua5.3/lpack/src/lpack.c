@@ -24,11 +24,23 @@
 #define	OP_UINT		'I'		/* unsigned int */
 #define	OP_LONG		'l'		/* long */
 #define	OP_ULONG	'L'		/* unsigned long */
+#define	OP_INT8		'y'		/* int8_t */
+#define	OP_UINT8	'Y'		/* uint8_t */
+#define	OP_INT16	's'		/* int16_t */
+#define	OP_UINT16	'S'		/* uint16_t */
+#define	OP_INT32	'j'		/* int32_t */
+#define	OP_UINT32	'J'		/* uint32_t */
+#define	OP_INT64	'q'		/* int64_t */
+#define	OP_UINT64	'Q'		/* uint64_t */
+#define	OP_VARINT	'v'		/* LEB128 varint */
+#define	OP_ZIGZAG	'V'		/* zigzag encoded LEB128 varint */
 #define	OP_LITTLEENDIAN	'<'		/* little endian */
 #define	OP_BIGENDIAN	'>'		/* big endian */
 #define	OP_NATIVE	'='		/* native endian */
 
 #include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lua.h"
@@ -43,12 +55,70 @@
 #include <windows.h>
 #endif
 
-static void badcode(lua_State *L, int c)
+#define	LPACK_FORMAT	"lpack.format"	/* metatable of compiled formats */
+#define	LPACK_BUFFER	"lpack.buffer"	/* metatable of mutable buffers */
+#define	LPACK_CACHE_SIZE	64		/* formats kept by pack/unpack */
+#define	LPACK_VARINT_MAX	10		/* bytes in the longest varint */
+
+#if LUA_VERSION_NUM >= 503
+#define lpack_checkint(L,i)	((int64_t)luaL_checkinteger(L,i))
+#define lpack_pushint(L,v)	lua_pushinteger(L,(lua_Integer)(v))
+#else
+#define lpack_checkint(L,i)	((int64_t)luaL_checknumber(L,i))
+#define lpack_pushint(L,v)	lua_pushnumber(L,(lua_Number)(v))
+#endif
+
+typedef struct lpack_Op
 {
- char s[]="bad code `?'";
- s[sizeof(s)-3]=c;
- luaL_argerror(L,1,s);
-}
+ int code;
+ int swap;
+ size_t count;		/* repetitions; length for OP_STRING in unpack */
+} lpack_Op;
+
+typedef struct lpack_Format
+{
+ size_t fixed;		/* most bytes written by pack apart from string bodies */
+ int nops;
+ int nargs;		/* values consumed by pack */
+ int nresults;		/* values produced by unpack */
+ int strings;		/* has ops whose size depends on the arguments */
+ size_t flen;
+ const char *f;		/* copy of the source format, follows op[] */
+ lpack_Op op[1];
+} lpack_Format;
+
+typedef struct lpack_Cache
+{
+ unsigned tick;
+ struct
+ {
+  lpack_Format *F;
+  unsigned hash;
+  unsigned used;
+ } slot[LPACK_CACHE_SIZE];
+} lpack_Cache;
+
+typedef struct lpack_Buffer
+{
+ size_t len;
+ size_t cap;
+ char *data;
+} lpack_Buffer;
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#define lpack_bswap16(x)	_byteswap_ushort(x)
+#define lpack_bswap32(x)	_byteswap_ulong(x)
+#define lpack_bswap64(x)	_byteswap_uint64(x)
+#elif defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define lpack_bswap16(x)	__builtin_bswap16(x)
+#define lpack_bswap32(x)	__builtin_bswap32(x)
+#define lpack_bswap64(x)	__builtin_bswap64(x)
+#else
+#define lpack_bswap16(x)	((uint16_t)((x) >> 8 | (x) << 8))
+#define lpack_bswap32(x)	((x) >> 24 | ((x) >> 8 & 0xff00) | ((x) & 0xff00) << 8 | (x) << 24)
+#define lpack_bswap64(x)	((uint64_t)lpack_bswap32((uint32_t)(x)) << 32 | lpack_bswap32((uint32_t)((x) >> 32)))
+#endif
 
 static int doendian(int c)
 {
@@ -60,30 +130,286 @@ static int doendian(int c)
  return 0;
 }
 
-static void doswap(int swap, void *p, size_t n)
+static void doswap(void *p, size_t n)
+{
+ switch (n)
+ {
+  case 1:
+   break;
+  case 2:
+  {
+   uint16_t a;
+   memcpy(&a,p,2);
+   a=lpack_bswap16(a);
+   memcpy(p,&a,2);
+   break;
+  }
+  case 4:
+  {
+   uint32_t a;
+   memcpy(&a,p,4);
+   a=lpack_bswap32(a);
+   memcpy(p,&a,4);
+   break;
+  }
+  case 8:
+  {
+   uint64_t a;
+   memcpy(&a,p,8);
+   a=lpack_bswap64(a);
+   memcpy(p,&a,8);
+   break;
+  }
+  default:
+  {
+   char *a=p;
+   size_t i,j;
+   for (i=0, j=n-1, n=n/2; n--; i++, j--)
+   {
+    char t=a[i]; a[i]=a[j]; a[j]=t;
+   }
+   break;
+  }
+ }
+}
+
+static size_t opsize(int c)		/* most bytes per repetition, 0 if unknown */
+{
+ switch (c)
+ {
+  case OP_BSTRING: return sizeof(unsigned char);
+  case OP_WSTRING: return sizeof(unsigned short);
+  case OP_SSTRING: return sizeof(size_t);
+  case OP_STRING: case OP_ZSTRING: return 0;
+  case OP_NUMBER: return sizeof(lua_Number);
+  case OP_DOUBLE: return sizeof(double);
+  case OP_FLOAT: return sizeof(float);
+  case OP_CHAR: return sizeof(char);
+  case OP_BYTE: return sizeof(unsigned char);
+  case OP_SHORT: return sizeof(short);
+  case OP_USHORT: return sizeof(unsigned short);
+  case OP_INT: return sizeof(int);
+  case OP_UINT: return sizeof(unsigned int);
+  case OP_LONG: return sizeof(long);
+  case OP_ULONG: return sizeof(unsigned long);
+  case OP_INT8: case OP_UINT8: return 1;
+  case OP_INT16: case OP_UINT16: return 2;
+  case OP_INT32: case OP_UINT32: return 4;
+  case OP_INT64: case OP_UINT64: return 8;
+  case OP_VARINT: case OP_ZIGZAG: return LPACK_VARINT_MAX;
+  default: return 0;
+ }
+}
+
+/* bytes needed by a format of flen characters: at most one op per character */
+static size_t formatsize(size_t flen)
+{
+ return offsetof(lpack_Format,op)+(flen>0 ? flen : 1)*sizeof(lpack_Op)+flen+1;
+}
+
+/* decode f into F; returns 0 or the offending letter */
+static int compile(const char *f, size_t flen, lpack_Format *F)
 {
- if (swap)
+ const char *e=f+flen;
+ int swap=0;
+ char *copy=(char*)&F->op[flen>0 ? flen : 1];
+ memcpy(copy,f,flen);
+ copy[flen]=0;
+ F->f=copy;
+ F->flen=flen;
+ F->fixed=0;
+ F->nops=0;
+ F->nargs=0;
+ F->nresults=0;
+ F->strings=0;
+ while (f<e && *f)
  {
-  char *a=p;
-  int i,j;
-  for (i=0, j=n-1, n=n/2; n--; i++, j--)
+  int c=*f++;
+  size_t N=1;
+  lpack_Op *op;
+  if (f<e && isdigit((unsigned char)*f))
   {
-   char t=a[i]; a[i]=a[j]; a[j]=t;
+   N=0;
+   while (f<e && isdigit((unsigned char)*f)) N=10*N+(*f++)-'0';
   }
+  switch (c)
+  {
+   case OP_LITTLEENDIAN:
+   case OP_BIGENDIAN:
+   case OP_NATIVE:
+    swap=doendian(c);
+    continue;
+   case ' ': case ',':
+    continue;
+   case OP_STRING: case OP_ZSTRING:
+   case OP_BSTRING: case OP_WSTRING: case OP_SSTRING:
+    F->strings=1;
+    break;
+   default:
+    if (opsize(c)==0) return c;
+    break;
+  }
+  op=&F->op[F->nops++];
+  op->code=c;
+  op->swap=swap;
+  op->count=N;
+  F->fixed+=N*opsize(c);
+  F->nargs+=(int)N;
+  F->nresults+=(c==OP_STRING) ? 1 : (int)N;
  }
+ return 0;
 }
 
+static void badcode(lua_State *L, int arg, int c)
+{
+ char s[]="bad code `?'";
+ s[sizeof(s)-3]=c;
+ luaL_argerror(L,arg,s);
+}
+
+static unsigned hashformat(const char *f, size_t flen)
+{
+ unsigned h=2166136261u;
+ while (flen--) h=(h^(unsigned char)*f++)*16777619u;
+ return h;
+}
+
+/* compiled form of the format at arg, through the cache in upvalue 1 */
+static const lpack_Format *cachedformat(lua_State *L, int arg)
+{
+ size_t flen;
+ const char *f=luaL_checklstring(L,arg,&flen);
+ lpack_Cache *C=(lpack_Cache*)lua_touserdata(L,lua_upvalueindex(1));
+ unsigned h=hashformat(f,flen);
+ int i,victim=0;
+ lpack_Format *F;
+ int c;
+ for (i=0; i<LPACK_CACHE_SIZE; i++)
+ {
+  F=C->slot[i].F;
+  if (F==NULL)
+  {
+   victim=i;
+   break;
+  }
+  if (C->slot[i].hash==h && F->flen==flen && memcmp(F->f,f,flen)==0)
+  {
+   C->slot[i].used=++C->tick;
+   return F;
+  }
+  if (C->slot[i].used<C->slot[victim].used) victim=i;
+ }
+ F=(lpack_Format*)malloc(formatsize(flen));
+ if (F==NULL) luaL_error(L,"not enough memory");
+ c=compile(f,flen,F);
+ if (c!=0)
+ {
+  free(F);
+  badcode(L,arg,c);
+ }
+ free(C->slot[victim].F);
+ C->slot[victim].F=F;
+ C->slot[victim].hash=h;
+ C->slot[victim].used=++C->tick;
+ return F;
+}
+
+static int cache_gc(lua_State *L)
+{
+ lpack_Cache *C=(lpack_Cache*)lua_touserdata(L,1);
+ int i;
+ for (i=0; i<LPACK_CACHE_SIZE; i++)
+ {
+  free(C->slot[i].F);
+  C->slot[i].F=NULL;
+ }
+ return 0;
+}
+
+static void *testudata(lua_State *L, int i, const char *tname)
+{
+ void *p=lua_touserdata(L,i);
+ if (p==NULL || !lua_getmetatable(L,i)) return NULL;
+ luaL_getmetatable(L,tname);
+ if (!lua_rawequal(L,-1,-2)) p=NULL;
+ lua_pop(L,2);
+ return p;
+}
+
+/* bytes of a string or an lpack.buffer */
+static const char *checkbytes(lua_State *L, int i, size_t *len)
+{
+ lpack_Buffer *B=(lpack_Buffer*)testudata(L,i,LPACK_BUFFER);
+ if (B!=NULL)
+ {
+  *len=B->len;
+  return B->data!=NULL ? B->data : "";
+ }
+ return luaL_checklstring(L,i,len);
+}
+
+static char *packvarint(char *p, uint64_t v)
+{
+ while (v>=0x80)
+ {
+  *p++=(char)(v|0x80);
+  v>>=7;
+ }
+ *p++=(char)v;
+ return p;
+}
+
+/* 0 if the varint at s+*i is truncated or too long */
+static int unpackvarint(const char *s, size_t len, size_t *i, uint64_t *v)
+{
+ size_t j=*i;
+ uint64_t r=0;
+ int shift;
+ for (shift=0; shift<64 && j<len; shift+=7)
+ {
+  unsigned char c=(unsigned char)s[j++];
+  r|=(uint64_t)(c&0x7f)<<shift;
+  if (c<0x80)
+  {
+   *i=j;
+   *v=r;
+   return 1;
+  }
+ }
+ return 0;
+}
+
+#define UNPACKINT(OP,T)			\
+   case OP:				\
+   {					\
+    T a;				\
+    size_t m=sizeof(a);			\
+    for (N=op->count; N--; )		\
+    {					\
+     if (i+m>len) goto done;		\
+     memcpy(&a,s+i,m);			\
+     i+=m;				\
+     if (op->swap) doswap(&a,m);	\
+     lpack_pushint(L,a);		\
+     ++n;				\
+    }					\
+    break;				\
+   }
+
 #define UNPACKNUMBER(OP,T)		\
    case OP:				\
    {					\
     T a;				\
-    int m=sizeof(a);			\
-    if (i+m>len) goto done;		\
-    memcpy(&a,s+i,m);			\
-    i+=m;				\
-    doswap(swap,&a,m);			\
-    lua_pushnumber(L,(lua_Number)a);	\
-    ++n;				\
+    size_t m=sizeof(a);			\
+    for (N=op->count; N--; )		\
+    {					\
+     if (i+m>len) goto done;		\
+     memcpy(&a,s+i,m);			\
+     i+=m;				\
+     if (op->swap) doswap(&a,m);	\
+     lua_pushnumber(L,(lua_Number)a);	\
+     ++n;				\
+    }					\
     break;				\
    }
 
@@ -91,65 +417,60 @@ static void doswap(int swap, void *p, size_t n)
    case OP:				\
    {					\
     T l;				\
-    int m=sizeof(l);			\
-    if (i+m>len) goto done;		\
-    memcpy(&l,s+i,m);			\
-    doswap(swap,&l,m);			\
-    if (i+m+l>len) goto done;		\
-    i+=m;				\
-    lua_pushlstring(L,s+i,l);		\
-    i+=l;				\
-    ++n;				\
+    size_t m=sizeof(l);			\
+    for (N=op->count; N--; )		\
+    {					\
+     if (i+m>len) goto done;		\
+     memcpy(&l,s+i,m);			\
+     if (op->swap) doswap(&l,m);	\
+     if (i+m+l>len) goto done;		\
+     i+=m;				\
+     lua_pushlstring(L,s+i,l);		\
+     i+=l;				\
+     ++n;				\
+    }					\
     break;				\
    }
 
-static int l_unpack(lua_State *L) 		/** unpack(s,f,[init]) */
+static int unpack(lua_State *L, const lpack_Format *F, int sarg, int iarg)
 {
  size_t len;
- const char *s=luaL_checklstring(L,1,&len);
- const char *f=luaL_checkstring(L,2);
- size_t i=(size_t)luaL_optnumber(L,3,1)-1;
+ const char *s=checkbytes(L,sarg,&len);
+ size_t i=(size_t)luaL_optnumber(L,iarg,1)-1;
+ const lpack_Op *op=F->op;
+ const lpack_Op *e=op+F->nops;
  int n=0;
- int swap=0;
+ luaL_checkstack(L,F->nresults+1,"too many results to unpack");
  lua_pushnil(L);
- while (*f)
+ for (; op<e; op++)
  {
-  int c=*f++;
-  int N=1;
-  if (isdigit(*f))
-  {
-   N=0;
-   while (isdigit(*f)) N=10*N+(*f++)-'0';
-   if (N==0 && c==OP_STRING) { lua_pushliteral(L,""); ++n; }
-  }
-  while (N--) switch (c)
+  size_t N;
+  switch (op->code)
   {
-   case OP_LITTLEENDIAN:
-   case OP_BIGENDIAN:
-   case OP_NATIVE:
-   {
-    swap=doendian(c);
-    N=0;
-    break;
-   }
    case OP_STRING:
    {
-    ++N;
-    if (i+N>len) goto done;
+    N=op->count;
+    if (N>0 && i+N>len) goto done;
     lua_pushlstring(L,s+i,N);
     i+=N;
     ++n;
-    N=0;
     break;
    }
    case OP_ZSTRING:
    {
-    size_t l;
-    if (i>=len) goto done;
-    l=strlen(s+i);
-    lua_pushlstring(L,s+i,l);
-    i+=l+1;
-    ++n;
+    for (N=op->count; N--; )
+    {
+     size_t l;
+     const char *z;
+     if (i>=len) goto done;
+     /* s may be a buffer, which has no NUL after its end */
+     z=memchr(s+i,0,len-i);
+     if (z==NULL) goto done;
+     l=z-(s+i);
+     lua_pushlstring(L,s+i,l);
+     i+=l+1;
+     ++n;
+    }
     break;
    }
    UNPACKSTRING(OP_BSTRING, unsigned char)
@@ -166,15 +487,33 @@ static int l_unpack(lua_State *L) 		/** unpack(s,f,[init]) */
    UNPACKNUMBER(OP_UINT, unsigned int)
    UNPACKNUMBER(OP_LONG, long)
    UNPACKNUMBER(OP_ULONG, unsigned long)
-   case ' ': case ',':
-    break;
-   default:
-    badcode(L,c);
+   UNPACKINT(OP_INT8, int8_t)
+   UNPACKINT(OP_UINT8, uint8_t)
+   UNPACKINT(OP_INT16, int16_t)
+   UNPACKINT(OP_UINT16, uint16_t)
+   UNPACKINT(OP_INT32, int32_t)
+   UNPACKINT(OP_UINT32, uint32_t)
+   UNPACKINT(OP_INT64, int64_t)
+   UNPACKINT(OP_UINT64, uint64_t)
+   case OP_VARINT:
+   case OP_ZIGZAG:
+   {
+    for (N=op->count; N--; )
+    {
+     uint64_t v;
+     if (!unpackvarint(s,len,&i,&v)) goto done;
+     if (op->code==OP_ZIGZAG)
+      lpack_pushint(L,(int64_t)(v>>1)^-(int64_t)(v&1));
+     else
+      lpack_pushint(L,v);
+     ++n;
+    }
     break;
+   }
   }
  }
 done:
- lua_pushnumber(L,i+1);
+ lua_pushnumber(L,(lua_Number)(i+1));
  lua_replace(L,-n-2);
  return n+1;
 }
@@ -182,56 +521,98 @@ done:
 #define PACKNUMBER(OP,T)			\
    case OP:					\
    {						\
-    T a=(T)luaL_checknumber(L,i++);		\
-    doswap(swap,&a,sizeof(a));			\
-    luaL_addlstring(&b,(void*)&a,sizeof(a));	\
+    for (N=op->count; N--; )			\
+    {						\
+     T a=(T)luaL_checknumber(L,i++);		\
+     memcpy(p,&a,sizeof(a));			\
+     if (op->swap) doswap(p,sizeof(a));		\
+     p+=sizeof(a);				\
+    }						\
     break;					\
    }
 
 #define PACKSTRING(OP,T)			\
    case OP:					\
    {						\
-    size_t l;					\
-    const char *a=luaL_checklstring(L,i++,&l);	\
-    T ll=(T)l;					\
-    doswap(swap,&ll,sizeof(ll));		\
-    luaL_addlstring(&b,(void*)&ll,sizeof(ll));	\
-    luaL_addlstring(&b,a,l);			\
+    for (N=op->count; N--; )			\
+    {						\
+     size_t l;					\
+     const char *a=lua_tolstring(L,i++,&l);	\
+     T ll=(T)l;					\
+     memcpy(p,&ll,sizeof(ll));			\
+     if (op->swap) doswap(p,sizeof(ll));	\
+     p+=sizeof(ll);				\
+     memcpy(p,a,l);				\
+     p+=l;					\
+    }						\
     break;					\
    }
 
-static int l_pack(lua_State *L) 		/** pack(f,...) */
+#define PACKINT(OP,T)				\
+   case OP:					\
+   {						\
+    for (N=op->count; N--; )			\
+    {						\
+     T a=(T)lpack_checkint(L,i++);		\
+     memcpy(p,&a,sizeof(a));			\
+     if (op->swap) doswap(p,sizeof(a));		\
+     p+=sizeof(a);				\
+    }						\
+    break;					\
+   }
+
+/* most bytes that packto will write for the arguments from arg on */
+static size_t packsize(lua_State *L, const lpack_Format *F, int arg)
 {
- int i=2;
- const char *f=luaL_checkstring(L,1);
- int swap=0;
- luaL_Buffer b;
- luaL_buffinit(L,&b);
- while (*f)
+ const lpack_Op *op=F->op;
+ const lpack_Op *e=op+F->nops;
+ size_t size=F->fixed;
+ int i=arg;
+ if (!F->strings) return size;
+ for (; op<e; op++)
  {
-  int c=*f++;
-  int N=1;
-  if (isdigit(*f)) 
+  size_t N;
+  switch (op->code)
   {
-   N=0;
-   while (isdigit(*f)) N=10*N+(*f++)-'0';
+   case OP_STRING: case OP_ZSTRING:
+   case OP_BSTRING: case OP_WSTRING: case OP_SSTRING:
+    for (N=op->count; N--; )
+    {
+     size_t l;
+     luaL_checklstring(L,i++,&l);
+     size+=l+(op->code==OP_ZSTRING);
+    }
+    break;
+   default:
+    i+=(int)op->count;
+    break;
   }
-  while (N--) switch (c)
+ }
+ return size;
+}
+
+/* write the arguments from arg on at p, which has room for packsize bytes */
+static char *packto(lua_State *L, const lpack_Format *F, int arg, char *p)
+{
+ const lpack_Op *op=F->op;
+ const lpack_Op *e=op+F->nops;
+ int i=arg;
+ for (; op<e; op++)
+ {
+  size_t N;
+  switch (op->code)
   {
-   case OP_LITTLEENDIAN:
-   case OP_BIGENDIAN:
-   case OP_NATIVE:
-   {
-    swap=doendian(c);
-    N=0;
-    break;
-   }
    case OP_STRING:
    case OP_ZSTRING:
    {
-    size_t l;
-    const char *a=luaL_checklstring(L,i++,&l);
-    luaL_addlstring(&b,a,l+(c==OP_ZSTRING));
+    for (N=op->count; N--; )
+    {
+     size_t l;
+     const char *a=lua_tolstring(L,i++,&l);
+     l+=(op->code==OP_ZSTRING);
+     memcpy(p,a,l);
+     p+=l;
+    }
     break;
    }
    PACKSTRING(OP_BSTRING, unsigned char)
@@ -248,22 +629,179 @@ static int l_pack(lua_State *L) 		/** pack(f,...) */
    PACKNUMBER(OP_UINT, unsigned int)
    PACKNUMBER(OP_LONG, long)
    PACKNUMBER(OP_ULONG, unsigned long)
-   case ' ': case ',':
+   PACKINT(OP_INT8, int8_t)
+   PACKINT(OP_UINT8, uint8_t)
+   PACKINT(OP_INT16, int16_t)
+   PACKINT(OP_UINT16, uint16_t)
+   PACKINT(OP_INT32, int32_t)
+   PACKINT(OP_UINT32, uint32_t)
+   PACKINT(OP_INT64, int64_t)
+   PACKINT(OP_UINT64, uint64_t)
+   case OP_VARINT:
+    for (N=op->count; N--; )
+     p=packvarint(p,(uint64_t)lpack_checkint(L,i++));
     break;
-   default:
-    badcode(L,c);
+   case OP_ZIGZAG:
+    for (N=op->count; N--; )
+    {
+     int64_t v=lpack_checkint(L,i++);
+     p=packvarint(p,((uint64_t)v<<1)^(uint64_t)(v>>63));
+    }
     break;
   }
  }
- luaL_pushresult(&b);
+ return p;
+}
+
+static int pack(lua_State *L, const lpack_Format *F, int arg)
+{
+ size_t size=packsize(L,F,arg);
+ char *p;
+#if LUA_VERSION_NUM >= 502
+ luaL_Buffer b;
+ p=luaL_buffinitsize(L,&b,size);
+ luaL_pushresultsize(&b,packto(L,F,arg,p)-p);
+#else
+ p=(char*)lua_newuserdata(L,size);
+ lua_pushlstring(L,p,packto(L,F,arg,p)-p);
+#endif
+ return 1;
+}
+
+/* pack the arguments from arg on into buffer B at offset o (1-based) */
+static int packinto(lua_State *L, const lpack_Format *F, lpack_Buffer *B, int oarg, int arg)
+{
+ size_t o=(size_t)luaL_optnumber(L,oarg,(lua_Number)(B->len+1));
+ size_t size=packsize(L,F,arg);
+ char *p;
+ luaL_argcheck(L,o>=1 && o<=B->len+1,oarg,"offset out of range");
+ o--;
+ if (o+size>B->cap)
+ {
+  size_t cap=B->cap>0 ? B->cap : 64;
+  char *data;
+  while (cap<o+size) cap*=2;
+  data=(char*)realloc(B->data,cap);
+  if (data==NULL) return luaL_error(L,"not enough memory");
+  B->data=data;
+  B->cap=cap;
+ }
+ p=packto(L,F,arg,B->data+o);
+ o=(size_t)(p-B->data);
+ if (o>B->len) B->len=o;
+ lua_pushnumber(L,(lua_Number)(o+1));
  return 1;
 }
 
-static int l_crc32(lua_State *L)
+static int l_unpack(lua_State *L) 		/** unpack(s,f,[init]) */
+{
+ return unpack(L,cachedformat(L,2),1,3);
+}
+
+static int l_pack(lua_State *L) 		/** pack(f,...) */
+{
+ return pack(L,cachedformat(L,1),2);
+}
+
+static int l_pack_into(lua_State *L)		/** pack_into(b,o,f,...) */
+{
+ lpack_Buffer *B=(lpack_Buffer*)luaL_checkudata(L,1,LPACK_BUFFER);
+ const lpack_Format *F=(const lpack_Format*)testudata(L,3,LPACK_FORMAT);
+ return packinto(L,F!=NULL ? F : cachedformat(L,3),B,2,4);
+}
+
+static int l_buffer(lua_State *L)		/** buffer([size]) */
+{
+ size_t cap=(size_t)luaL_optnumber(L,1,0);
+ lpack_Buffer *B=(lpack_Buffer*)lua_newuserdata(L,sizeof(lpack_Buffer));
+ B->len=0;
+ B->cap=0;
+ B->data=NULL;
+ luaL_getmetatable(L,LPACK_BUFFER);
+ lua_setmetatable(L,-2);
+ if (cap>0)
+ {
+  B->data=(char*)malloc(cap);
+  if (B->data==NULL) return luaL_error(L,"not enough memory");
+  B->cap=cap;
+ }
+ return 1;
+}
+
+static int b_tostring(lua_State *L)		/** buffer:tostring([i,[j]]) */
+{
+ lpack_Buffer *B=(lpack_Buffer*)luaL_checkudata(L,1,LPACK_BUFFER);
+ lua_Number i=luaL_optnumber(L,2,1);
+ lua_Number j=luaL_optnumber(L,3,(lua_Number)B->len);
+ if (i<1) i=1;
+ if (j>(lua_Number)B->len) j=(lua_Number)B->len;
+ if (i>j)
+  lua_pushliteral(L,"");
+ else
+  lua_pushlstring(L,B->data+(size_t)i-1,(size_t)(j-i)+1);
+ return 1;
+}
+
+static int b_len(lua_State *L)
+{
+ lpack_Buffer *B=(lpack_Buffer*)luaL_checkudata(L,1,LPACK_BUFFER);
+ lua_pushnumber(L,(lua_Number)B->len);
+ return 1;
+}
+
+static int b_reset(lua_State *L)		/** buffer:reset() */
+{
+ lpack_Buffer *B=(lpack_Buffer*)luaL_checkudata(L,1,LPACK_BUFFER);
+ B->len=0;
+ return 0;
+}
+
+static int b_gc(lua_State *L)
+{
+ lpack_Buffer *B=(lpack_Buffer*)luaL_checkudata(L,1,LPACK_BUFFER);
+ free(B->data);
+ B->data=NULL;
+ B->len=B->cap=0;
+ return 0;
+}
+
+static int l_compile(lua_State *L)		/** compile(f) */
+{
+ size_t flen;
+ const char *f=luaL_checklstring(L,1,&flen);
+ lpack_Format *F=(lpack_Format*)lua_newuserdata(L,formatsize(flen));
+ int c=compile(f,flen,F);
+ if (c!=0) badcode(L,1,c);
+ luaL_getmetatable(L,LPACK_FORMAT);
+ lua_setmetatable(L,-2);
+ return 1;
+}
+
+static int f_unpack(lua_State *L)		/** format:unpack(s,[init]) */
+{
+ return unpack(L,(const lpack_Format*)luaL_checkudata(L,1,LPACK_FORMAT),2,3);
+}
+
+static int f_pack(lua_State *L)		/** format:pack(...) */
+{
+ return pack(L,(const lpack_Format*)luaL_checkudata(L,1,LPACK_FORMAT),2);
+}
+
+static int f_pack_into(lua_State *L)		/** format:pack_into(b,o,...) */
+{
+ const lpack_Format *F=(const lpack_Format*)luaL_checkudata(L,1,LPACK_FORMAT);
+ return packinto(L,F,(lpack_Buffer*)luaL_checkudata(L,2,LPACK_BUFFER),3,4);
+}
+
+static int f_tostring(lua_State *L)
+{
+ const lpack_Format *F=(const lpack_Format*)luaL_checkudata(L,1,LPACK_FORMAT);
+ lua_pushfstring(L,LPACK_FORMAT ": %s",F->f);
+ return 1;
+}
+
+static int pushcrc(lua_State *L, uint32_t crc)
 {
-	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
-	uint32_t crc = CalcCRC(str, len);
 #if LUA_VERSION_NUM < 502
 	lua_pushnumber(L, (lua_Number)crc);
 #else
@@ -272,6 +810,27 @@ static int l_crc32(lua_State *L)
 	return 1;
 }
 
+static int l_crc32(lua_State *L)		/** crc32(s) */
+{
+	size_t len;
+	const char *str = checkbytes(L, 1, &len);
+	return pushcrc(L, CalcCRC(str, len));
+}
+
+static int l_crc32_update(lua_State *L)		/** crc32_update(s,[prev]) */
+{
+	size_t len;
+	const char *str = checkbytes(L, 1, &len);
+	return pushcrc(L, CalcCRC32((uint32_t)luaL_optnumber(L, 2, 0), str, len));
+}
+
+static int l_crc32c(lua_State *L)		/** crc32c(s,[prev]) */
+{
+	size_t len;
+	const char *str = checkbytes(L, 1, &len);
+	return pushcrc(L, CalcCRC32C((uint32_t)luaL_optnumber(L, 2, 0), str, len));
+}
+
 static int l_current_procid(lua_State *L) {
 #ifdef _WIN32
 	DWORD procid = GetCurrentProcessId();
@@ -289,16 +848,76 @@ static int l_current_procid(lua_State *L) {
 
 static const luaL_Reg R[] =
 {
-	{"pack",	l_pack},
-	{"unpack",	l_unpack},
+	{"compile",	l_compile},
+	{"buffer",	l_buffer},
 	{"crc32",	l_crc32 },
+	{"crc32_update",	l_crc32_update },
+	{"crc32c",	l_crc32c },
 	{"current_procid",	l_current_procid },
 	{NULL,	NULL}
 };
 
+static const luaL_Reg F[] =
+{
+	{"pack",	f_pack},
+	{"unpack",	f_unpack},
+	{"pack_into",	f_pack_into},
+	{"__tostring",	f_tostring},
+	{NULL,	NULL}
+};
+
+static const luaL_Reg B[] =
+{
+	{"tostring",	b_tostring},
+	{"reset",	b_reset},
+	{"__tostring",	b_tostring},
+	{"__len",	b_len},
+	{"__gc",	b_gc},
+	{NULL,	NULL}
+};
+
+/* pack, unpack and pack_into share one format cache as their upvalue */
+static void setcached(lua_State *L)
+{
+	lpack_Cache *C = (lpack_Cache*)lua_newuserdata(L, sizeof(lpack_Cache));
+	memset(C, 0, sizeof(lpack_Cache));
+	lua_newtable(L);
+	lua_pushcfunction(L, cache_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, l_pack, 1);
+	lua_setfield(L, -3, "pack");
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, l_unpack, 1);
+	lua_setfield(L, -3, "unpack");
+	lua_pushcclosure(L, l_pack_into, 1);
+	lua_setfield(L, -2, "pack_into");
+}
+
 LUALIB_API int
 luaopen_lpack(lua_State *L)
 {
+	InitCRC();
+	luaL_newmetatable(L, LPACK_FORMAT);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+	luaL_register(L, NULL, F);
+#else
+	luaL_setfuncs(L, F, 0);
+#endif
+	lua_pop(L, 1);
+	luaL_newmetatable(L, LPACK_BUFFER);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+	luaL_register(L, NULL, B);
+#else
+	luaL_setfuncs(L, B, 0);
+#endif
+	lua_pop(L, 1);
+
 #if LUA_VERSION_NUM < 502
 /*#ifdef USE_GLOBALS
  lua_register(L,"bpack",l_pack);
@@ -308,12 +927,14 @@ luaopen_lpack(lua_State *L)
  return 0;
 #endif */
 	luaL_register(L, "lpack", R);
+	setcached(L);
 	return 1;
 #else
 /* lua_getglobal(L, LUA_STRLIBNAME);
  luaL_setfuncs(L, R, 0);
  return 1; */
 	luaL_newlib(L, R);
+	setcached(L);
 	return 1;
 #endif
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 #include <lualib.h>
 #include <lauxlib.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -68,13 +69,105 @@ defined (BIT_ZERO_ON_LEFT) || defined(m68k) || defined(__sparc)
 #define checkiostring(L) \
     (IOString*) luaL_checkudata(L, 1, IOSTRING_META)
 
-#define IOSTRING_BUF_LEN 65535
+#define IOSTRING_INIT_LEN 256 /* inline buffer, used until the first growth */
+#define IOSTRING_KEEP_LEN 65536 /* clear() frees heap buffers larger than this */
 
 typedef struct {
 	size_t size;
-	char buf[IOSTRING_BUF_LEN];
+	size_t cap;
+	char* buf; /* init or a heap buffer */
+	char init[IOSTRING_INIT_LEN];
 } IOString;
 
+/* The IOString at idx, or NULL when it is something else (a write function). */
+static IOString* toiostring(lua_State *L, int idx) {
+	IOString* io = (IOString*)lua_touserdata(L, idx);
+	if (io != NULL && lua_getmetatable(L, idx)) {
+		luaL_getmetatable(L, IOSTRING_META);
+		if (!lua_rawequal(L, -1, -2)) {
+			io = NULL;
+		}
+		lua_pop(L, 2);
+		return io;
+	}
+	return NULL;
+}
+
+/* Make room for n more bytes, growing the buffer geometrically. */
+static char* iostring_reserve(lua_State *L, IOString *io, size_t n) {
+	if (io->size + n > io->cap) {
+		size_t cap = io->cap;
+		char* buf;
+		while (cap < io->size + n) {
+			if (cap > (size_t)-1 / 2) {
+				luaL_error(L, "Out of memory");
+			}
+			cap *= 2;
+		}
+		if (io->buf == io->init) {
+			buf = (char*)malloc(cap);
+			if (buf != NULL) {
+				memcpy(buf, io->init, io->size);
+			}
+		}
+		else {
+			buf = (char*)realloc(io->buf, cap);
+		}
+		if (buf == NULL) {
+			luaL_error(L, "Out of memory");
+		}
+		io->buf = buf;
+		io->cap = cap;
+	}
+	return io->buf + io->size;
+}
+
+static size_t encode_varint(char* p, uint64_t value) {
+	size_t n = 0;
+	while (value >= 0x80) {
+		p[n++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	p[n++] = (char)value;
+	return n;
+}
+
+static void iostring_add_varint(lua_State *L, IOString *io, uint64_t value) {
+	char* p = iostring_reserve(L, io, 10);
+	io->size += encode_varint(p, value);
+}
+
+static void iostring_add_fixed32(lua_State *L, IOString *io, uint8_t* value) {
+	char* p = iostring_reserve(L, io, 4);
+#ifdef IS_LITTLE_ENDIAN
+	memcpy(p, value, 4);
+#else
+	uint32_t v = htole32(*(uint32_t*)value);
+	memcpy(p, &v, 4);
+#endif
+	io->size += 4;
+}
+
+static void iostring_add_fixed64(lua_State *L, IOString *io, uint8_t* value) {
+	char* p = iostring_reserve(L, io, 8);
+#ifdef IS_LITTLE_ENDIAN
+	memcpy(p, value, 8);
+#else
+	uint64_t v = htole64(*(uint64_t*)value);
+	memcpy(p, &v, 8);
+#endif
+	io->size += 8;
+}
+
+static int64_t check_int64(lua_State *L, int idx) {
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, idx)) {
+		return (int64_t)lua_tointeger(L, idx);
+	}
+#endif
+	return (int64_t)luaL_checknumber(L, idx);
+}
+
 static void pack_varint(luaL_Buffer *b, uint64_t value) {
 	if (value >= 0x80) {
 
@@ -129,6 +222,12 @@ static int varint_encoder(lua_State *L) {
 	lua_Number l_value = luaL_checknumber(L, 2);
 	uint64_t value = (uint64_t)l_value;
 
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_varint(L, io, value);
+		return 0;
+	}
+
 	luaL_Buffer b;
 	luaL_buffinit(L, &b);
 
@@ -145,6 +244,12 @@ static int signed_varint_encoder(lua_State *L) {
 	lua_Number l_value = luaL_checknumber(L, 2);
 	int64_t value = (int64_t)l_value;
 
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_varint(L, io, (uint64_t)value);
+		return 0;
+	}
+
 	luaL_Buffer b;
 	luaL_buffinit(L, &b);
 
@@ -182,10 +287,59 @@ static int pack_fixed64(lua_State *L, uint8_t* value) {
 	return 0;
 }
 
+static void iostring_add_struct(lua_State *L, IOString *io, uint8_t format, lua_Number value) {
+
+	switch (format) {
+	case 'i': {
+		int32_t v = (int32_t)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'q': {
+		int64_t v = (int64_t)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'f': {
+		float v = (float)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'd': {
+		double v = (double)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	case 'I': {
+		uint32_t v = (uint32_t)value;
+		iostring_add_fixed32(L, io, (uint8_t*)&v);
+		break;
+	}
+	case 'Q': {
+		uint64_t v = (uint64_t)value;
+		iostring_add_fixed64(L, io, (uint8_t*)&v);
+		break;
+	}
+
+	default:
+		luaL_error(L, "Unknown, format");
+	}
+}
+
 static int struct_pack(lua_State *L) {
 
 	uint8_t format = luaL_checkinteger(L, 2);
 	lua_Number value = luaL_checknumber(L, 3);
+
+	IOString* io = toiostring(L, 1);
+	if (io != NULL) {
+		iostring_add_struct(L, io, format, value);
+		return 0;
+	}
 	lua_settop(L, 1);
 
 	switch (format) {
@@ -390,7 +544,7 @@ static int struct_unpack(lua_State *L) {
 #if LUA_VERSION_NUM < 502
 		lua_pushnumber(L, (lua_Number)*(int64_t*)unpack_fixed64(buffer, out));
 #else
-		lua_pushinteger(L, unpack_fixed64(buffer, out));
+		lua_pushinteger(L, *(int64_t*)unpack_fixed64(buffer, out));
 #endif
 		break;
 	}
@@ -409,7 +563,7 @@ static int struct_unpack(lua_State *L) {
 #if LUA_VERSION_NUM < 502
 		lua_pushnumber(L, *(uint32_t*)unpack_fixed32(buffer, out));
 #else
-		lua_pushinteger(L, unpack_fixed32(buffer, out));
+		lua_pushinteger(L, *(uint32_t*)unpack_fixed32(buffer, out));
 #endif
 		break;
 	}
@@ -418,7 +572,7 @@ static int struct_unpack(lua_State *L) {
 #if LUA_VERSION_NUM < 502
 		lua_pushnumber(L, (lua_Number)*(uint64_t*)unpack_fixed64(buffer, out));
 #else
-		lua_pushinteger(L, unpack_fixed64(buffer, out));
+		lua_pushinteger(L, *(uint64_t*)unpack_fixed64(buffer, out));
 #endif
 		break;
 	}
@@ -433,12 +587,26 @@ static int iostring_new(lua_State* L) {
 
 	IOString* io = (IOString*)lua_newuserdata(L, sizeof(IOString));
 	io->size = 0;
+	io->cap = IOSTRING_INIT_LEN;
+	io->buf = io->init;
 
 	luaL_getmetatable(L, IOSTRING_META);
 	lua_setmetatable(L, -2);
 	return 1;
 }
 
+static int iostring_gc(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	if (io->buf != io->init) {
+		free(io->buf);
+		io->buf = io->init;
+		io->cap = IOSTRING_INIT_LEN;
+	}
+	io->size = 0;
+	return 0;
+}
+
 static int iostring_str(lua_State* L) {
 
 	IOString *io = checkiostring(L);
@@ -458,14 +626,58 @@ static int iostring_write(lua_State* L) {
 	IOString *io = checkiostring(L);
 	size_t size;
 	const char* str = luaL_checklstring(L, 2, &size);
-	if (io->size + size > IOSTRING_BUF_LEN) {
-		luaL_error(L, "Out of range");
-	}
-	memcpy(io->buf + io->size, str, size);
+	memcpy(iostring_reserve(L, io, size), str, size);
 	io->size += size;
 	return 0;
 }
 
+static int iostring_write_varint(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	iostring_add_varint(L, io, (uint64_t)check_int64(L, 2));
+	return 0;
+}
+
+static int iostring_write_zigzag32(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	int32_t n = (int32_t)check_int64(L, 2);
+	iostring_add_varint(L, io, ((uint32_t)n << 1) ^ (uint32_t)(n >> 31));
+	return 0;
+}
+
+static int iostring_write_zigzag64(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	int64_t n = check_int64(L, 2);
+	iostring_add_varint(L, io, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+	return 0;
+}
+
+static int iostring_write_fixed32(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint32_t v = (uint32_t)check_int64(L, 2);
+	iostring_add_fixed32(L, io, (uint8_t*)&v);
+	return 0;
+}
+
+static int iostring_write_fixed64(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint64_t v = (uint64_t)check_int64(L, 2);
+	iostring_add_fixed64(L, io, (uint8_t*)&v);
+	return 0;
+}
+
+static int iostring_write_struct(lua_State* L) {
+
+	IOString *io = checkiostring(L);
+	uint8_t format = luaL_checkinteger(L, 2);
+	iostring_add_struct(L, io, format, luaL_checknumber(L, 3));
+	return 0;
+}
+
 static int iostring_sub(lua_State* L) {
 
 	IOString *io = checkiostring(L);
@@ -482,10 +694,598 @@ static int iostring_sub(lua_State* L) {
 static int iostring_clear(lua_State* L) {
 
 	IOString *io = checkiostring(L);
+	if (io->cap > IOSTRING_KEEP_LEN) {
+		free(io->buf);
+		io->buf = io->init;
+		io->cap = IOSTRING_INIT_LEN;
+	}
 	io->size = 0;
 	return 0;
 }
 
+/* Whole-message decoder.
+ *
+ * A field table maps a field number to { key, type, repeated, fields }, where
+ * type is a FieldDescriptor.TYPE_* value and fields is the field table of a
+ * nested message. protobuf.lua compiles it from the generated descriptors.
+ */
+
+#define PB_TYPE_DOUBLE 1
+#define PB_TYPE_FLOAT 2
+#define PB_TYPE_INT64 3
+#define PB_TYPE_UINT64 4
+#define PB_TYPE_INT32 5
+#define PB_TYPE_FIXED64 6
+#define PB_TYPE_FIXED32 7
+#define PB_TYPE_BOOL 8
+#define PB_TYPE_STRING 9
+#define PB_TYPE_GROUP 10
+#define PB_TYPE_MESSAGE 11
+#define PB_TYPE_BYTES 12
+#define PB_TYPE_UINT32 13
+#define PB_TYPE_ENUM 14
+#define PB_TYPE_SFIXED32 15
+#define PB_TYPE_SFIXED64 16
+#define PB_TYPE_SINT32 17
+#define PB_TYPE_SINT64 18
+
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_FIXED64 1
+#define PB_WIRE_BYTES 2
+#define PB_WIRE_START_GROUP 3
+#define PB_WIRE_END_GROUP 4
+#define PB_WIRE_FIXED32 5
+
+#define PB_DECODE_DEPTH_MAX 64
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
+typedef struct {
+	const uint8_t* p;
+	const uint8_t* end;
+} pb_Slice;
+
+static int pb_wiretype(int type) {
+	switch (type) {
+	case PB_TYPE_DOUBLE: case PB_TYPE_FIXED64: case PB_TYPE_SFIXED64:
+		return PB_WIRE_FIXED64;
+	case PB_TYPE_FLOAT: case PB_TYPE_FIXED32: case PB_TYPE_SFIXED32:
+		return PB_WIRE_FIXED32;
+	case PB_TYPE_STRING: case PB_TYPE_MESSAGE: case PB_TYPE_BYTES:
+		return PB_WIRE_BYTES;
+	case PB_TYPE_GROUP:
+		return PB_WIRE_START_GROUP;
+	default:
+		return PB_WIRE_VARINT;
+	}
+}
+
+/* Returns 0 when the varint is truncated or longer than 10 bytes. */
+static int pb_readvarint(pb_Slice* s, uint64_t* value) {
+	const uint8_t* p = s->p;
+	uint64_t v = 0;
+	int shift;
+	if (p < s->end && *p < 0x80) {
+		*value = *p;
+		s->p = p + 1;
+		return 1;
+	}
+	for (shift = 0; shift < 70 && p < s->end; shift += 7) {
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (b < 0x80) {
+			*value = v;
+			s->p = p;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int pb_readfixed32(pb_Slice* s, uint32_t* value) {
+	const uint8_t* p = s->p;
+	if (s->end - p < 4) {
+		return 0;
+	}
+	*value = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+	s->p = p + 4;
+	return 1;
+}
+
+static int pb_readfixed64(pb_Slice* s, uint64_t* value) {
+	uint32_t lo = 0, hi = 0;
+	if (s->end - s->p < 8) {
+		return 0;
+	}
+	pb_readfixed32(s, &lo);
+	pb_readfixed32(s, &hi);
+	*value = (uint64_t)hi << 32 | lo;
+	return 1;
+}
+
+static int pb_readbytes(pb_Slice* s, pb_Slice* bytes) {
+	uint64_t len;
+	if (!pb_readvarint(s, &len) || len > (uint64_t)(s->end - s->p)) {
+		return 0;
+	}
+	bytes->p = s->p;
+	bytes->end = s->p + len;
+	s->p = bytes->end;
+	return 1;
+}
+
+static void pb_pushint64(lua_State *L, int64_t value) {
+#if LUA_VERSION_NUM < 503
+	lua_pushnumber(L, (lua_Number)value);
+#else
+	lua_pushinteger(L, (lua_Integer)value);
+#endif
+}
+
+static void pb_decode_error(lua_State *L, const pb_Slice* s, const uint8_t* begin) {
+	luaL_error(L, "error data at pos:%d", (int)(s->p - begin));
+}
+
+/* Skip a field of the given wire type, groups included. */
+static int pb_skipfield(pb_Slice* s, int wiretype, int depth) {
+	uint64_t v;
+	pb_Slice bytes;
+	switch (wiretype) {
+	case PB_WIRE_VARINT:
+		return pb_readvarint(s, &v);
+	case PB_WIRE_FIXED64:
+		return pb_readfixed64(s, &v);
+	case PB_WIRE_BYTES:
+		return pb_readbytes(s, &bytes);
+	case PB_WIRE_FIXED32:
+		if (s->end - s->p < 4) {
+			return 0;
+		}
+		s->p += 4;
+		return 1;
+	case PB_WIRE_START_GROUP:
+		if (depth >= PB_DECODE_DEPTH_MAX) {
+			return 0;
+		}
+		while (pb_readvarint(s, &v)) {
+			if ((v & 7) == PB_WIRE_END_GROUP) {
+				return 1;
+			}
+			if (!pb_skipfield(s, (int)(v & 7), depth + 1)) {
+				return 0;
+			}
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/* Read one value of a scalar type and push it. Returns 0 on truncated data. */
+static int pb_pushscalar(lua_State *L, int type, pb_Slice* s) {
+	uint64_t v;
+	uint32_t v32;
+	switch (type) {
+	case PB_TYPE_INT64: case PB_TYPE_UINT64:
+		if (!pb_readvarint(s, &v)) return 0;
+		pb_pushint64(L, (int64_t)v);
+		break;
+	case PB_TYPE_INT32: case PB_TYPE_ENUM:
+		if (!pb_readvarint(s, &v)) return 0;
+		lua_pushinteger(L, (int32_t)v);
+		break;
+	case PB_TYPE_UINT32:
+		if (!pb_readvarint(s, &v)) return 0;
+		pb_pushint64(L, (uint32_t)v);
+		break;
+	case PB_TYPE_BOOL:
+		if (!pb_readvarint(s, &v)) return 0;
+		lua_pushboolean(L, v != 0);
+		break;
+	case PB_TYPE_SINT32:
+		if (!pb_readvarint(s, &v)) return 0;
+		v32 = (uint32_t)v;
+		lua_pushinteger(L, (int32_t)((v32 >> 1) ^ -(int32_t)(v32 & 1)));
+		break;
+	case PB_TYPE_SINT64:
+		if (!pb_readvarint(s, &v)) return 0;
+		pb_pushint64(L, (int64_t)((v >> 1) ^ -(int64_t)(v & 1)));
+		break;
+	case PB_TYPE_FIXED32:
+		if (!pb_readfixed32(s, &v32)) return 0;
+		pb_pushint64(L, v32);
+		break;
+	case PB_TYPE_SFIXED32:
+		if (!pb_readfixed32(s, &v32)) return 0;
+		lua_pushinteger(L, (int32_t)v32);
+		break;
+	case PB_TYPE_FLOAT: {
+		float f;
+		if (!pb_readfixed32(s, &v32)) return 0;
+		memcpy(&f, &v32, 4);
+		lua_pushnumber(L, (lua_Number)f);
+		break;
+	}
+	case PB_TYPE_FIXED64: case PB_TYPE_SFIXED64:
+		if (!pb_readfixed64(s, &v)) return 0;
+		pb_pushint64(L, (int64_t)v);
+		break;
+	case PB_TYPE_DOUBLE: {
+		double d;
+		if (!pb_readfixed64(s, &v)) return 0;
+		memcpy(&d, &v, 8);
+		lua_pushnumber(L, (lua_Number)d);
+		break;
+	}
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/* Push the array stored at key in the table at target, creating it if needed. */
+static void pb_getarray(lua_State *L, int target, int key) {
+	lua_pushvalue(L, key);
+	lua_rawget(L, target);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, key);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, target);
+	}
+}
+
+/* Decode s into the table on top of the stack, using the field table at fields.
+ * Like the Lua decoder, a zero tag stops the whole decoding, then it returns 1. */
+static int pb_decode(lua_State *L, int fields, pb_Slice* s, const uint8_t* begin, int depth) {
+	int target = lua_gettop(L);
+	uint64_t tag;
+	if (depth > PB_DECODE_DEPTH_MAX) {
+		luaL_error(L, "message nested too deep");
+	}
+	luaL_checkstack(L, 8, NULL);
+	while (s->p < s->end) {
+		int wiretype, type, repeated, spec;
+		int stop = 0;
+		if (!pb_readvarint(s, &tag)) {
+			pb_decode_error(L, s, begin);
+		}
+		if (tag == 0) {
+			return 1;
+		}
+		wiretype = (int)(tag & 7);
+		if ((tag >> 3) == 0 || (tag >> 3) > 0x1fffffff) {
+			pb_decode_error(L, s, begin);
+		}
+		lua_rawgeti(L, fields, (int)(tag >> 3));
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			if (!pb_skipfield(s, wiretype, depth)) {
+				pb_decode_error(L, s, begin);
+			}
+			continue;
+		}
+		spec = lua_gettop(L);
+		lua_rawgeti(L, spec, 1); /* key */
+		lua_rawgeti(L, spec, 2);
+		type = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_rawgeti(L, spec, 3);
+		repeated = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		if (wiretype == pb_wiretype(type) && wiretype != PB_WIRE_START_GROUP) {
+			if (type == PB_TYPE_MESSAGE) {
+				pb_Slice sub = { NULL, NULL };
+				if (!pb_readbytes(s, &sub)) {
+					pb_decode_error(L, s, begin);
+				}
+				lua_rawgeti(L, spec, 4);
+				if (!lua_istable(L, -1)) {
+					luaL_error(L, "no fields for message field %d", (int)(tag >> 3));
+				}
+				if (repeated) {
+					pb_getarray(L, target, spec + 1);
+					lua_newtable(L);
+					stop = pb_decode(L, spec + 2, &sub, begin, depth + 1);
+					if (stop) {
+						s->p = sub.p;
+					}
+					lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+					lua_pop(L, 1);
+				}
+				else {
+					/* merge into a message already read */
+					lua_pushvalue(L, spec + 1);
+					lua_rawget(L, target);
+					if (!lua_istable(L, -1)) {
+						lua_pop(L, 1);
+						lua_newtable(L);
+						lua_pushvalue(L, spec + 1);
+						lua_pushvalue(L, -2);
+						lua_rawset(L, target);
+					}
+					stop = pb_decode(L, spec + 2, &sub, begin, depth + 1);
+					if (stop) {
+						s->p = sub.p;
+					}
+				}
+			}
+			else if (type == PB_TYPE_STRING || type == PB_TYPE_BYTES) {
+				pb_Slice sub = { NULL, NULL };
+				if (!pb_readbytes(s, &sub)) {
+					pb_decode_error(L, s, begin);
+				}
+				if (repeated) {
+					pb_getarray(L, target, spec + 1);
+					lua_pushlstring(L, (const char*)sub.p, sub.end - sub.p);
+					lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+				}
+				else {
+					lua_pushvalue(L, spec + 1);
+					lua_pushlstring(L, (const char*)sub.p, sub.end - sub.p);
+					lua_rawset(L, target);
+				}
+			}
+			else if (repeated) {
+				pb_getarray(L, target, spec + 1);
+				if (!pb_pushscalar(L, type, s)) {
+					pb_decode_error(L, s, begin);
+				}
+				lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+			}
+			else {
+				lua_pushvalue(L, spec + 1);
+				if (!pb_pushscalar(L, type, s)) {
+					pb_decode_error(L, s, begin);
+				}
+				lua_rawset(L, target);
+			}
+		}
+		else if (wiretype == PB_WIRE_BYTES && repeated && pb_wiretype(type) != PB_WIRE_BYTES
+			&& type != PB_TYPE_GROUP) {
+			/* packed repeated scalars */
+			pb_Slice sub = { NULL, NULL };
+			int n;
+			if (!pb_readbytes(s, &sub)) {
+				pb_decode_error(L, s, begin);
+			}
+			pb_getarray(L, target, spec + 1);
+			n = (int)lua_rawlen(L, -1);
+			while (sub.p < sub.end) {
+				if (!pb_pushscalar(L, type, &sub)) {
+					pb_decode_error(L, &sub, begin);
+				}
+				lua_rawseti(L, -2, ++n);
+			}
+		}
+		else if (!pb_skipfield(s, wiretype, depth)) {
+			pb_decode_error(L, s, begin);
+		}
+		lua_settop(L, target);
+		if (stop) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* decode_message(fields, buffer [, pos [, pend [, target]]]) -> target, end position
+ * pos is 0-based as in the other decoders, target defaults to a new table. */
+static int decode_message(lua_State *L) {
+
+	size_t len;
+	const uint8_t* buffer;
+	size_t pos, pend;
+	pb_Slice s;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	buffer = (const uint8_t*)luaL_checklstring(L, 2, &len);
+	pos = (size_t)luaL_optinteger(L, 3, 0);
+	pend = (size_t)luaL_optinteger(L, 4, len);
+	if (pos > pend || pend > len) {
+		luaL_error(L, "Out of range");
+	}
+	if (lua_isnoneornil(L, 5)) {
+		lua_settop(L, 4);
+		lua_newtable(L);
+	}
+	else {
+		luaL_checktype(L, 5, LUA_TTABLE);
+		lua_settop(L, 5);
+	}
+	s.p = buffer + pos;
+	s.end = buffer + pend;
+	pb_decode(L, 1, &s, buffer, 0);
+	lua_pushinteger(L, (lua_Integer)(s.p - buffer));
+	return 2;
+}
+
+/* Bulk decoders.
+ *
+ * xxx_decoder_n(buffer, pos, n, target [, first [, pend]]) -> end position, count
+ * decode up to n values (all of them when n < 0) that lie before pend
+ * (default #buffer) into target[first], target[first + 1], ... (first
+ * defaults to #target + 1). This is one call per packed field instead of
+ * one call per element.
+ */
+
+#define PB_BULK_VARINT 0
+#define PB_BULK_SIGNED 1
+#define PB_BULK_ZIGZAG 2
+
+/* Decode varints from s into out, stopping at n values or a varint that
+ * cannot be read here. Runs of one byte varints are found 8 bytes at a time. */
+static size_t pb_readvarints(pb_Slice* s, uint64_t* out, size_t n) {
+	const uint8_t* p = s->p;
+	const uint8_t* end = s->end;
+	size_t i = 0;
+	while (i < n) {
+		if (end - p >= 8 && n - i >= 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			if ((w & 0x8080808080808080ULL) == 0) {
+				int k;
+				for (k = 0; k < 8; ++k) {
+					out[i + k] = p[k];
+				}
+				i += 8;
+				p += 8;
+				continue;
+			}
+		}
+		if (end - p >= 2) {
+			if (p[0] < 0x80) {
+				out[i++] = p[0];
+				p += 1;
+				continue;
+			}
+			if (p[1] < 0x80) {
+				out[i++] = (uint64_t)(p[0] & 0x7f) | (uint64_t)p[1] << 7;
+				p += 2;
+				continue;
+			}
+		}
+		s->p = p;
+		if (!pb_readvarint(s, &out[i])) {
+			return i;
+		}
+		p = s->p;
+		++i;
+	}
+	s->p = p;
+	return i;
+}
+
+#define PB_BULK_CHUNK 64
+
+static int pb_check_bulk(lua_State *L, int arg, pb_Slice* s, size_t* n, lua_Integer* first) {
+	size_t len;
+	const uint8_t* buffer = (const uint8_t*)luaL_checklstring(L, arg, &len);
+	size_t pos = (size_t)luaL_checkinteger(L, arg + 1);
+	lua_Integer count = luaL_checkinteger(L, arg + 2);
+	size_t pend;
+	luaL_checktype(L, arg + 3, LUA_TTABLE);
+	*first = luaL_optinteger(L, arg + 4, (lua_Integer)lua_rawlen(L, arg + 3) + 1);
+	pend = (size_t)luaL_optinteger(L, arg + 5, len);
+	if (pos > pend || pend > len) {
+		luaL_error(L, "Out of range");
+	}
+	s->p = buffer + pos;
+	s->end = buffer + pend;
+	*n = count < 0 ? (size_t)-1 : (size_t)count;
+	return arg + 3;
+}
+
+static int pb_varints_decoder(lua_State *L, int kind) {
+	pb_Slice s;
+	size_t n, count = 0;
+	lua_Integer first;
+	const uint8_t* buffer = (const uint8_t*)lua_tostring(L, 1);
+	int target = pb_check_bulk(L, 1, &s, &n, &first);
+	uint64_t v[PB_BULK_CHUNK];
+	while (count < n && s.p < s.end) {
+		size_t want = n - count < PB_BULK_CHUNK ? n - count : PB_BULK_CHUNK;
+		size_t got = pb_readvarints(&s, v, want);
+		size_t i;
+		for (i = 0; i < got; ++i) {
+			switch (kind) {
+			case PB_BULK_ZIGZAG:
+				pb_pushint64(L, (int64_t)((v[i] >> 1) ^ -(int64_t)(v[i] & 1)));
+				break;
+			default:
+				pb_pushint64(L, (int64_t)v[i]);
+				break;
+			}
+			lua_rawseti(L, target, (int)(first + count + i));
+		}
+		count += got;
+		if (got < want) {
+			if (s.p < s.end) {
+				pb_decode_error(L, &s, buffer);
+			}
+			break;
+		}
+	}
+	lua_pushinteger(L, (lua_Integer)(s.p - buffer));
+	lua_pushinteger(L, (lua_Integer)count);
+	return 2;
+}
+
+static int varint_decoder_n(lua_State *L) {
+	return pb_varints_decoder(L, PB_BULK_VARINT);
+}
+
+static int signed_varint_decoder_n(lua_State *L) {
+	return pb_varints_decoder(L, PB_BULK_SIGNED);
+}
+
+static int zig_zag_decoder_n(lua_State *L) {
+	return pb_varints_decoder(L, PB_BULK_ZIGZAG);
+}
+
+/* struct_unpack_n(format, buffer, pos, n, target [, first [, pend]]), formats as struct_unpack */
+static int struct_unpack_n(lua_State *L) {
+	pb_Slice s;
+	size_t n, count = 0, size;
+	lua_Integer first;
+	uint8_t format = (uint8_t)luaL_checkinteger(L, 1);
+	const uint8_t* buffer = (const uint8_t*)lua_tostring(L, 2);
+	int target = pb_check_bulk(L, 2, &s, &n, &first);
+	switch (format) {
+	case 'i': case 'f': case 'I':
+		size = 4;
+		break;
+	case 'q': case 'd': case 'Q':
+		size = 8;
+		break;
+	default:
+		return luaL_error(L, "Unknown, format");
+	}
+	if (n > (size_t)(s.end - s.p) / size) {
+		n = (size_t)(s.end - s.p) / size;
+	}
+	for (; count < n; ++count) {
+		uint32_t v32 = 0;
+		uint64_t v64 = 0;
+		if (size == 4) {
+			pb_readfixed32(&s, &v32);
+		}
+		else {
+			pb_readfixed64(&s, &v64);
+		}
+		switch (format) {
+		case 'i':
+			lua_pushinteger(L, (int32_t)v32);
+			break;
+		case 'I':
+			pb_pushint64(L, v32);
+			break;
+		case 'f': {
+			float f;
+			memcpy(&f, &v32, 4);
+			lua_pushnumber(L, (lua_Number)f);
+			break;
+		}
+		case 'd': {
+			double d;
+			memcpy(&d, &v64, 8);
+			lua_pushnumber(L, (lua_Number)d);
+			break;
+		}
+		default:
+			pb_pushint64(L, (int64_t)v64);
+			break;
+		}
+		lua_rawseti(L, target, (int)(first + count));
+	}
+	lua_pushinteger(L, (lua_Integer)(s.p - buffer));
+	lua_pushinteger(L, (lua_Integer)count);
+	return 2;
+}
+
 static const struct luaL_Reg _pb[] = {
 	{ "varint_encoder", varint_encoder },
 	{ "signed_varint_encoder", signed_varint_encoder },
@@ -499,13 +1299,26 @@ static const struct luaL_Reg _pb[] = {
 	{ "zig_zag_decode64", zig_zag_decode64 },
 	{ "zig_zag_encode64", zig_zag_encode64 },
 	{ "new_iostring", iostring_new },
+	{ "decode_message", decode_message },
+	{ "varint_decoder_n", varint_decoder_n },
+	{ "signed_varint_decoder_n", signed_varint_decoder_n },
+	{ "zig_zag_decoder_n", zig_zag_decoder_n },
+	{ "struct_unpack_n", struct_unpack_n },
 	{ NULL, NULL }
 };
 
 static const struct luaL_Reg _c_iostring_m[] = {
 	{ "__tostring", iostring_str },
 	{ "__len", iostring_len },
+	{ "__gc", iostring_gc },
+	{ "__call", iostring_write },
 	{ "write", iostring_write },
+	{ "write_varint", iostring_write_varint },
+	{ "write_zigzag32", iostring_write_zigzag32 },
+	{ "write_zigzag64", iostring_write_zigzag64 },
+	{ "write_fixed32", iostring_write_fixed32 },
+	{ "write_fixed64", iostring_write_fixed64 },
+	{ "write_struct", iostring_write_struct },
 	{ "sub", iostring_sub },
 	{ "clear", iostring_clear },
 	{ NULL, NULL }